@@ -28,6 +28,8 @@
 
 #include <itkCorrelationCoefficientHistogramImageToImageMetric.h>
 
+#include <algorithm>
+
 
 /**
 \brief Get the itk::Image
@@ -72,27 +74,64 @@ void segmentationFilter(typename TImageType::Pointer image, const std::string &o
   filter->SetInput(image);
 
   filter->SetReplaceValue(1000);
-  filter->SetLower(1100);
-  filter->SetUpper(2000);
-
-  typename TImageType::IndexType index;
-  // place a random seed point - values are in accordance with example data
-  index[0] = 90;
-  index[1] = 120;
-  index[2] = 67;
-
-  filter->AddSeed(index);
-  //filter->AddSeed(index);
-  filter->Update();
+  // the thresholds suit the example data; a pixel type which cannot hold any value between them gives an empty
+  // segmentation, as the same values read as float would
+  typedef typename TImageType::PixelType PixelType;
+  const double lower = 1100, upper = 2000;
+  const double lowest = static_cast<double>(itk::NumericTraits<PixelType>::NonpositiveMin());
+  const double highest = static_cast<double>(itk::NumericTraits<PixelType>::max());
+  OImageType::Pointer segmentation;
+  if ((upper < lowest) || (lower > highest))
+  {
+    segmentation = OImageType::New();
+    segmentation->CopyInformation(image);
+    segmentation->SetRegions(image->GetLargestPossibleRegion());
+    segmentation->Allocate();
+    segmentation->FillBuffer(0);
+  }
+  else
+  {
+    // a partial overlap is clamped, which selects the same pixels
+    filter->SetLower(static_cast<PixelType>(std::max(lower, lowest)));
+    filter->SetUpper(static_cast<PixelType>(std::min(upper, highest)));
+
+    typename TImageType::IndexType index;
+    // place a random seed point - values are in accordance with example data
+    index[0] = 90;
+    index[1] = 120;
+    index[2] = 67;
+
+    filter->AddSeed(index);
+    //filter->AddSeed(index);
+    filter->Update();
+    segmentation = filter->GetOutput();
+  }
 
   typedef itk::ImageFileWriter<OImageType> WriterType;
   WriterType::Pointer writer = WriterType::New();
   writer->SetFileName(outputFileName);
 
-  writer->SetInput(filter->GetOutput());
+  writer->SetInput(segmentation);
   writer->Update();
 }
 
+/**
+\brief Read the image with pixel type TPixelType and segment it
+
+\param inputFileName File name of the input image
+\param outputFileName File name of output
+*/
+template <typename TPixelType>
+void runSegmentation(const std::string &inputFileName, const std::string &outputFileName)
+{
+  typedef itk::Image<TPixelType, 3> ImageType; // define image type
+  typename ImageType::Pointer image_1 = ImageType::New(); // initialize new image
+  SafeReadImage<ImageType>(image_1, inputFileName); // read image along with exceptions
+
+  std::cout << "Doing connectivity segmentation...\n";
+  segmentationFilter<ImageType>(image_1, outputFileName);
+}
+
 void echoUsage(const std::string &exeName)
 {
   std::cout << exeName << " <inputImageFile> <outputFileName>\n" <<
@@ -128,13 +167,22 @@ int main(int argc, char *argv[])
       return EXIT_FAILURE;
     }
 
-    typedef float PixelType; // default pixel type is float, all voxel data is static-casted
-    typedef itk::Image<PixelType, 3> ImageType; // define image type
-    ImageType::Pointer image_1 = ImageType::New(); // initialize new image
-    SafeReadImage<ImageType>(image_1, im_base->GetFileName()); // read image along with exceptions
-    
-    std::cout << "Doing connectivity segmentation...\n";
-    segmentationFilter<ImageType>(image_1, outputFName);
+    // the image keeps its storage type, which saves the float copy of 8 and 16 bit data
+    switch (im_base->GetComponentType())
+    {
+    case itk::ImageIOBase::UCHAR:
+      runSegmentation<unsigned char>(im_base->GetFileName(), outputFName);
+      break;
+    case itk::ImageIOBase::USHORT:
+      runSegmentation<unsigned short>(im_base->GetFileName(), outputFName);
+      break;
+    case itk::ImageIOBase::SHORT:
+      runSegmentation<short>(im_base->GetFileName(), outputFName);
+      break;
+    default: // everything else is static-casted to float
+      runSegmentation<float>(im_base->GetFileName(), outputFName);
+      break;
+    }
     
   }
   catch (itk::ExceptionObject &error)
@@ -63,13 +63,15 @@ void SafeReadImage(typename TImageType::Pointer image, const std::string &fName)
 \param image_1 itk::Image::Pointer to first image
 \param image_2 itk::Image::Pointer to second image
 \param fOutName File name of output 
+
+The product is written with pixel type TOutputImageType, which has to hold the product of two input values.
 */
-template <typename TImageType>
+template <typename TImageType, typename TOutputImageType>
 void multiplicationFilter(typename TImageType::Pointer image_1,
   typename TImageType::Pointer image_2,
   const std::string &fOutName)
 {
-  typedef itk::MultiplyImageFilter<TImageType, TImageType> FilterType;
+  typedef itk::MultiplyImageFilter<TImageType, TImageType, TOutputImageType> FilterType;
   typename FilterType::Pointer filter = FilterType::New();
 
   filter->SetInput1(image_1);
@@ -77,13 +79,37 @@ void multiplicationFilter(typename TImageType::Pointer image_1,
   filter->Update();
   //typename TImageType::Pointer result = filter->GetOutput();
 
-  typedef itk::ImageFileWriter<TImageType> WriterType;
+  typedef itk::ImageFileWriter<TOutputImageType> WriterType;
   typename WriterType::Pointer writer = WriterType::New();
   writer->SetInput(filter->GetOutput());
   writer->SetFileName(fOutName);
   writer->Write();
 }
 
+/**
+\brief Read both images with pixel type TPixelType and multiply them
+
+Integer images are multiplied into their accumulation type (e.g., 8 bit into 16 bit), so the product does
+not overflow; only the output is widened.
+
+\param inputFileName1 File name of the first image
+\param inputFileName2 File name of the second image
+\param outputFileName File name of output
+*/
+template <typename TPixelType, typename TOutputPixelType>
+void runMultiplication(const std::string &inputFileName1, const std::string &inputFileName2, const std::string &outputFileName)
+{
+  typedef itk::Image<TPixelType, 3> ImageType; // define image type
+  typedef itk::Image<TOutputPixelType, 3> OutputImageType;
+  typename ImageType::Pointer image_1 = ImageType::New(); // initialize new image
+  SafeReadImage<ImageType>(image_1, inputFileName1); // read image along with exceptions
+
+  std::cout << "Doing multiplication...\n";
+  typename ImageType::Pointer image_2 = ImageType::New();
+  SafeReadImage<ImageType>(image_2, inputFileName2);
+  multiplicationFilter<ImageType, OutputImageType>(image_1, image_2, outputFileName);
+}
+
 void echoUsage(const std::string &exeName)
 {
   std::cout << exeName << " <inputImageFile1> <inputImageFile2> <outputFileName>\n" <<
@@ -131,15 +157,24 @@ int main(int argc, char *argv[])
       return EXIT_FAILURE;
     }
 
-    typedef float PixelType; // default pixel type is float, all voxel data is static-casted
-    typedef itk::Image<PixelType, 3> ImageType; // define image type
-    ImageType::Pointer image_1 = ImageType::New(); // initialize new image
-    SafeReadImage<ImageType>(image_1, im_base->GetFileName()); // read image along with exceptions
-    
-    std::cout << "Doing multiplication...\n";
-    ImageType::Pointer image_2 = ImageType::New();
-    SafeReadImage<ImageType>(image_2, inputFName2);
-    multiplicationFilter<ImageType>(image_1, image_2, outputFName);        
+    // both images are read with the storage type of the first one if they share it, and as float otherwise
+    const itk::ImageIOBase::IOComponentType componentType = (im_base->GetComponentType() == im_base_2->GetComponentType()) ?
+      im_base->GetComponentType() : itk::ImageIOBase::FLOAT;
+    switch (componentType)
+    {
+    case itk::ImageIOBase::UCHAR:
+      runMultiplication<unsigned char, itk::NumericTraits<unsigned char>::AccumulateType>(im_base->GetFileName(), inputFName2, outputFName);
+      break;
+    case itk::ImageIOBase::USHORT:
+      runMultiplication<unsigned short, itk::NumericTraits<unsigned short>::AccumulateType>(im_base->GetFileName(), inputFName2, outputFName);
+      break;
+    case itk::ImageIOBase::SHORT:
+      runMultiplication<short, itk::NumericTraits<short>::AccumulateType>(im_base->GetFileName(), inputFName2, outputFName);
+      break;
+    default: // everything else is static-casted to float
+      runMultiplication<float, float>(im_base->GetFileName(), inputFName2, outputFName);
+      break;
+    }
   }
   catch (itk::ExceptionObject &error)
   {
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/**
+\brief Modification time of a file in nanoseconds, from its stat() result
+
+Whole seconds miss a file which is rewritten within the same second with the same size, e.g., an uncompressed
+mask regenerated on the same grid. The sub-second part is that of the file system; Windows reports none.
+*/
+inline unsigned long long fileModificationTime(const struct stat &status)
+{
+  unsigned long long nanoseconds = 0;
+#if defined(__APPLE__)
+  nanoseconds = static_cast< unsigned long long >(status.st_mtimespec.tv_nsec);
+#elif !defined(_WIN32)
+  nanoseconds = static_cast< unsigned long long >(status.st_mtim.tv_nsec);
+#endif
+  return static_cast< unsigned long long >(status.st_mtime) * 1000000000ULL + nanoseconds;
+}
@@ -0,0 +1,329 @@
+#pragma once
+
+#include "itkMacro.h"
+
+#include "fileModificationTime.h"
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/**
+\brief Foreground of a mask as sorted runs of consecutive voxels along the rows (x lines) of its buffer
+
+A run is a range [begin, end) of linear buffer offsets and never crosses a row, so a consumer computes the
+index or physical point of its first voxel once and steps along x. Brain masks cover a fifth of the grid or
+less: a stage which iterates the runs instead of testing every mask voxel skips the background entirely. The
+runs are in buffer order, which is also the row order of the sample matrices built from the foreground.
+
+The index is built once per mask with Build() and can be written next to the mask (see FileNameOf()), so
+later stages and runs only read the runs; Load() does either.
+*/
+class ForegroundIndex
+{
+public:
+  enum
+  {
+    Version = 2,
+    MaximumDimension = 3
+  };
+
+  struct Run
+  {
+    unsigned long long begin, end; //! offsets of the first voxel and one past the last voxel
+  };
+
+  ForegroundIndex() :
+    m_Dimension(0), m_NumberOfVoxels(0)
+  {
+    std::fill(m_Size, m_Size + MaximumDimension, 0ULL);
+  }
+
+  //! Collect the runs of the non-zero voxels of the buffered region of 'mask'
+  template < typename TMaskImageType >
+  void Build(const TMaskImageType *mask)
+  {
+    itkStaticAssert(static_cast< unsigned int >(TMaskImageType::ImageDimension) <= static_cast< unsigned int >(MaximumDimension),
+      "Foreground indexes are implemented up to volumes");
+    const typename TMaskImageType::RegionType &region = mask->GetBufferedRegion();
+    m_Dimension = TMaskImageType::ImageDimension;
+    std::fill(m_Size, m_Size + MaximumDimension, 1ULL);
+    for (unsigned int d = 0; d < m_Dimension; d++)
+    {
+      m_Size[d] = region.GetSize()[d];
+    }
+    m_Runs.clear();
+
+    const typename TMaskImageType::PixelType *pixels = mask->GetBufferPointer();
+    const size_t rowLength = static_cast< size_t >(m_Size[0]), numberOfVoxels = region.GetNumberOfPixels();
+    for (size_t row = 0; (rowLength > 0) && (row < numberOfVoxels); row += rowLength)
+    {
+      const typename TMaskImageType::PixelType *line = pixels + row;
+      size_t x = 0;
+      while (x < rowLength)
+      {
+        while ((x < rowLength) && (line[x] == 0))
+        {
+          x++;
+        }
+        if (x == rowLength)
+        {
+          break;
+        }
+        Run run;
+        run.begin = row + x;
+        while ((x < rowLength) && (line[x] != 0))
+        {
+          x++;
+        }
+        run.end = row + x;
+        m_Runs.push_back(run);
+      }
+    }
+    this->UpdateRows();
+  }
+
+  //! Whether the index was built for a buffer of the size of the buffered region of 'image'
+  template < typename TImageType >
+  bool SharesGrid(const TImageType *image) const
+  {
+    if (m_Dimension != TImageType::ImageDimension)
+    {
+      return false;
+    }
+    for (unsigned int d = 0; d < m_Dimension; d++)
+    {
+      if (m_Size[d] != image->GetBufferedRegion().GetSize()[d])
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool IsEmpty() const
+  {
+    return m_Runs.empty();
+  }
+
+  //! Number of foreground voxels
+  size_t GetNumberOfVoxels() const
+  {
+    return m_NumberOfVoxels;
+  }
+
+  size_t GetNumberOfRuns() const
+  {
+    return m_Runs.size();
+  }
+
+  const Run &GetRun(size_t run) const
+  {
+    return m_Runs[run];
+  }
+
+  //! Number of foreground voxels before 'run', i.e., the sample row of its first voxel
+  size_t GetFirstRow(size_t run) const
+  {
+    return m_FirstRows[run];
+  }
+
+  //! First run which ends after 'offset'; GetNumberOfRuns() if there is none
+  size_t FindRun(size_t offset) const
+  {
+    size_t low = 0, high = m_Runs.size();
+    while (low < high)
+    {
+      const size_t middle = (low + high) / 2;
+      if (m_Runs[middle].end <= offset)
+      {
+        low = middle + 1;
+      }
+      else
+      {
+        high = middle;
+      }
+    }
+    return low;
+  }
+
+  //! Linear offsets of all foreground voxels in buffer order
+  void GetOffsets(std::vector< size_t > &offsets) const
+  {
+    offsets.resize(m_NumberOfVoxels);
+    size_t i = 0;
+    for (size_t r = 0; r < m_Runs.size(); r++)
+    {
+      for (unsigned long long o = m_Runs[r].begin; o < m_Runs[r].end; o++)
+      {
+        offsets[i++] = static_cast< size_t >(o);
+      }
+    }
+  }
+
+  //! The index file of a mask: '<maskFileName>.runs'
+  static std::string FileNameOf(const std::string &maskFileName)
+  {
+    return maskFileName + ".runs";
+  }
+
+  /**
+  \brief Write the runs together with the size and modification time of the mask file they were built from
+
+  The file is written to '<fileName>.tmp' and renamed, so an index which exists is always complete.
+  */
+  bool Write(const std::string &fileName, const std::string &maskFileName) const
+  {
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "FGINDEX", 8);
+    header.version = Version;
+    header.dimension = m_Dimension;
+    std::copy(m_Size, m_Size + MaximumDimension, header.size);
+    header.numberOfRuns = m_Runs.size();
+    if (!MaskSignature(maskFileName, header.maskLength, header.maskModified))
+    {
+      return false;
+    }
+
+    const std::string temporary = fileName + ".tmp";
+    std::FILE *file = std::fopen(temporary.c_str(), "wb");
+    if (!file)
+    {
+      return false;
+    }
+    bool ok = (std::fwrite(&header, sizeof(header), 1, file) == 1) &&
+      (m_Runs.empty() || (std::fwrite(&m_Runs[0], sizeof(Run), m_Runs.size(), file) == m_Runs.size()));
+    ok = (std::fclose(file) == 0) && ok;
+    std::remove(fileName.c_str()); // rename() does not replace existing files on Windows
+    if (!ok || (std::rename(temporary.c_str(), fileName.c_str()) != 0))
+    {
+      std::remove(temporary.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  /**
+  \brief Read what Write() wrote
+
+  \return False if the file does not exist or is damaged, or if the mask file was rewritten since
+  */
+  bool Read(const std::string &fileName, const std::string &maskFileName)
+  {
+    unsigned long long maskLength, maskModified;
+    if (!MaskSignature(maskFileName, maskLength, maskModified))
+    {
+      return false;
+    }
+    std::FILE *file = std::fopen(fileName.c_str(), "rb");
+    if (!file)
+    {
+      return false;
+    }
+    Header header;
+    bool ok = (std::fread(&header, sizeof(header), 1, file) == 1) && (std::memcmp(header.magic, "FGINDEX", 8) == 0) &&
+      (header.version == Version) && (header.dimension <= MaximumDimension) && (header.maskLength == maskLength) &&
+      (header.maskModified == maskModified);
+    std::vector< Run > runs;
+    if (ok)
+    {
+      runs.resize(static_cast< size_t >(header.numberOfRuns));
+      ok = runs.empty() || (std::fread(&runs[0], sizeof(Run), runs.size(), file) == runs.size());
+    }
+    std::fclose(file);
+
+    // runs have to be sorted, disjoint, inside the grid and within one row
+    unsigned long long numberOfVoxels = 1, previousEnd = 0;
+    for (unsigned int d = 0; ok && (d < MaximumDimension); d++)
+    {
+      numberOfVoxels *= header.size[d];
+    }
+    for (size_t r = 0; ok && (r < runs.size()); r++)
+    {
+      ok = (runs[r].begin >= previousEnd) && (runs[r].begin < runs[r].end) && (runs[r].end <= numberOfVoxels) &&
+        (runs[r].begin / header.size[0] == (runs[r].end - 1) / header.size[0]);
+      previousEnd = runs[r].end;
+    }
+    if (!ok)
+    {
+      return false;
+    }
+    m_Dimension = header.dimension;
+    std::copy(header.size, header.size + MaximumDimension, m_Size);
+    m_Runs.swap(runs);
+    this->UpdateRows();
+    return true;
+  }
+
+  /**
+  \brief Read the index of a mask from FileNameOf(maskFileName), or build it and write it there
+
+  A failed write, e.g., into a read-only data directory, only means that the index is built again next time.
+
+  \param mask The mask, already read from 'maskFileName'
+  \param maskFileName The mask file
+  \param writeIndex Whether a built index is written next to the mask
+
+  \return True if the index was read, false if it was built
+  */
+  template < typename TMaskImageType >
+  bool Load(const TMaskImageType *mask, const std::string &maskFileName, bool writeIndex = true)
+  {
+    if (!maskFileName.empty() && this->Read(FileNameOf(maskFileName), maskFileName) && this->SharesGrid(mask))
+    {
+      return true;
+    }
+    this->Build(mask);
+    if (writeIndex && !maskFileName.empty())
+    {
+      this->Write(FileNameOf(maskFileName), maskFileName);
+    }
+    return false;
+  }
+
+private:
+  struct Header
+  {
+    char magic[8];
+    unsigned int version;
+    unsigned int dimension;
+    unsigned long long size[MaximumDimension]; //! of the buffer; 1 beyond the dimension
+    unsigned long long maskLength, maskModified; //! of the mask file
+    unsigned long long numberOfRuns;
+  };
+
+  //! Size and modification time of the mask file, see fileModificationTime(); they change whenever it is rewritten
+  static bool MaskSignature(const std::string &maskFileName, unsigned long long &length, unsigned long long &modified)
+  {
+    struct stat status;
+    if (stat(maskFileName.c_str(), &status) != 0)
+    {
+      return false;
+    }
+    length = static_cast< unsigned long long >(status.st_size);
+    modified = fileModificationTime(status);
+    return true;
+  }
+
+  void UpdateRows()
+  {
+    m_FirstRows.resize(m_Runs.size());
+    m_NumberOfVoxels = 0;
+    for (size_t r = 0; r < m_Runs.size(); r++)
+    {
+      m_FirstRows[r] = m_NumberOfVoxels;
+      m_NumberOfVoxels += static_cast< size_t >(m_Runs[r].end - m_Runs[r].begin);
+    }
+  }
+
+  unsigned int m_Dimension;
+  unsigned long long m_Size[MaximumDimension];
+  std::vector< Run > m_Runs;
+  std::vector< size_t > m_FirstRows; //! see GetFirstRow()
+  size_t m_NumberOfVoxels;
+};
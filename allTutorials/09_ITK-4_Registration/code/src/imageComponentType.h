@@ -0,0 +1,47 @@
+#pragma once
+
+#include "itkImageIOBase.h"
+#include "itkImageIOFactory.h"
+
+#include <vector>
+#include <string>
+
+/**
+\brief Storage type of the voxels of an image, read from its header only
+
+\return itk::ImageIOBase::UNKNOWNCOMPONENTTYPE if the file cannot be read
+*/
+inline itk::ImageIOBase::IOComponentType readComponentType(const std::string &fileName)
+{
+  itk::ImageIOBase::Pointer io = itk::ImageIOFactory::CreateImageIO(fileName.c_str(), itk::ImageIOFactory::ReadMode);
+  if (io.IsNull())
+  {
+    return itk::ImageIOBase::UNKNOWNCOMPONENTTYPE;
+  }
+  io->SetFileName(fileName);
+  io->ReadImageInformation();
+  return io->GetComponentType();
+}
+
+/**
+\brief Storage type shared by all images, e.g., the modalities of one subject or the fixed and moving images of a registration
+
+Images which are processed together are read with one pixel type; if their storage types differ, float holds
+the values of all of them.
+
+\return The shared type, or itk::ImageIOBase::FLOAT if the types differ or a header cannot be read
+*/
+inline itk::ImageIOBase::IOComponentType commonComponentType(const std::vector< std::string > &fileNames)
+{
+  itk::ImageIOBase::IOComponentType common = itk::ImageIOBase::UNKNOWNCOMPONENTTYPE;
+  for (size_t i = 0; i < fileNames.size(); i++)
+  {
+    const itk::ImageIOBase::IOComponentType type = readComponentType(fileNames[i]);
+    if ((type == itk::ImageIOBase::UNKNOWNCOMPONENTTYPE) || ((i > 0) && (type != common)))
+    {
+      return itk::ImageIOBase::FLOAT;
+    }
+    common = type;
+  }
+  return (common == itk::ImageIOBase::UNKNOWNCOMPONENTTYPE) ? itk::ImageIOBase::FLOAT : common;
+}
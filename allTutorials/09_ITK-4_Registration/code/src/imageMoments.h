@@ -0,0 +1,293 @@
+#pragma once
+
+#include "itkImage.h"
+#include "itkMatrix.h"
+#include "itkVector.h"
+#include "itkPoint.h"
+#include "vnl/algo/vnl_symmetric_eigensystem.h"
+#include "vnl/vnl_det.h"
+
+#include "registrationBudget.h"
+#include "foregroundIndex.h"
+
+#include <vector>
+#include <iostream>
+#include <cmath>
+#include <thread>
+#include <algorithm>
+
+/**
+\brief Zeroth, first and second order moments of an image in physical space
+*/
+struct ImageMoments
+{
+  ImageMoments() :
+    mass(0)
+  {
+    center.Fill(0);
+    principalMoments.Fill(0);
+    principalAxes.SetIdentity();
+  }
+
+  typedef itk::Point< double, 3 > PointType;
+  typedef itk::Vector< double, 3 > VectorType;
+  typedef itk::Matrix< double, 3, 3 > MatrixType;
+
+  double mass; //! sum of the voxel weights
+  PointType center; //! center of mass
+  VectorType principalMoments; //! eigenvalues of the covariance, ascending
+  MatrixType principalAxes; //! eigenvectors of the covariance as columns, ordered like principalMoments, right handed
+};
+
+/**
+\brief Compute the moments of an image in one multithreaded pass
+
+Voxels are weighted by their intensity (negative intensities count as 0). If a mask is given, only voxels
+where the mask is non-zero contribute; the mask is expected to share the grid of the image. With the runs of
+the mask (see ForegroundIndex), only the foreground voxels are visited instead of testing the mask everywhere.
+Every thread accumulates the raw sums of a slab of the image and the sums are added up afterwards.
+
+\param image The image
+\param mask Optional mask on the grid of 'image'; may be NULL
+\param numberOfThreads Number of threads; 0 uses all cores
+\param budget Optional budget, checked once per slice (or per 256 runs); may be NULL
+\param foreground Optional runs of the non-zero voxels of 'mask'; may be NULL
+
+\return The moments; mass is 0 if no voxel contributed or the budget was exhausted
+*/
+template < typename TImageType, typename TMaskImageType >
+ImageMoments computeImageMoments(const TImageType *image, const TMaskImageType *mask, unsigned int numberOfThreads = 0,
+  const RegistrationBudget *budget = NULL, const ForegroundIndex *foreground = NULL)
+{
+  typedef typename TImageType::RegionType RegionType;
+
+  // raw sums of a slab: mass, first order (3) and second order (xx, xy, xz, yy, yz, zz)
+  struct Sums
+  {
+    double values[10];
+  };
+
+  const RegionType region = image->GetBufferedRegion();
+  if (mask && (mask->GetBufferedRegion() != region))
+  {
+    mask = NULL; // masks on a different grid are not resampled here
+    std::cerr << "Mask does not share the grid of the image; moments are computed without it.\n";
+  }
+  if (!mask || (foreground && !foreground->SharesGrid(image)))
+  {
+    foreground = NULL;
+  }
+
+  if (numberOfThreads == 0)
+  {
+    numberOfThreads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  const itk::SizeValueType slices = region.GetSize()[2];
+  numberOfThreads = static_cast< unsigned int >(std::max< itk::SizeValueType >(1, std::min< itk::SizeValueType >(numberOfThreads, slices)));
+
+  // physical point = origin + indexToPoint * index; along x it advances by the first column
+  itk::Matrix< double, 3, 3 > indexToPoint;
+  for (unsigned int r = 0; r < 3; r++)
+  {
+    for (unsigned int c = 0; c < 3; c++)
+    {
+      indexToPoint[r][c] = image->GetDirection()[r][c] * image->GetSpacing()[c];
+    }
+  }
+
+  std::vector< Sums > partial(numberOfThreads);
+  auto accumulate = [&](unsigned int thread)
+  {
+    double *sums = partial[thread].values;
+    std::fill(sums, sums + 10, 0.0);
+
+    const itk::SizeValueType sizeX = region.GetSize()[0], sizeY = region.GetSize()[1];
+    const itk::SizeValueType beginZ = slices * thread / numberOfThreads, endZ = slices * (thread + 1) / numberOfThreads;
+    const typename TImageType::PixelType *pixels = image->GetBufferPointer();
+    const typename TMaskImageType::PixelType *maskPixels = mask ? mask->GetBufferPointer() : NULL;
+
+    // add the voxel x steps along the line starting at 'point'
+    auto add = [&](double weight, const typename TImageType::PointType &point, itk::SizeValueType x)
+    {
+      double p[3];
+      for (unsigned int d = 0; d < 3; d++)
+      {
+        p[d] = point[d] + indexToPoint[d][0] * x;
+      }
+      sums[0] += weight;
+      sums[1] += weight * p[0];
+      sums[2] += weight * p[1];
+      sums[3] += weight * p[2];
+      sums[4] += weight * p[0] * p[0];
+      sums[5] += weight * p[0] * p[1];
+      sums[6] += weight * p[0] * p[2];
+      sums[7] += weight * p[1] * p[1];
+      sums[8] += weight * p[1] * p[2];
+      sums[9] += weight * p[2] * p[2];
+    };
+
+    if (foreground)
+    {
+      // runs never cross a row, so the runs of the slab are the ones from its first offset up to its last
+      const itk::SizeValueType sliceSize = sizeX * sizeY;
+      for (size_t r = foreground->FindRun(beginZ * sliceSize);
+        (r < foreground->GetNumberOfRuns()) && (foreground->GetRun(r).begin < endZ * sliceSize); r++)
+      {
+        if (budget && ((r % 256) == 0) && budget->IsExhausted())
+        {
+          return;
+        }
+        const ForegroundIndex::Run &run = foreground->GetRun(r);
+        typename TImageType::IndexType runStart = region.GetIndex();
+        runStart[0] += static_cast< itk::IndexValueType >(run.begin % sizeX);
+        runStart[1] += static_cast< itk::IndexValueType >((run.begin / sizeX) % sizeY);
+        runStart[2] += static_cast< itk::IndexValueType >(run.begin / sliceSize);
+        typename TImageType::PointType point;
+        image->TransformIndexToPhysicalPoint(runStart, point);
+
+        const typename TImageType::PixelType *runPixels = pixels + run.begin;
+        const itk::SizeValueType length = static_cast< itk::SizeValueType >(run.end - run.begin);
+        for (itk::SizeValueType x = 0; x < length; x++)
+        {
+          const double weight = static_cast< double >(runPixels[x]);
+          if (weight > 0)
+          {
+            add(weight, point, x);
+          }
+        }
+      }
+      return;
+    }
+
+    for (itk::SizeValueType z = beginZ; z < endZ; z++)
+    {
+      if (budget && budget->IsExhausted())
+      {
+        return;
+      }
+      for (itk::SizeValueType y = 0; y < sizeY; y++)
+      {
+        typename TImageType::IndexType lineStart = region.GetIndex();
+        lineStart[1] += y;
+        lineStart[2] += z;
+        typename TImageType::PointType point;
+        image->TransformIndexToPhysicalPoint(lineStart, point);
+
+        const itk::OffsetValueType offset = (z * sizeY + y) * sizeX;
+        for (itk::SizeValueType x = 0; x < sizeX; x++)
+        {
+          double weight = static_cast< double >(pixels[offset + x]);
+          if ((weight > 0) && (!maskPixels || (maskPixels[offset + x] != 0)))
+          {
+            add(weight, point, x);
+          }
+        }
+      }
+    }
+  };
+
+  std::vector< std::thread > threads;
+  for (unsigned int t = 1; t < numberOfThreads; t++)
+  {
+    threads.push_back(std::thread(accumulate, t));
+  }
+  accumulate(0);
+  for (size_t t = 0; t < threads.size(); t++)
+  {
+    threads[t].join();
+  }
+
+  double total[10] = { 0 };
+  for (unsigned int t = 0; t < numberOfThreads; t++)
+  {
+    for (unsigned int i = 0; i < 10; i++)
+    {
+      total[i] += partial[t].values[i];
+    }
+  }
+
+  ImageMoments moments;
+  if (budget && budget->IsExhausted())
+  {
+    return moments; // partial sums would give a biased center
+  }
+  moments.mass = total[0];
+  if (moments.mass <= 0)
+  {
+    return moments;
+  }
+  for (unsigned int d = 0; d < 3; d++)
+  {
+    moments.center[d] = total[1 + d] / moments.mass;
+  }
+
+  // central second order moments
+  vnl_matrix< double > covariance(3, 3);
+  const unsigned int second[3][3] = { { 4, 5, 6 }, { 5, 7, 8 }, { 6, 8, 9 } };
+  for (unsigned int r = 0; r < 3; r++)
+  {
+    for (unsigned int c = 0; c < 3; c++)
+    {
+      covariance(r, c) = total[second[r][c]] / moments.mass - moments.center[r] * moments.center[c];
+    }
+  }
+
+  vnl_symmetric_eigensystem< double > eigensystem(covariance);
+  for (unsigned int c = 0; c < 3; c++)
+  {
+    moments.principalMoments[c] = eigensystem.get_eigenvalue(c);
+    // eigenvectors have no sign; point each one along the positive direction of its dominant image axis
+    unsigned int dominant = 0;
+    for (unsigned int r = 1; r < 3; r++)
+    {
+      if (std::abs(eigensystem.V(r, c)) > std::abs(eigensystem.V(dominant, c)))
+      {
+        dominant = r;
+      }
+    }
+    const double sign = (eigensystem.V(dominant, c) < 0) ? -1.0 : 1.0;
+    for (unsigned int r = 0; r < 3; r++)
+    {
+      moments.principalAxes[r][c] = sign * eigensystem.V(r, c);
+    }
+  }
+  if (vnl_det(moments.principalAxes.GetVnlMatrix()) < 0)
+  {
+    for (unsigned int r = 0; r < 3; r++)
+    {
+      moments.principalAxes[r][0] = -moments.principalAxes[r][0];
+    }
+  }
+
+  return moments;
+}
+
+/**
+\brief Initialize an affine transform (fixed -> moving) from the moments of both images
+
+The center of the transform is set to the fixed center of mass and the translation maps it onto the moving
+center of mass. With 'useRotation', the matrix rotates the principal axes of the fixed image onto those of
+the moving image.
+
+\return False (and the transform is left untouched) if one of the images has no mass
+*/
+template < typename TTransformType >
+bool initializeTransformFromMoments(TTransformType *transform, const ImageMoments &fixedMoments,
+  const ImageMoments &movingMoments, bool useRotation)
+{
+  if ((fixedMoments.mass <= 0) || (movingMoments.mass <= 0))
+  {
+    return false;
+  }
+
+  transform->SetIdentity();
+  transform->SetCenter(fixedMoments.center);
+  if (useRotation)
+  {
+    typename TTransformType::MatrixType rotation;
+    rotation = movingMoments.principalAxes * fixedMoments.principalAxes.GetTranspose();
+    transform->SetMatrix(rotation);
+  }
+  transform->SetTranslation(movingMoments.center - fixedMoments.center);
+  return true;
+}
@@ -0,0 +1,359 @@
+#pragma once
+
+#include "itkImageToImageFilter.h"
+#include "itkMatrixOffsetTransformBase.h"
+#include "itkImageLinearIteratorWithIndex.h"
+#include "itkProgressReporter.h"
+#include "itkNumericTraits.h"
+#include "itkMath.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace itk
+{
+/**
+\brief Resample an image through an affine transform by stepping along output scanlines
+
+itk::ResampleImageFilter maps every output voxel through a virtual TransformPoint() call and evaluates a
+generic interpolator on the result. For an affine transform the continuous input index is an affine function
+of the output index, so this filter computes it once at the start of every scanline and adds a constant
+increment per voxel. The part of each scanline which maps inside the input is computed up front, which keeps
+bounds checks out of the inner loop; voxels outside get the default pixel value. Like itk::ResampleImageFilter,
+the input extends half a voxel beyond the centers of its first and last voxels; linear interpolation repeats the
+border voxel there, as itk::LinearInterpolateImageFunction does.
+
+Linear (trilinear in 3D) and nearest neighbor interpolation read the input buffer directly. The output is
+split into slabs by the usual ImageToImageFilter multithreading. Progress is reported per scanline, which is
+also where AbortGenerateDataOn() takes effect.
+
+The index map is composed in double precision; TInternalComputationValueType is the type of the per-voxel
+positions, fractions and interpolation weights. With float, every voxel position is computed as scanline start +
+i * step instead of being accumulated, so the rounding error does not grow along the scanline.
+*/
+template < typename TInputImage, typename TOutputImage = TInputImage, typename TInternalComputationValueType = double >
+class AffineScanlineResampleImageFilter :
+  public ImageToImageFilter< TInputImage, TOutputImage >
+{
+public:
+  //! Standard class typedefs
+  typedef AffineScanlineResampleImageFilter Self;
+  typedef ImageToImageFilter< TInputImage, TOutputImage > Superclass;
+  typedef SmartPointer< Self > Pointer;
+  typedef SmartPointer< const Self > ConstPointer;
+
+  itkNewMacro(Self);
+  itkTypeMacro(AffineScanlineResampleImageFilter, ImageToImageFilter);
+
+  itkStaticConstMacro(ImageDimension, unsigned int, TOutputImage::ImageDimension);
+
+  typedef TInputImage InputImageType;
+  typedef TOutputImage OutputImageType;
+  typedef typename OutputImageType::RegionType OutputImageRegionType;
+  typedef typename OutputImageType::PixelType OutputPixelType;
+  typedef typename OutputImageType::SizeType SizeType;
+  typedef typename OutputImageType::PointType PointType;
+  typedef typename OutputImageType::SpacingType SpacingType;
+  typedef typename OutputImageType::DirectionType DirectionType;
+
+  typedef MatrixOffsetTransformBase< double, ImageDimension, ImageDimension > TransformType;
+  typedef Matrix< double, ImageDimension, ImageDimension > MatrixType;
+  typedef Vector< double, ImageDimension > VectorType;
+  typedef TInternalComputationValueType InternalComputationValueType;
+  typedef Vector< InternalComputationValueType, ImageDimension > InternalVectorType;
+
+  enum InterpolationType
+  {
+    LINEAR,
+    NEAREST_NEIGHBOR
+  };
+
+  //! Affine (or any matrix + offset) transform mapping output points to input points
+  itkSetConstObjectMacro(Transform, TransformType);
+  itkGetConstObjectMacro(Transform, TransformType);
+
+  itkSetMacro(Interpolation, InterpolationType);
+  itkGetConstMacro(Interpolation, InterpolationType);
+
+  itkSetMacro(DefaultPixelValue, OutputPixelType);
+  itkGetConstMacro(DefaultPixelValue, OutputPixelType);
+
+  itkSetMacro(Size, SizeType);
+  itkGetConstReferenceMacro(Size, SizeType);
+  itkSetMacro(OutputOrigin, PointType);
+  itkGetConstReferenceMacro(OutputOrigin, PointType);
+  itkSetMacro(OutputSpacing, SpacingType);
+  itkGetConstReferenceMacro(OutputSpacing, SpacingType);
+  itkSetMacro(OutputDirection, DirectionType);
+  itkGetConstReferenceMacro(OutputDirection, DirectionType);
+
+  //! Copy size, origin, spacing and direction of the output from an image
+  void SetOutputParametersFromImage(const ImageBase< ImageDimension > *image)
+  {
+    this->SetSize(image->GetLargestPossibleRegion().GetSize());
+    this->SetOutputOrigin(image->GetOrigin());
+    this->SetOutputSpacing(image->GetSpacing());
+    this->SetOutputDirection(image->GetDirection());
+  }
+
+protected:
+  AffineScanlineResampleImageFilter() :
+    m_Interpolation(LINEAR), m_DefaultPixelValue(NumericTraits< OutputPixelType >::Zero)
+  {
+    m_Size.Fill(0);
+    m_OutputOrigin.Fill(0.0);
+    m_OutputSpacing.Fill(1.0);
+    m_OutputDirection.SetIdentity();
+  }
+
+  virtual ~AffineScanlineResampleImageFilter()
+  {
+  }
+
+  void PrintSelf(std::ostream &os, Indent indent) const
+  {
+    Superclass::PrintSelf(os, indent);
+    os << indent << "Interpolation: " << (m_Interpolation == LINEAR ? "linear" : "nearest neighbor") << std::endl;
+    os << indent << "Size: " << m_Size << std::endl;
+    os << indent << "OutputOrigin: " << m_OutputOrigin << std::endl;
+    os << indent << "OutputSpacing: " << m_OutputSpacing << std::endl;
+    os << indent << "OutputDirection: " << m_OutputDirection << std::endl;
+  }
+
+  void GenerateOutputInformation()
+  {
+    Superclass::GenerateOutputInformation();
+    OutputImageType *output = this->GetOutput();
+    OutputImageRegionType region;
+    region.SetSize(m_Size);
+    output->SetLargestPossibleRegion(region);
+    output->SetOrigin(m_OutputOrigin);
+    output->SetSpacing(m_OutputSpacing);
+    output->SetDirection(m_OutputDirection);
+  }
+
+  void GenerateInputRequestedRegion()
+  {
+    Superclass::GenerateInputRequestedRegion();
+    InputImageType *input = const_cast< InputImageType * >(this->GetInput());
+    if (input)
+    {
+      input->SetRequestedRegionToLargestPossibleRegion(); // the transform can map anywhere into the input
+    }
+  }
+
+  //! Compose output index -> output point -> transform -> input continuous index into one affine map
+  void BeforeThreadedGenerateData()
+  {
+    if (m_Transform.IsNull())
+    {
+      itkExceptionMacro(<< "Transform not set");
+    }
+    const InputImageType *input = this->GetInput();
+
+    MatrixType outputIndexToPoint;
+    for (unsigned int r = 0; r < ImageDimension; r++)
+    {
+      for (unsigned int c = 0; c < ImageDimension; c++)
+      {
+        outputIndexToPoint[r][c] = m_OutputDirection[r][c] * m_OutputSpacing[c];
+      }
+    }
+    MatrixType inputPointToIndex;
+    for (unsigned int r = 0; r < ImageDimension; r++)
+    {
+      for (unsigned int c = 0; c < ImageDimension; c++)
+      {
+        inputPointToIndex[r][c] = input->GetPhysicalPointToIndex()[r][c];
+      }
+    }
+
+    // input continuous index = m_IndexMatrix * output index + m_IndexOffset
+    m_IndexMatrix = inputPointToIndex * m_Transform->GetMatrix() * outputIndexToPoint;
+    VectorType mappedOrigin = m_Transform->GetMatrix() * m_OutputOrigin.GetVectorFromOrigin() + m_Transform->GetOffset();
+    m_IndexOffset = inputPointToIndex * (mappedOrigin - input->GetOrigin().GetVectorFromOrigin());
+
+    const typename InputImageType::RegionType &buffered = input->GetBufferedRegion();
+    for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+      m_InputStart[d] = buffered.GetIndex()[d];
+      m_InputLast[d] = buffered.GetIndex()[d] + static_cast< IndexValueType >(buffered.GetSize()[d]) - 1;
+      // along a dimension of size 1 both corners of the linear cell are the same voxel
+      m_CornerStride[d] = (buffered.GetSize()[d] > 1) ? input->GetOffsetTable()[d] : 0;
+      m_OffsetTable[d] = input->GetOffsetTable()[d];
+    }
+  }
+
+  void ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread, ThreadIdType threadId)
+  {
+    OutputImageType *output = this->GetOutput();
+    const typename InputImageType::PixelType *inputBuffer = this->GetInput()->GetBufferPointer();
+
+    VectorType step; // constant increment of the input continuous index along a scanline
+    InternalVectorType internalStep;
+    for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+      step[d] = m_IndexMatrix[d][0];
+      internalStep[d] = static_cast< InternalComputationValueType >(step[d]);
+    }
+
+    // continuous index limits of the input, including the half voxel border; the interpolators clamp the corners
+    double lower[ImageDimension], upper[ImageDimension];
+    for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+      lower[d] = m_InputStart[d] - 0.5;
+      upper[d] = m_InputLast[d] + 0.5;
+    }
+
+    const SizeValueType lineLength = outputRegionForThread.GetSize()[0];
+    ProgressReporter progress(this, threadId, outputRegionForThread.GetNumberOfPixels() / std::max< SizeValueType >(lineLength, 1));
+    ImageLinearIteratorWithIndex< OutputImageType > it(output, outputRegionForThread);
+    it.SetDirection(0);
+    for (it.GoToBegin(); !it.IsAtEnd(); it.NextLine())
+    {
+      const typename OutputImageType::IndexType &lineStart = it.GetIndex();
+      VectorType position = m_IndexOffset;
+      for (unsigned int d = 0; d < ImageDimension; d++)
+      {
+        for (unsigned int c = 0; c < ImageDimension; c++)
+        {
+          position[d] += m_IndexMatrix[d][c] * lineStart[c];
+        }
+      }
+
+      // [first, last) is the part of the scanline which maps inside the input
+      double first = 0, last = static_cast< double >(lineLength);
+      for (unsigned int d = 0; d < ImageDimension; d++)
+      {
+        if (step[d] == 0)
+        {
+          if ((position[d] < lower[d]) || (position[d] > upper[d]))
+          {
+            last = first;
+          }
+          continue;
+        }
+        double enter = (lower[d] - position[d]) / step[d], leave = (upper[d] - position[d]) / step[d];
+        if (enter > leave)
+        {
+          std::swap(enter, leave);
+        }
+        first = std::max(first, std::ceil(enter));
+        last = std::min(last, std::floor(leave) + 1.0);
+      }
+      const SizeValueType insideBegin = static_cast< SizeValueType >(std::min(first, static_cast< double >(lineLength)));
+      const SizeValueType insideEnd = std::max(insideBegin, static_cast< SizeValueType >(std::max(0.0, last)));
+
+      OutputPixelType *line = output->GetBufferPointer() + output->ComputeOffset(lineStart);
+      std::fill(line, line + insideBegin, m_DefaultPixelValue);
+      std::fill(line + insideEnd, line + lineLength, m_DefaultPixelValue);
+
+      position += step * static_cast< double >(insideBegin);
+      InternalVectorType start;
+      for (unsigned int d = 0; d < ImageDimension; d++)
+      {
+        start[d] = static_cast< InternalComputationValueType >(position[d]);
+      }
+      if (m_Interpolation == LINEAR)
+      {
+        for (SizeValueType i = insideBegin; i < insideEnd; i++)
+        {
+          const InternalVectorType voxel = start + internalStep * static_cast< InternalComputationValueType >(i - insideBegin);
+          line[i] = this->ConvertPixel(this->EvaluateLinear(inputBuffer, voxel));
+        }
+      }
+      else
+      {
+        for (SizeValueType i = insideBegin; i < insideEnd; i++)
+        {
+          const InternalVectorType voxel = start + internalStep * static_cast< InternalComputationValueType >(i - insideBegin);
+          line[i] = this->ConvertPixel(this->EvaluateNearest(inputBuffer, voxel));
+        }
+      }
+      progress.CompletedPixel(); // throws ProcessAborted once the filter is aborted
+    }
+  }
+
+private:
+  AffineScanlineResampleImageFilter(const Self &); // purposely not implemented
+  void operator=(const Self &); // purposely not implemented
+
+  //! Linear interpolation; the base index and fractions are clamped, so the half voxel border repeats the border voxel
+  inline InternalComputationValueType EvaluateLinear(const typename InputImageType::PixelType *buffer,
+    const InternalVectorType &position) const
+  {
+    typedef InternalComputationValueType RealType;
+    OffsetValueType offset = 0;
+    RealType fraction[ImageDimension];
+    for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+      IndexValueType base = Math::Floor< IndexValueType >(position[d]);
+      base = std::min(std::max(base, m_InputStart[d]), std::max(m_InputStart[d], m_InputLast[d] - 1));
+      fraction[d] = std::min(std::max(position[d] - static_cast< RealType >(base), RealType(0)), RealType(1));
+      offset += (base - m_InputStart[d]) * m_OffsetTable[d];
+    }
+
+    RealType value = 0;
+    for (unsigned int corner = 0; corner < (1u << ImageDimension); corner++)
+    {
+      RealType weight = 1;
+      OffsetValueType cornerOffset = offset;
+      for (unsigned int d = 0; d < ImageDimension; d++)
+      {
+        if (corner & (1u << d))
+        {
+          weight *= fraction[d];
+          cornerOffset += m_CornerStride[d];
+        }
+        else
+        {
+          weight *= RealType(1) - fraction[d];
+        }
+      }
+      value += weight * static_cast< RealType >(buffer[cornerOffset]);
+    }
+    return value;
+  }
+
+  inline InternalComputationValueType EvaluateNearest(const typename InputImageType::PixelType *buffer,
+    const InternalVectorType &position) const
+  {
+    OffsetValueType offset = 0;
+    for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+      IndexValueType index = Math::RoundHalfIntegerUp< IndexValueType >(position[d]);
+      index = std::min(std::max(index, m_InputStart[d]), m_InputLast[d]);
+      offset += (index - m_InputStart[d]) * m_OffsetTable[d];
+    }
+    return static_cast< InternalComputationValueType >(buffer[offset]);
+  }
+
+  //! Integer outputs are rounded and clamped to their range, like itk::ResampleImageFilter does
+  inline OutputPixelType ConvertPixel(double value) const
+  {
+    if (NumericTraits< OutputPixelType >::is_integer)
+    {
+      value = std::floor(value + 0.5);
+      value = std::max(value, static_cast< double >(NumericTraits< OutputPixelType >::NonpositiveMin()));
+      value = std::min(value, static_cast< double >(NumericTraits< OutputPixelType >::max()));
+    }
+    return static_cast< OutputPixelType >(value);
+  }
+
+  typename TransformType::ConstPointer m_Transform;
+  InterpolationType m_Interpolation;
+  OutputPixelType m_DefaultPixelValue;
+  SizeType m_Size;
+  PointType m_OutputOrigin;
+  SpacingType m_OutputSpacing;
+  DirectionType m_OutputDirection;
+
+  MatrixType m_IndexMatrix;
+  VectorType m_IndexOffset;
+  IndexValueType m_InputStart[ImageDimension];
+  IndexValueType m_InputLast[ImageDimension];
+  OffsetValueType m_OffsetTable[ImageDimension];
+  OffsetValueType m_CornerStride[ImageDimension];
+};
+
+} // end namespace itk
@@ -17,6 +17,7 @@
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
 #include "itkMeanSquaresImageToImageMetric.h"
+#include "itkMattesMutualInformationImageToImageMetric.h"
 #include "itkRegularStepGradientDescentOptimizer.h"
 #include "itkResampleImageFilter.h"
 #include "itkRescaleIntensityImageFilter.h"
@@ -28,6 +29,77 @@
 
 #include <itkCorrelationCoefficientHistogramImageToImageMetric.h>
 
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkTransformFileWriter.h"
+#include "itkMultiThreader.h"
+
+#include "itkFusedGradientMeanSquaresImageToImageMetric.h"
+#include "itkAffineScanlineResampleImageFilter.h"
+#include "registrationTelemetry.h"
+#include "registrationBudget.h"
+#include "imageMoments.h"
+#include "foregroundIndex.h"
+#include "imageComponentType.h"
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <random>
+
+/**
+\brief Options which control registrationFilter()
+*/
+struct RegistrationOptions
+{
+  //! Similarity metrics supported by registrationFilter()
+  enum MetricType
+  {
+    MattesMutualInformation, //! works across modalities (e.g., T1 to FLAIR/PD)
+    MeanSquares //! same modality only
+  };
+
+  //! Initial transforms supported by registrationFilter()
+  enum InitializationType
+  {
+    IdentityInitialization,
+    MomentsInitialization //! align the centers of mass
+  };
+
+  RegistrationOptions() :
+    metric(MattesMutualInformation), numberOfHistogramBins(50), numberOfSamples(0),
+    useGradientCache(false), floatGradientCache(true), numberOfThreads(0), verbose(true),
+    numberOfIterations(20), checkpointInterval(0), resume(false), genericResampler(false),
+    initialization(MomentsInitialization), initializeRotation(false), singlePrecision(false),
+    timeBudgetSeconds(0), cancellationToken(NULL)
+  {
+  }
+
+  MetricType metric; //! similarity metric
+  unsigned int numberOfHistogramBins; //! joint histogram bins of the mutual information metric
+  size_t numberOfSamples; //! number of fixed image samples per iteration; 0 uses all mask voxels
+  bool useGradientCache; //! precompute the moving-image gradient and interpolate it alongside intensity
+  bool floatGradientCache; //! store the gradient cache as float (halves memory) instead of double
+  unsigned int numberOfThreads; //! threads used by a single registration; 0 uses the ITK default
+  bool verbose; //! print the final parameters
+  std::string transformFileName; //! if not empty, the final transform is written here
+  unsigned int numberOfIterations; //! iteration budget of the optimizer
+  std::string telemetryFormat; //! "csv" or "json" writes per-iteration telemetry next to the output
+  unsigned int checkpointInterval; //! write a checkpoint next to the output every n iterations; 0 disables
+  bool resume; //! continue from the checkpoint next to the output if there is one
+  bool genericResampler; //! resample with itk::ResampleImageFilter instead of the affine scanline resampler
+  InitializationType initialization; //! how the initial transform is computed
+  bool initializeRotation; //! also align the principal axes when initializing from moments
+  std::string movingMaskFileName; //! mask of the moving image for the moments; if empty, neither side's moments are masked
+  bool singlePrecision; //! float coordinates and interpolation weights in the fused metric and the scanline resampler
+  double timeBudgetSeconds; //! wall time of one registration after which the best parameters so far are used; 0 disables
+  const std::atomic< bool > *cancellationToken; //! registrations stop as soon as this is true; may be NULL
+};
+
 
 /**
 \brief Get the itk::Image
@@ -58,34 +130,263 @@ void SafeReadImage(typename TImageType::Pointer image, const std::string &fName)
 }
 
 /**
-\brief Apply the registration filter
+\brief Fixed image data which is shared by all registrations against the same fixed image
+
+Everything in here is computed once by prepareFixedImageState() and is only read afterwards, so a single
+instance can be used by several registrations running concurrently.
+*/
+template <typename TImageType>
+struct FixedImageState
+{
+  typedef std::vector< typename TImageType::IndexType > IndexContainerType;
+
+  typename TImageType::Pointer image; //! the fixed image
+  typename TImageType::RegionType region; //! bounding region of the mask inside the fixed image
+  IndexContainerType sampleIndexes; //! fixed image voxels inside the mask; used as the metric samples
+  ImageMoments moments; //! moments of the fixed image, used to initialize the transform
+};
+
+/**
+\brief Compute the fixed image state (mask samples and their bounding region) once
 
 \param fixedImage itk::Image::Pointer to fixed image
+\param maskImage itk::Image::Pointer to mask of fixed image; all non-zero voxels are used as samples
+\param foreground Runs of the non-zero voxels of maskImage (see ForegroundIndex::Load()); only these are visited
+\param options If options.numberOfSamples is not 0, a random (but reproducible) subset of this many mask voxels
+is used as samples; the fixed moments are computed if options.initialization needs them, inside the mask only if
+the moving moments are masked as well (options.movingMaskFileName)
+
+\return The state to pass to registrationFilter()
+*/
+template <typename TImageType, typename TMaskImageType>
+FixedImageState<TImageType> prepareFixedImageState(typename TImageType::Pointer fixedImage,
+  typename TMaskImageType::Pointer maskImage, const ForegroundIndex &foreground,
+  const RegistrationOptions &options)
+{
+  const size_t numberOfSamples = options.numberOfSamples;
+  FixedImageState<TImageType> state;
+  state.image = fixedImage;
+  state.region = fixedImage->GetLargestPossibleRegion();
+
+  typename TImageType::IndexType lower, upper;
+  lower.Fill(itk::NumericTraits<itk::IndexValueType>::max());
+  upper.Fill(itk::NumericTraits<itk::IndexValueType>::NonpositiveMin());
+
+  // the mask is mapped through physical space so it does not need to share the grid of the fixed image; if it
+  // does, its indexes are fixed image indexes and the mapping is skipped
+  const bool sameGrid = (maskImage->GetBufferedRegion() == fixedImage->GetLargestPossibleRegion()) &&
+    (maskImage->GetOrigin() == fixedImage->GetOrigin()) && (maskImage->GetSpacing() == fixedImage->GetSpacing()) &&
+    (maskImage->GetDirection() == fixedImage->GetDirection());
+  const typename TMaskImageType::RegionType &maskRegion = maskImage->GetBufferedRegion();
+  const unsigned long long sizeX = maskRegion.GetSize()[0], sizeY = maskRegion.GetSize()[1];
+  if (!foreground.SharesGrid(maskImage.GetPointer()))
+  {
+    itkGenericExceptionMacro(<< "The foreground index was not built from the mask of the fixed image");
+  }
+  state.sampleIndexes.reserve(foreground.GetNumberOfVoxels());
+  for (size_t r = 0; r < foreground.GetNumberOfRuns(); r++)
+  {
+    const ForegroundIndex::Run &run = foreground.GetRun(r);
+    typename TMaskImageType::IndexType maskIndex = maskRegion.GetIndex();
+    maskIndex[0] += static_cast<itk::IndexValueType>(run.begin % sizeX);
+    maskIndex[1] += static_cast<itk::IndexValueType>((run.begin / sizeX) % sizeY);
+    maskIndex[2] += static_cast<itk::IndexValueType>(run.begin / (sizeX * sizeY));
+    for (unsigned long long o = run.begin; o < run.end; o++, maskIndex[0]++)
+    {
+      typename TImageType::IndexType index;
+      if (sameGrid)
+      {
+        for (unsigned int d = 0; d < TImageType::ImageDimension; d++)
+        {
+          index[d] = maskIndex[d];
+        }
+      }
+      else
+      {
+        typename TMaskImageType::PointType point;
+        maskImage->TransformIndexToPhysicalPoint(maskIndex, point);
+        if (!fixedImage->TransformPhysicalPointToIndex(point, index))
+        {
+          continue;
+        }
+      }
+      state.sampleIndexes.push_back(index);
+      for (unsigned int d = 0; d < TImageType::ImageDimension; d++)
+      {
+        lower[d] = std::min(lower[d], index[d]);
+        upper[d] = std::max(upper[d], index[d]);
+      }
+    }
+  }
+
+  if (!state.sampleIndexes.empty())
+  {
+    typename TImageType::SizeType size;
+    for (unsigned int d = 0; d < TImageType::ImageDimension; d++)
+    {
+      size[d] = static_cast<itk::SizeValueType>(upper[d] - lower[d] + 1);
+    }
+    state.region.SetIndex(lower);
+    state.region.SetSize(size);
+
+    // draw the sample subset once; every iteration of every registration then only touches these voxels
+    if ((numberOfSamples > 0) && (numberOfSamples < state.sampleIndexes.size()))
+    {
+      std::mt19937 generator(5489u); // fixed seed so that repeated runs use the same samples
+      for (size_t i = 0; i < numberOfSamples; i++)
+      {
+        std::uniform_int_distribution<size_t> pick(i, state.sampleIndexes.size() - 1);
+        std::swap(state.sampleIndexes[i], state.sampleIndexes[pick(generator)]);
+      }
+      state.sampleIndexes.resize(numberOfSamples);
+
+      // restore memory order of the samples for cache friendly lookups in the fixed image
+      std::sort(state.sampleIndexes.begin(), state.sampleIndexes.end(),
+        [](const typename TImageType::IndexType &a, const typename TImageType::IndexType &b)
+      {
+        for (int d = TImageType::ImageDimension - 1; d >= 0; d--)
+        {
+          if (a[d] != b[d])
+          {
+            return a[d] < b[d];
+          }
+        }
+        return false;
+      });
+    }
+  }
+  else
+  {
+    std::cerr << "Mask of fixed image is empty; the whole fixed image is used for registration.\n";
+  }
+
+  // both sides are masked or neither is; a brain mask on one side only would pull the centers of mass apart
+  if (options.initialization == RegistrationOptions::MomentsInitialization)
+  {
+    const bool masked = !options.movingMaskFileName.empty();
+    state.moments = computeImageMoments<TImageType, TMaskImageType>(fixedImage, masked ? maskImage.GetPointer() : NULL,
+      options.numberOfThreads, NULL, masked ? &foreground : NULL);
+  }
+
+  return state;
+}
+
+/**
+\brief Get the name of a file which is written next to a registered image
+
+\param outputFileName File name of the registered image
+\param extension Extension (including the '.') which replaces the image extension
+
+\return outputFileName with its image extension replaced by 'extension'
+*/
+std::string outputFileNameWithExtension(const std::string &outputFileName, const std::string &extension)
+{
+  const std::string imageExtensions[] = { ".nii.gz", ".nii", ".nrrd", ".mha", ".mhd" };
+  for (size_t i = 0; i < sizeof(imageExtensions) / sizeof(imageExtensions[0]); i++)
+  {
+    const std::string &ext = imageExtensions[i];
+    if ((outputFileName.length() > ext.length()) &&
+      (outputFileName.compare(outputFileName.length() - ext.length(), ext.length(), ext) == 0))
+    {
+      return outputFileName.substr(0, outputFileName.length() - ext.length()) + extension;
+    }
+  }
+  return outputFileName + extension;
+}
+
+/**
+\brief Resample an image onto its own grid through an affine transform with linear interpolation
+
+\param image The image to resample
+\param transform Transform mapping output points to input points
+\param numberOfThreads Threads of the resampler; 0 uses the ITK default
+\param progressObserver Observer of the progress events, e.g., to abort the filter; may be NULL
+
+\return The resampled image, disconnected from the pipeline
+*/
+template <typename TImageType, typename TInternalComputationValueType>
+typename TImageType::Pointer affineScanlineResample(const TImageType *image,
+  const itk::AffineTransform<double, 3> *transform, unsigned int numberOfThreads, itk::Command *progressObserver)
+{
+  typedef itk::AffineScanlineResampleImageFilter<TImageType, TImageType, TInternalComputationValueType> ResampleFilterType;
+  typename ResampleFilterType::Pointer resampler = ResampleFilterType::New();
+
+  resampler->SetInput(image);
+  resampler->SetTransform(transform);
+  resampler->SetOutputParametersFromImage(image);
+  resampler->SetDefaultPixelValue(0);
+  resampler->SetInterpolation(ResampleFilterType::LINEAR);
+  if (numberOfThreads > 0)
+  {
+    resampler->SetNumberOfThreads(numberOfThreads);
+  }
+  if (progressObserver)
+  {
+    resampler->AddObserver(itk::ProgressEvent(), progressObserver);
+  }
+  resampler->Update();
+  typename TImageType::Pointer resampledImage = resampler->GetOutput();
+  resampledImage->DisconnectPipeline();
+  return resampledImage;
+}
+
+/**
+\brief Apply the registration filter
+
+\param fixedState Fixed image and its mask samples, see prepareFixedImageState()
 \param movingImage itk::Image::Pointer to moving image
-\param maskImage itk::Image::Pointer to mask of fixed image
 \param outputFileName File name of output
+\param options Options controlling the metric and threading
+
+\return RegistrationCompleted, or why the optimizer was stopped early; a cancelled registration does not
+write the resampled image
 */
-template <typename TImageType, typename TMaskImageType>
-void registrationFilter(typename TImageType::Pointer fixedImage,
+template <typename TImageType>
+RegistrationStatus registrationFilter(const FixedImageState<TImageType> &fixedState,
   typename TImageType::Pointer movingImage,
-  typename TMaskImageType::Pointer maskImage,
-  const std::string &outputFileName)
+  const std::string &outputFileName,
+  const RegistrationOptions &options = RegistrationOptions())
 {
-  // convert mask image to input image type
-  typedef itk::CastImageFilter<TMaskImageType, TImageType> CastFilterType;
-  typename CastFilterType::Pointer cast_filter = CastFilterType::New();
-  cast_filter->SetInput(maskImage);
-  cast_filter->Update();
-  typename TImageType::Pointer mask = cast_filter->GetOutput();
+  // the budget covers the whole registration, including initialization and resampling
+  RegistrationBudgetObserver::Pointer budgetObserver = RegistrationBudgetObserver::New();
+  budgetObserver->SetBudget(RegistrationBudget(options.timeBudgetSeconds, options.cancellationToken));
+
+  // the fixed image is shared with other registrations; graft it so the pipeline of this registration
+  // never writes to the shared object
+  typename TImageType::Pointer fixedImage = TImageType::New();
+  fixedImage->Graft(fixedState.image);
 
   typedef itk::ImageRegistrationMethod<TImageType, TImageType> RegistrationType;
   typedef itk::AffineTransform<double, 3> TransformType;
   typedef itk::RegularStepGradientDescentOptimizer OptimizerType;
-  typedef itk::MeanSquaresImageToImageMetric<TImageType, TImageType> MetricType;
+  typedef itk::ImageToImageMetric<TImageType, TImageType> MetricType;
+  typedef itk::MeanSquaresImageToImageMetric<TImageType, TImageType> MeanSquaresMetricType;
+  typedef itk::MattesMutualInformationImageToImageMetric<TImageType, TImageType> MattesMetricType;
+  typedef itk::FusedGradientMeanSquaresImageToImageMetric<TImageType, TImageType, float> FloatCachedMetricType;
+  typedef itk::FusedGradientMeanSquaresImageToImageMetric<TImageType, TImageType, double> DoubleCachedMetricType;
   typedef itk::LinearInterpolateImageFunction<TImageType, double> InterpolatorType;
   typedef itk::NearestNeighborInterpolateImageFunction<TImageType, double> NNInterpolatorType;
 
-  typename MetricType::Pointer metric = MetricType::New(); // typename required here because template class used -> syntax
+  typename MetricType::Pointer metric; // typename required here because template class used -> syntax
+  if (options.metric == RegistrationOptions::MattesMutualInformation)
+  {
+    // per-thread joint histograms with B-spline Parzen windowing, merged after every evaluation
+    typename MattesMetricType::Pointer mattes = MattesMetricType::New();
+    mattes->SetNumberOfHistogramBins(options.numberOfHistogramBins);
+    metric = mattes;
+  }
+  else if (!options.useGradientCache)
+  {
+    metric = MeanSquaresMetricType::New();
+  }
+  else if (options.floatGradientCache)
+  {
+    metric = FloatCachedMetricType::New();
+  }
+  else
+  {
+    metric = DoubleCachedMetricType::New();
+  }
   typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
   typename NNInterpolatorType::Pointer nn_interpolator = NNInterpolatorType::New();
   typename RegistrationType::Pointer registration = RegistrationType::New();
@@ -102,7 +403,24 @@ void registrationFilter(typename TImageType::Pointer fixedImage,
   // set the inputs
   registration->SetFixedImage(fixedImage);
   registration->SetMovingImage(movingImage);
-  registration->SetFixedImageRegion(fixedImage->GetLargestPossibleRegion());
+  registration->SetFixedImageRegion(fixedState.region);
+  if (!fixedState.sampleIndexes.empty())
+  {
+    metric->SetFixedImageIndexes(fixedState.sampleIndexes);
+  }
+  else if (options.numberOfSamples > 0)
+  {
+    metric->SetNumberOfSpatialSamples(options.numberOfSamples);
+  }
+  else
+  {
+    metric->SetUseAllPixels(true);
+  }
+  if (options.numberOfThreads > 0)
+  {
+    metric->SetNumberOfThreads(options.numberOfThreads);
+    registration->SetNumberOfThreads(options.numberOfThreads);
+  }
 
   typename RegistrationType::ParametersType initialParameters(transform->GetNumberOfParameters());
 
@@ -119,40 +437,357 @@ void registrationFilter(typename TImageType::Pointer fixedImage,
   initialParameters[10] = 0.0;
   initialParameters[11] = 0.0;
 
+  // align the centers of mass (and optionally the principal axes) instead of starting from identity
+  if (options.initialization == RegistrationOptions::MomentsInitialization)
+  {
+    typedef itk::Image<unsigned char, 3> MovingMaskImageType;
+    MovingMaskImageType::Pointer movingMask;
+    ForegroundIndex movingForeground;
+    if (!options.movingMaskFileName.empty())
+    {
+      movingMask = MovingMaskImageType::New();
+      SafeReadImage<MovingMaskImageType>(movingMask, options.movingMaskFileName);
+      if (movingMask->GetBufferedRegion().GetNumberOfPixels() == 0)
+      {
+        itkGenericExceptionMacro(<< "Could not read the moving mask '" << options.movingMaskFileName << "'");
+      }
+      movingForeground.Load(movingMask.GetPointer(), options.movingMaskFileName);
+    }
+    ImageMoments movingMoments = computeImageMoments<TImageType, MovingMaskImageType>(movingImage, movingMask.GetPointer(),
+      options.numberOfThreads, &budgetObserver->GetBudget(), movingMask.IsNotNull() ? &movingForeground : NULL);
+    if (initializeTransformFromMoments<TransformType>(transform, fixedState.moments, movingMoments, options.initializeRotation))
+    {
+      initialParameters = transform->GetParameters();
+    }
+    else
+    {
+      std::cerr << "Moments of fixed or moving image are empty; starting from identity.\n";
+    }
+  }
+
   registration->SetInitialTransformParameters(initialParameters);
 
   optimizer->SetMaximumStepLength(0.25);
   optimizer->SetMinimumStepLength(0.0001);
-  optimizer->SetNumberOfIterations(20);
+  optimizer->SetNumberOfIterations(options.numberOfIterations);
+
+  // continue a previous run from its checkpoint: parameters, step length and the remaining iterations
+  const std::string checkpointFileName = outputFileNameWithExtension(outputFileName, ".checkpoint");
+  RegistrationCheckpoint checkpoint;
+  bool resumed = false;
+  if (options.resume && readCheckpoint(checkpointFileName, checkpoint))
+  {
+    if (checkpoint.parameters.GetSize() != transform->GetNumberOfParameters())
+    {
+      std::cerr << "Ignoring checkpoint '" << checkpointFileName << "' with wrong number of parameters.\n";
+    }
+    else
+    {
+      resumed = true;
+      registration->SetInitialTransformParameters(checkpoint.parameters);
+      optimizer->SetMaximumStepLength(checkpoint.stepLength);
+      optimizer->SetNumberOfIterations(options.numberOfIterations > checkpoint.iteration ?
+        options.numberOfIterations - checkpoint.iteration : 0);
+      if (options.verbose)
+      {
+        std::cout << "Resuming from iteration " << checkpoint.iteration << " of '" << checkpointFileName << "'\n";
+      }
+    }
+  }
+
+  RegistrationTelemetryObserver::Pointer observer = RegistrationTelemetryObserver::New();
+  observer->SetIterationOffset(resumed ? checkpoint.iteration : 0);
+  if (!options.telemetryFormat.empty())
+  {
+    const bool json = (options.telemetryFormat == "json");
+    const std::string telemetryFileName = outputFileNameWithExtension(outputFileName, json ? ".telemetry.jsonl" : ".telemetry.csv");
+    if (!observer->SetTelemetryFile(telemetryFileName,
+      json ? RegistrationTelemetryObserver::JSON : RegistrationTelemetryObserver::CSV, resumed))
+    {
+      std::cerr << "Could not open telemetry file '" << telemetryFileName << "'\n";
+    }
+  }
+  if ((options.checkpointInterval > 0) || options.resume)
+  {
+    observer->SetCheckpoint(checkpointFileName, options.checkpointInterval);
+  }
+  optimizer->AddObserver(itk::StartEvent(), observer);
+  optimizer->AddObserver(itk::IterationEvent(), observer);
+  optimizer->AddObserver(itk::EndEvent(), observer);
+  optimizer->AddObserver(itk::StartEvent(), budgetObserver);
+  optimizer->AddObserver(itk::IterationEvent(), budgetObserver);
 
   registration->Update();
 
-  typename RegistrationType::ParametersType finalParameters = registration->GetLastTransformParameters();
-  std::cout << "Final parameters: " << finalParameters << std::endl;
+  // the last position of the optimizer was never evaluated and an interrupted optimizer may have just stepped
+  // uphill; the result is the best evaluated parameters, in the transform file and in the final checkpoint alike
+  RegistrationStatus status = budgetObserver->GetStatus();
+  if (budgetObserver->HasBestParameters())
+  {
+    transform->SetParameters(budgetObserver->GetBestParameters());
+    observer->WriteFinalCheckpoint(budgetObserver->GetBestParameters(), budgetObserver->GetBestValue());
+  }
+
+  typename RegistrationType::ParametersType finalParameters = transform->GetParameters();
+  if (options.verbose)
+  {
+    std::cout << "Stop condition: " << optimizer->GetStopConditionDescription() << "\n";
+    std::cout << "Status: " << registrationStatusName(status) << "\n";
+    std::cout << "Final parameters: " << finalParameters << std::endl;
+  }
+
+  if (!options.transformFileName.empty())
+  {
+    itk::TransformFileWriter::Pointer transformWriter = itk::TransformFileWriter::New();
+    transformWriter->SetInput(transform);
+    transformWriter->SetFileName(options.transformFileName);
+    transformWriter->Update();
+  }
 
   // apply transformation matrix to moving image
-  typedef itk::ResampleImageFilter<TImageType, TImageType> ResampleFilterType;
-  typename ResampleFilterType::Pointer resampler = ResampleFilterType::New();
+  typename TImageType::Pointer resampledImage;
+  try
+  {
+    if (options.genericResampler)
+    {
+      typedef itk::ResampleImageFilter<TImageType, TImageType> ResampleFilterType;
+      typename ResampleFilterType::Pointer resampler = ResampleFilterType::New();
   
-  resampler->SetInput(movingImage);
-  resampler->SetTransform(registration->GetOutput()->Get());
-  resampler->SetSize(movingImage->GetLargestPossibleRegion().GetSize());
-  resampler->SetOutputOrigin(movingImage->GetOrigin());
-  resampler->SetOutputSpacing(movingImage->GetSpacing());
-  resampler->SetOutputDirection(movingImage->GetDirection());
-  resampler->SetDefaultPixelValue(0);
-  resampler->SetInterpolator(interpolator);
+      resampler->SetInput(movingImage);
+      resampler->SetTransform(transform);
+      resampler->SetSize(movingImage->GetLargestPossibleRegion().GetSize());
+      resampler->SetOutputOrigin(movingImage->GetOrigin());
+      resampler->SetOutputSpacing(movingImage->GetSpacing());
+      resampler->SetOutputDirection(movingImage->GetDirection());
+      resampler->SetDefaultPixelValue(0);
+      resampler->SetInterpolator(interpolator);
+      if (options.numberOfThreads > 0)
+      {
+        resampler->SetNumberOfThreads(options.numberOfThreads);
+      }
+      resampler->AddObserver(itk::ProgressEvent(), budgetObserver);
+      resampler->Update();
+      resampledImage = resampler->GetOutput();
+      resampledImage->DisconnectPipeline();
+    }
+    else
+    {
+      // the final transform is affine, so the output can be resampled by stepping along scanlines
+      resampledImage = options.singlePrecision ?
+        affineScanlineResample<TImageType, float>(movingImage, transform, options.numberOfThreads, budgetObserver) :
+        affineScanlineResample<TImageType, double>(movingImage, transform, options.numberOfThreads, budgetObserver);
+    }
+  }
+  catch (itk::ProcessAborted &)
+  {
+    if (options.verbose)
+    {
+      std::cout << "Resampling cancelled; the output image is not written.\n";
+    }
+    return RegistrationCancelled;
+  }
 
   typedef itk::ImageFileWriter<TImageType> WriterType;
   typename WriterType::Pointer writer = WriterType::New();
   writer->SetFileName(outputFileName);
-  writer->SetInput(resampler->GetOutput());
+  writer->SetInput(resampledImage);
   writer->Update();
+
+  return status;
+}
+
+/**
+\brief Register a list of moving images to one fixed image
+
+The fixed image state is prepared once by the caller and shared by all registrations. 'numberOfWorkers'
+registrations run at the same time, each one using options.numberOfThreads threads. Every job writes
+the resampled moving image and its transform (see outputFileNameWithExtension()). Once the cancellation
+token is set, jobs which have not started yet are skipped and count as failed.
+
+\param fixedState Fixed image and its mask samples, see prepareFixedImageState()
+\param jobs Pairs of (moving image file, output file)
+\param numberOfWorkers Number of concurrent registrations
+\param options Options used for every registration
+
+\return Number of failed registrations
+*/
+template <typename TImageType>
+size_t batchRegistration(const FixedImageState<TImageType> &fixedState,
+  const std::vector< std::pair< std::string, std::string > > &jobs,
+  unsigned int numberOfWorkers,
+  const RegistrationOptions &options)
+{
+  std::atomic< size_t > nextJob(0), failures(0);
+  std::mutex outputMutex;
+
+  auto worker = [&]()
+  {
+    for (size_t job = nextJob++; job < jobs.size(); job = nextJob++)
+    {
+      if (options.cancellationToken && options.cancellationToken->load())
+      {
+        failures++;
+        continue;
+      }
+      RegistrationOptions jobOptions = options;
+      jobOptions.verbose = false;
+      jobOptions.transformFileName = outputFileNameWithExtension(jobs[job].second, ".tfm");
+
+      try
+      {
+        typename TImageType::Pointer movingImage = TImageType::New();
+        SafeReadImage<TImageType>(movingImage, jobs[job].first);
+        RegistrationStatus status = registrationFilter<TImageType>(fixedState, movingImage, jobs[job].second, jobOptions);
+        if (status == RegistrationCancelled)
+        {
+          failures++;
+        }
+
+        std::lock_guard< std::mutex > lock(outputMutex);
+        std::cout << "[" << job + 1 << "/" << jobs.size() << "] Registered '" << jobs[job].first << "' (" <<
+          registrationStatusName(status) << ")\n";
+      }
+      catch (itk::ExceptionObject &e)
+      {
+        failures++;
+        std::lock_guard< std::mutex > lock(outputMutex);
+        std::cerr << "[" << job + 1 << "/" << jobs.size() << "] Registration of '" << jobs[job].first <<
+          "' failed: " << e.what() << "\n";
+      }
+      catch (std::exception &e) // e.g., std::bad_alloc; an exception escaping a worker would terminate the batch
+      {
+        failures++;
+        std::lock_guard< std::mutex > lock(outputMutex);
+        std::cerr << "[" << job + 1 << "/" << jobs.size() << "] Registration of '" << jobs[job].first <<
+          "' failed: " << e.what() << "\n";
+      }
+    }
+  };
+
+  std::vector< std::thread > workers;
+  for (unsigned int i = 0; i < std::max(1u, numberOfWorkers); i++)
+  {
+    workers.push_back(std::thread(worker));
+  }
+  for (size_t i = 0; i < workers.size(); i++)
+  {
+    workers[i].join();
+  }
+
+  return failures;
+}
+
+/**
+\brief Read the job list of a batch registration
+
+\param listFileName Text file with one "<movingImageFile> <outputFileName>" pair per line
+
+\return Pairs of (moving image file, output file)
+*/
+std::vector< std::pair< std::string, std::string > > readBatchList(const std::string &listFileName)
+{
+  std::vector< std::pair< std::string, std::string > > jobs;
+  std::ifstream infile(listFileName.c_str());
+  for (std::string line; std::getline(infile, line);)
+  {
+    std::istringstream stream(line);
+    std::string moving, output;
+    if (stream >> moving >> output)
+    {
+      jobs.push_back(std::make_pair(moving, output));
+    }
+    else if (!moving.empty())
+    {
+      std::cerr << "Skipping line without output file name in '" << listFileName << "': " << line << "\n";
+    }
+  }
+  return jobs;
+}
+
+/**
+\brief Read the fixed image with pixel type TPixelType and register the moving image, or every image of a batch, to it
+
+The images keep their storage type from reading to writing the resampled result; the metrics, interpolators
+and resamplers convert to real values per sample, so no float copy of a volume is made.
+
+\param fixedFileName The fixed image
+\param mask Mask of the fixed image
+\param foreground Runs of the non-zero voxels of 'mask'
+\param movingFileName The moving image; unused in batch mode
+\param outputFileName The output of the moving image; unused in batch mode
+\param jobs The batch; empty for a single registration
+\param batch Whether this is a batch registration
+\param numberOfWorkers Concurrent registrations in batch mode
+\param options Options used for every registration
+
+\return EXIT_SUCCESS or EXIT_FAILURE
+*/
+template <typename TPixelType, typename TMaskImageType>
+int runRegistration(const std::string &fixedFileName, typename TMaskImageType::Pointer mask, const ForegroundIndex &foreground,
+  const std::string &movingFileName, const std::string &outputFileName,
+  const std::vector< std::pair< std::string, std::string > > &jobs, bool batch,
+  unsigned int numberOfWorkers, const RegistrationOptions &options)
+{
+  typedef itk::Image<TPixelType, 3> ImageType; // define image type
+  typename ImageType::Pointer image_1 = ImageType::New(); // initialize new image
+  SafeReadImage<ImageType>(image_1, fixedFileName); // read image along with exceptions
+
+  // everything that only depends on the fixed image is computed once
+  FixedImageState<ImageType> fixedState = prepareFixedImageState<ImageType, TMaskImageType>(image_1, mask, foreground,
+    options);
+
+  if (batch)
+  {
+    std::cout << "Doing batch registration of " << jobs.size() << " images with " << numberOfWorkers << " worker(s)...\n";
+    size_t failures = batchRegistration<ImageType>(fixedState, jobs, numberOfWorkers, options);
+    if (failures > 0)
+    {
+      std::cerr << failures << " of " << jobs.size() << " registrations failed.\n";
+      return EXIT_FAILURE;
+    }
+  }
+  else
+  {
+    std::cout << "Doing registration...\n";
+    typename ImageType::Pointer image_2 = ImageType::New();
+    SafeReadImage<ImageType>(image_2, movingFileName);
+    if (registrationFilter<ImageType>(fixedState, image_2, outputFileName, options) == RegistrationCancelled)
+    {
+      std::cerr << "Registration cancelled.\n";
+      return EXIT_FAILURE;
+    }
+  }
+  return EXIT_SUCCESS;
 }
 
 void echoUsage(const std::string &exeName)
 {
-  std::cout << exeName << " <inputImageFile1> <inputImageFile2> <outputFileName> <inputImageFile2Mask>\n" <<
+  std::cout << exeName << " <inputImageFile1> <inputImageFile2> <outputFileName> <inputImageFile2Mask> [options]\n" <<
+    exeName << " -batch <listFile> <fixedImageFile> <fixedImageMask> [options]\n" <<
+    "  listFile contains one '<movingImageFile> <outputFileName>' pair per line; the transforms are\n" <<
+    "  written next to the outputs with the extension '.tfm'\n" <<
+    "Options:\n" <<
+    "  -metric <mattes|meansquares>   Similarity metric (default: mattes, mutual information for multimodal pairs)\n" <<
+    "  -bins <n>                      Histogram bins of the mattes metric (default: 50)\n" <<
+    "  -samples <n>                   Random subset of mask voxels used as samples (default: all)\n" <<
+    "  -gradientCache <float|double>  Precompute the moving image gradient; meansquares only (default: off)\n" <<
+    "  -workers <n>                   Concurrent registrations in batch mode (default: 1)\n" <<
+    "  -threads <n>                   Total number of threads, split between the workers (default: number of cores\n" <<
+    "                                 in batch mode, ITK default otherwise)\n" <<
+    "  -iterations <n>                Iteration budget of the optimizer (default: 20)\n" <<
+    "  -telemetry <csv|json>          Write per-iteration telemetry to '<output>.telemetry.csv|jsonl'\n" <<
+    "  -checkpointEvery <n>           Write the optimizer state to '<output>.checkpoint' every n iterations\n" <<
+    "  -resume                        Continue from '<output>.checkpoint' if it exists\n" <<
+    "  -init <moments|identity>       Initial transform (default: moments, aligns the centers of mass)\n" <<
+    "  -initRotation                  Also align the principal axes when initializing from moments\n" <<
+    "  -movingMask <file>             Mask of the moving image; the moments of both images are then computed inside\n" <<
+    "                                 their masks, otherwise both are unmasked (single registration only)\n" <<
+    "  -genericResampler              Resample with itk::ResampleImageFilter (default: affine scanline resampler)\n" <<
+    "  -precision <float|double>      Precision of the meansquares metric and the scanline resampler (default: double);\n" <<
+    "                                 float implies '-gradientCache float'. With mattes only the resampler runs in float\n" <<
+    "  -timeBudget <seconds>          Wall time per registration; then the best parameters so far are used (default: none)\n" <<
+    "SIGTERM/SIGINT stop running registrations after their current iteration; their transforms and checkpoints\n" <<
+    "are still written.\n" <<
     "NOTE - Only 3D images are supported in this example.\n";
 }
 
@@ -162,20 +797,191 @@ int main(int argc, char *argv[])
   try // to catch exceptions
   {
     // basic check to see image file has been put in by the user
-    if( (argc < 2) )
+    if( (argc < 5) )
     {
       std::cerr << "Usage: " << std::endl;
       echoUsage(argv[0]);
       return EXIT_FAILURE;
     }
 
-    std::string inputFName1 = "", inputFName2 = "", inputMask2 = "", outputFName = "";
-    bool segFlag = false, mulFlag = false, regFlag = false;
+    std::string inputFName1 = "", inputFName2 = "", inputMask2 = "", outputFName = "", batchListFName = "";
+    RegistrationOptions options;
+    unsigned int numberOfWorkers = 1, totalThreads = 0;
+    bool gradientCacheRequested = false; // an explicit '-gradientCache' is not overridden by '-precision'
 
-    inputFName1 = argv[2];
-    inputFName2 = argv[3];
-    inputMask2 = argv[4];
-    outputFName = argv[5];
+    if (std::string(argv[1]) == "-batch")
+    {
+      batchListFName = argv[2];
+      inputFName1 = argv[3];
+      inputMask2 = argv[4];
+    }
+    else
+    {
+      inputFName1 = argv[1];
+      inputFName2 = argv[2];
+      outputFName = argv[3];
+      inputMask2 = argv[4];
+    }
+
+    for (int i = 5; i < argc; i++)
+    {
+      std::string option = argv[i];
+      if ((option == "-metric") && (i + 1 < argc))
+      {
+        std::string metric = argv[++i];
+        if (metric == "mattes")
+        {
+          options.metric = RegistrationOptions::MattesMutualInformation;
+        }
+        else if (metric == "meansquares")
+        {
+          options.metric = RegistrationOptions::MeanSquares;
+        }
+        else
+        {
+          std::cerr << "Unsupported metric '" << metric << "'\n";
+          return EXIT_FAILURE;
+        }
+      }
+      else if ((option == "-bins") && (i + 1 < argc))
+      {
+        options.numberOfHistogramBins = std::max(5, std::atoi(argv[++i]));
+      }
+      else if ((option == "-samples") && (i + 1 < argc))
+      {
+        options.numberOfSamples = static_cast<size_t>(std::max(0, std::atoi(argv[++i])));
+      }
+      else if ((option == "-gradientCache") && (i + 1 < argc))
+      {
+        std::string precision = argv[++i];
+        if ((precision != "float") && (precision != "double"))
+        {
+          std::cerr << "Unsupported gradient cache precision '" << precision << "'\n";
+          return EXIT_FAILURE;
+        }
+        options.useGradientCache = true;
+        options.floatGradientCache = (precision == "float");
+        gradientCacheRequested = true;
+      }
+      else if ((option == "-workers") && (i + 1 < argc))
+      {
+        numberOfWorkers = std::max(1, std::atoi(argv[++i]));
+      }
+      else if ((option == "-threads") && (i + 1 < argc))
+      {
+        totalThreads = std::max(0, std::atoi(argv[++i]));
+      }
+      else if ((option == "-iterations") && (i + 1 < argc))
+      {
+        options.numberOfIterations = std::max(0, std::atoi(argv[++i]));
+      }
+      else if ((option == "-telemetry") && (i + 1 < argc))
+      {
+        options.telemetryFormat = argv[++i];
+        if ((options.telemetryFormat != "csv") && (options.telemetryFormat != "json"))
+        {
+          std::cerr << "Unsupported telemetry format '" << options.telemetryFormat << "'\n";
+          return EXIT_FAILURE;
+        }
+      }
+      else if ((option == "-checkpointEvery") && (i + 1 < argc))
+      {
+        options.checkpointInterval = std::max(0, std::atoi(argv[++i]));
+      }
+      else if (option == "-resume")
+      {
+        options.resume = true;
+      }
+      else if ((option == "-init") && (i + 1 < argc))
+      {
+        std::string initialization = argv[++i];
+        if (initialization == "moments")
+        {
+          options.initialization = RegistrationOptions::MomentsInitialization;
+        }
+        else if (initialization == "identity")
+        {
+          options.initialization = RegistrationOptions::IdentityInitialization;
+        }
+        else
+        {
+          std::cerr << "Unsupported initialization '" << initialization << "'\n";
+          return EXIT_FAILURE;
+        }
+      }
+      else if (option == "-initRotation")
+      {
+        options.initializeRotation = true;
+      }
+      else if ((option == "-movingMask") && (i + 1 < argc))
+      {
+        options.movingMaskFileName = argv[++i];
+      }
+      else if (option == "-genericResampler")
+      {
+        options.genericResampler = true;
+      }
+      else if ((option == "-timeBudget") && (i + 1 < argc))
+      {
+        options.timeBudgetSeconds = std::max(0.0, std::atof(argv[++i]));
+      }
+      else if ((option == "-precision") && (i + 1 < argc))
+      {
+        std::string precision = argv[++i];
+        if ((precision != "float") && (precision != "double"))
+        {
+          std::cerr << "Unsupported precision '" << precision << "'\n";
+          return EXIT_FAILURE;
+        }
+        options.singlePrecision = (precision == "float");
+      }
+      else
+      {
+        std::cerr << "Unknown option '" << option << "'\n";
+        echoUsage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
+
+    if (!batchListFName.empty() && !options.movingMaskFileName.empty())
+    {
+      std::cerr << "'-movingMask' belongs to a single moving image and cannot be used with '-batch'.\n";
+      return EXIT_FAILURE;
+    }
+
+    // the fused metric is the single precision path of meansquares; ITK's own metrics are double only
+    if (options.singlePrecision && (options.metric == RegistrationOptions::MeanSquares))
+    {
+      if (gradientCacheRequested && !options.floatGradientCache)
+      {
+        std::cerr << "'-precision float' evaluates meansquares with a float gradient cache and contradicts " <<
+          "'-gradientCache double'.\n";
+        return EXIT_FAILURE;
+      }
+      options.useGradientCache = true;
+      options.floatGradientCache = true;
+    }
+    if (options.useGradientCache && (options.metric != RegistrationOptions::MeanSquares))
+    {
+      std::cerr << "The gradient cache is only used by the meansquares metric; ignoring '-gradientCache'.\n";
+      options.useGradientCache = false;
+    }
+
+    // a scheduler's SIGTERM stops the optimizers cooperatively instead of losing all work
+    installCancellationHandlers();
+    options.cancellationToken = &processCancellationToken();
+
+    // the thread budget is split between the concurrent registrations, so that their metrics, registrations and
+    // resamplers together stay within it; a batch without '-threads' shares the cores
+    if (!batchListFName.empty() && (totalThreads == 0))
+    {
+      totalThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (totalThreads > 0)
+    {
+      options.numberOfThreads = std::max(1u, totalThreads / numberOfWorkers);
+      itk::MultiThreader::SetGlobalDefaultNumberOfThreads(options.numberOfThreads);
+    }
 
     //std::string iterations_string = argv[5];
     //outputFName = outputFName + iterations_string + ".nii";
@@ -185,23 +991,20 @@ int main(int argc, char *argv[])
     im_base->SetFileName(inputFName1);
     im_base->ReadImageInformation();
 
-    itk::ImageIOBase::Pointer im_base_2 = itk::ImageIOFactory::CreateImageIO(inputFName2.c_str(),
-    im_base_2->SetFileName(inputFName2);
-    im_base_2->ReadImageInformation();
-    
-    if (im_base->GetComponentType() != im_base_2->GetComponentType())
+    if (batchListFName.empty())
     {
-      std::cerr << "Image type mismatch between images 1 & 2. Please check files\n" <<
-        inputFName1 << " and " << inputFName2 << "\n";
-      return EXIT_FAILURE;
+      itk::ImageIOBase::Pointer im_base_2 = itk::ImageIOFactory::CreateImageIO(inputFName2.c_str(), itk::ImageIOFactory::ReadMode);
+      im_base_2->SetFileName(inputFName2);
+      im_base_2->ReadImageInformation();
+    
+      if (im_base->GetNumberOfDimensions() != im_base_2->GetNumberOfDimensions())
+      {
+        std::cerr << "Image dimension mismatch between images 1 & 2. Please check files\n" <<
+          inputFName1 << " and " << inputFName2 << "\n";
+        return EXIT_FAILURE;
+      } 
     }
-    else if (im_base->GetNumberOfDimensions() != im_base_2->GetNumberOfDimensions())
-    {
-      std::cerr << "Image dimension mismatch between images 1 & 2. Please check files\n" <<
-        inputFName1 << " and " << inputFName2 << "\n";
-      return EXIT_FAILURE;
-    } 
-    else if (im_base->GetNumberOfDimensions() != 3)
+    if (im_base->GetNumberOfDimensions() != 3)
     {
       std::cerr << "Unsupported Image Dimension. Only 3D images are currently supported.\n";
       return EXIT_FAILURE;
@@ -225,17 +1028,53 @@ int main(int argc, char *argv[])
         std::cerr << "Unsupported Image Dimension for image mask.\n";
         return EXIT_FAILURE;
     }
+
+    // the runs of the mask are read from next to it if they were written before, so the mask is only scanned once
+    ForegroundIndex foreground;
+    foreground.Load(mask_reader->GetOutput(), inputMask2);
     
-    typedef float PixelType; // default pixel type is float, all voxel data is static-casted
-    typedef itk::Image<PixelType, 3> ImageType; // define image type
-    ImageType::Pointer image_1 = ImageType::New(); // initialize new image
-    SafeReadImage<ImageType>(image_1, im_base->GetFileName()); // read image along with exceptions
-    
-    std::cout << "Doing registration...\n";
-    ImageType::Pointer image_2 = ImageType::New();
-    SafeReadImage<ImageType>(image_2, inputFName2);
-    registrationFilter<ImageType, MaskImageType>(image_1, image_2, mask_reader->GetOutput(),
-        
+    // the images are processed with their storage type; if the moving image, or any moving image of a batch,
+    // differs in type from the fixed image, all are processed as float, which holds the values of all of them
+    std::vector< std::pair< std::string, std::string > > jobs;
+    std::vector< std::string > imageFileNames(1, inputFName1);
+    if (batchListFName.empty())
+    {
+      imageFileNames.push_back(inputFName2);
+    }
+    else
+    {
+      jobs = readBatchList(batchListFName);
+      for (size_t job = 0; job < jobs.size(); job++)
+      {
+        imageFileNames.push_back(jobs[job].first);
+      }
+    }
+    const itk::ImageIOBase::IOComponentType componentType = commonComponentType(imageFileNames);
+
+    int result = EXIT_FAILURE;
+    switch (componentType)
+    {
+    case itk::ImageIOBase::UCHAR:
+      result = runRegistration<unsigned char, MaskImageType>(im_base->GetFileName(), mask_reader->GetOutput(), foreground,
+        inputFName2, outputFName, jobs, !batchListFName.empty(), numberOfWorkers, options);
+      break;
+    case itk::ImageIOBase::USHORT:
+      result = runRegistration<unsigned short, MaskImageType>(im_base->GetFileName(), mask_reader->GetOutput(), foreground,
+        inputFName2, outputFName, jobs, !batchListFName.empty(), numberOfWorkers, options);
+      break;
+    case itk::ImageIOBase::SHORT:
+      result = runRegistration<short, MaskImageType>(im_base->GetFileName(), mask_reader->GetOutput(), foreground,
+        inputFName2, outputFName, jobs, !batchListFName.empty(), numberOfWorkers, options);
+      break;
+    default: // everything else is static-casted to float
+      result = runRegistration<float, MaskImageType>(im_base->GetFileName(), mask_reader->GetOutput(), foreground,
+        inputFName2, outputFName, jobs, !batchListFName.empty(), numberOfWorkers, options);
+      break;
+    }
+    if (result != EXIT_SUCCESS)
+    {
+      return result;
+    }
   }
   catch (itk::ExceptionObject &error)
   {
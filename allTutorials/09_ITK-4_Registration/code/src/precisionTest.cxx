@@ -0,0 +1,166 @@
+/**
+\brief 09_ITK-4: single against double precision of the fused metric and the scanline resampler
+
+Registers nothing; evaluates the meansquares metric (value and derivative) and resamples a synthetic volume
+with float and with double internal computations and checks that they agree within a tolerance. Run by ctest.
+*/
+
+//! ITK headers
+#include "itkImage.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkAffineTransform.h"
+#include "itkLinearInterpolateImageFunction.h"
+
+#include "itkFusedGradientMeanSquaresImageToImageMetric.h"
+#include "itkAffineScanlineResampleImageFilter.h"
+
+#include <cmath>
+#include <iostream>
+#include <algorithm>
+
+typedef itk::Image<float, 3> ImageType;
+typedef itk::AffineTransform<double, 3> TransformType;
+
+/**
+\brief Smooth synthetic volume: an anisotropic Gaussian blob with a ramp, centered at 'center' (in voxels)
+*/
+ImageType::Pointer createBlob(const double center[3])
+{
+  ImageType::SizeType size;
+  size[0] = 48;
+  size[1] = 40;
+  size[2] = 32;
+  ImageType::RegionType region;
+  region.SetSize(size);
+  ImageType::SpacingType spacing;
+  spacing[0] = 1.0;
+  spacing[1] = 1.2;
+  spacing[2] = 1.5;
+
+  ImageType::Pointer image = ImageType::New();
+  image->SetRegions(region);
+  image->SetSpacing(spacing);
+  image->Allocate();
+
+  itk::ImageRegionIteratorWithIndex<ImageType> it(image, region);
+  for (it.GoToBegin(); !it.IsAtEnd(); ++it)
+  {
+    const ImageType::IndexType &index = it.GetIndex();
+    const double x = (index[0] - center[0]) / 9.0, y = (index[1] - center[1]) / 7.0, z = (index[2] - center[2]) / 6.0;
+    it.Set(static_cast<float>(1000.0 * std::exp(-(x * x + y * y + z * z)) + 2.0 * index[0]));
+  }
+  return image;
+}
+
+/**
+\brief Value and derivative of the fused metric with internal computation type TInternalComputationValueType
+*/
+template <typename TInternalComputationValueType>
+void evaluateMetric(ImageType::Pointer fixedImage, ImageType::Pointer movingImage, TransformType::Pointer transform,
+  double &value, itk::Array<double> &derivative)
+{
+  typedef itk::FusedGradientMeanSquaresImageToImageMetric<ImageType, ImageType, TInternalComputationValueType> MetricType;
+  typedef itk::LinearInterpolateImageFunction<ImageType, double> InterpolatorType;
+
+  typename MetricType::Pointer metric = MetricType::New();
+  metric->SetFixedImage(fixedImage);
+  metric->SetMovingImage(movingImage);
+  metric->SetFixedImageRegion(fixedImage->GetBufferedRegion());
+  metric->SetTransform(transform);
+  metric->SetInterpolator(InterpolatorType::New());
+  metric->Initialize();
+
+  typename MetricType::DerivativeType metricDerivative;
+  typename MetricType::MeasureType metricValue;
+  metric->GetValueAndDerivative(transform->GetParameters(), metricValue, metricDerivative);
+  value = metricValue;
+  derivative = metricDerivative;
+}
+
+template <typename TInternalComputationValueType>
+ImageType::Pointer resample(ImageType::Pointer image, TransformType::Pointer transform)
+{
+  typedef itk::AffineScanlineResampleImageFilter<ImageType, ImageType, TInternalComputationValueType> ResampleFilterType;
+  typename ResampleFilterType::Pointer resampler = ResampleFilterType::New();
+  resampler->SetInput(image);
+  resampler->SetTransform(transform);
+  resampler->SetOutputParametersFromImage(image);
+  resampler->SetInterpolation(ResampleFilterType::LINEAR);
+  resampler->Update();
+  return resampler->GetOutput();
+}
+
+int main(int, char *[])
+{
+  const double fixedCenter[3] = { 24.0, 20.0, 16.0 }, movingCenter[3] = { 25.5, 19.0, 17.0 };
+  ImageType::Pointer fixedImage = createBlob(fixedCenter);
+  ImageType::Pointer movingImage = createBlob(movingCenter);
+
+  // a small rotation about z and a translation, with the center of rotation in the middle of the volume
+  TransformType::Pointer transform = TransformType::New();
+  TransformType::InputPointType center;
+  center[0] = 24.0;
+  center[1] = 24.0;
+  center[2] = 24.0;
+  transform->SetCenter(center);
+  transform->Rotate2D(0.05, false);
+  TransformType::OutputVectorType translation;
+  translation[0] = 0.7;
+  translation[1] = -0.4;
+  translation[2] = 0.9;
+  transform->Translate(translation);
+
+  int result = EXIT_SUCCESS;
+  try
+  {
+    // metric: the float path accumulates in double, so only the per-sample lookups differ
+    double floatValue, doubleValue;
+    itk::Array<double> floatDerivative, doubleDerivative;
+    evaluateMetric<float>(fixedImage, movingImage, transform, floatValue, floatDerivative);
+    evaluateMetric<double>(fixedImage, movingImage, transform, doubleValue, doubleDerivative);
+
+    const double valueError = std::fabs(floatValue - doubleValue) / std::max(std::fabs(doubleValue), 1e-12);
+    double derivativeError = 0, derivativeNorm = 0;
+    for (unsigned int i = 0; i < doubleDerivative.GetSize(); i++)
+    {
+      derivativeError += (floatDerivative[i] - doubleDerivative[i]) * (floatDerivative[i] - doubleDerivative[i]);
+      derivativeNorm += doubleDerivative[i] * doubleDerivative[i];
+    }
+    derivativeError = std::sqrt(derivativeError / std::max(derivativeNorm, 1e-24));
+    std::cout << "Metric value: " << doubleValue << " (double), " << floatValue << " (float), relative error " <<
+      valueError << "\n";
+    std::cout << "Metric derivative: relative error " << derivativeError << "\n";
+    if ((valueError > 1e-4) || (derivativeError > 1e-3))
+    {
+      std::cerr << "Single precision metric differs from double precision.\n";
+      result = EXIT_FAILURE;
+    }
+
+    // resampler: largest voxel difference relative to the intensity range
+    ImageType::Pointer floatResampled = resample<float>(movingImage, transform);
+    ImageType::Pointer doubleResampled = resample<double>(movingImage, transform);
+    const float *floatBuffer = floatResampled->GetBufferPointer(), *doubleBuffer = doubleResampled->GetBufferPointer();
+    const size_t numberOfPixels = doubleResampled->GetBufferedRegion().GetNumberOfPixels();
+    double maximumDifference = 0, minimum = doubleBuffer[0], maximum = doubleBuffer[0];
+    for (size_t i = 0; i < numberOfPixels; i++)
+    {
+      maximumDifference = std::max(maximumDifference, static_cast<double>(std::fabs(floatBuffer[i] - doubleBuffer[i])));
+      minimum = std::min(minimum, static_cast<double>(doubleBuffer[i]));
+      maximum = std::max(maximum, static_cast<double>(doubleBuffer[i]));
+    }
+    const double resampleError = maximumDifference / std::max(maximum - minimum, 1e-12);
+    std::cout << "Resampler: largest difference " << maximumDifference << ", relative to the range " << resampleError << "\n";
+    if (resampleError > 1e-4)
+    {
+      std::cerr << "Single precision resampler differs from double precision.\n";
+      result = EXIT_FAILURE;
+    }
+  }
+  catch (itk::ExceptionObject &error)
+  {
+    std::cerr << "Exception caught: " << error << "\n";
+    return EXIT_FAILURE;
+  }
+
+  return result;
+}
@@ -0,0 +1,227 @@
+#pragma once
+
+#include "itkCommand.h"
+#include "itkProcessObject.h"
+#include "itkRegularStepGradientDescentBaseOptimizer.h"
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+
+/**
+\brief Outcome of a registration
+*/
+enum RegistrationStatus
+{
+  RegistrationCompleted, //! the optimizer converged or used up its iterations
+  RegistrationTimeBudgetExceeded, //! stopped at the time budget; the result holds the best parameters so far
+  RegistrationCancelled //! stopped by the cancellation token; the result holds the best parameters so far
+};
+
+inline const char *registrationStatusName(RegistrationStatus status)
+{
+  switch (status)
+  {
+  case RegistrationCompleted:
+    return "completed";
+  case RegistrationTimeBudgetExceeded:
+    return "timeBudgetExceeded";
+  default:
+    return "cancelled";
+  }
+}
+
+/**
+\brief Process wide cancellation token; set by SIGTERM/SIGINT once installCancellationHandlers() was called
+*/
+inline std::atomic< bool > &processCancellationToken()
+{
+  static std::atomic< bool > token(false);
+  return token;
+}
+
+extern "C" inline void cancellationSignalHandler(int)
+{
+  processCancellationToken() = true; // lock free atomic stores are safe in a signal handler
+}
+
+//! Turn SIGTERM and SIGINT into a cooperative cancellation of the running registrations
+inline void installCancellationHandlers()
+{
+  std::signal(SIGTERM, cancellationSignalHandler);
+  std::signal(SIGINT, cancellationSignalHandler);
+}
+
+/**
+\brief Wall-clock budget and cancellation token of one registration
+
+Both are only polled: the optimizer checks them once per iteration and the long-running filters once per
+scanline or slice, so a registration stops within one iteration of the deadline.
+*/
+class RegistrationBudget
+{
+public:
+  //! No deadline and no token; never exhausted
+  RegistrationBudget() :
+    m_HasDeadline(false), m_Token(NULL)
+  {
+  }
+
+  /**
+  \param seconds Wall time from now until the deadline; 0 means no deadline
+  \param token Registration stops as soon as this is true; may be NULL
+  */
+  RegistrationBudget(double seconds, const std::atomic< bool > *token) :
+    m_HasDeadline(seconds > 0), m_Token(token)
+  {
+    m_Deadline = std::chrono::steady_clock::now() +
+      std::chrono::duration_cast< std::chrono::steady_clock::duration >(std::chrono::duration< double >(seconds));
+  }
+
+  bool IsCancelled() const
+  {
+    return (m_Token != NULL) && m_Token->load();
+  }
+
+  bool IsExpired() const
+  {
+    return m_HasDeadline && (std::chrono::steady_clock::now() >= m_Deadline);
+  }
+
+  bool IsExhausted() const
+  {
+    return this->IsCancelled() || this->IsExpired();
+  }
+
+  //! Status of a registration which stopped now; cancellation takes precedence over the deadline
+  RegistrationStatus GetStatus() const
+  {
+    return this->IsCancelled() ? RegistrationCancelled :
+      (this->IsExpired() ? RegistrationTimeBudgetExceeded : RegistrationCompleted);
+  }
+
+private:
+  bool m_HasDeadline;
+  std::chrono::steady_clock::time_point m_Deadline;
+  const std::atomic< bool > *m_Token;
+};
+
+/**
+\brief Observer which enforces a RegistrationBudget on an optimizer and on filters
+
+On the IterationEvent of a gradient descent optimizer it records the parameters with the lowest metric value
+seen so far and stops the optimizer once the budget is exhausted. On the ProgressEvent of a filter it aborts
+the filter once the token is cancelled; the filter then throws itk::ProcessAborted. The deadline alone does
+not abort filters, since they produce the result of a registration which already stopped.
+*/
+class RegistrationBudgetObserver : public itk::Command
+{
+public:
+  typedef RegistrationBudgetObserver Self;
+  typedef itk::Command Superclass;
+  typedef itk::SmartPointer< Self > Pointer;
+  itkNewMacro(Self);
+
+  typedef itk::RegularStepGradientDescentBaseOptimizer OptimizerType;
+  typedef OptimizerType::ParametersType ParametersType;
+
+  void SetBudget(const RegistrationBudget &budget)
+  {
+    m_Budget = budget;
+  }
+
+  const RegistrationBudget &GetBudget() const
+  {
+    return m_Budget;
+  }
+
+  //! True if the optimizer was stopped by the budget
+  bool GetStopped() const
+  {
+    return m_Stopped;
+  }
+
+  //! Completed unless the optimizer was stopped by the budget
+  RegistrationStatus GetStatus() const
+  {
+    return m_Status;
+  }
+
+  //! True once at least one metric value was seen
+  bool HasBestParameters() const
+  {
+    return m_HasBest;
+  }
+
+  const ParametersType &GetBestParameters() const
+  {
+    return m_BestParameters;
+  }
+
+  double GetBestValue() const
+  {
+    return m_BestValue;
+  }
+
+  void Execute(itk::Object *caller, const itk::EventObject &event)
+  {
+    if (itk::ProgressEvent().CheckEvent(&event))
+    {
+      itk::ProcessObject *filter = dynamic_cast< itk::ProcessObject * >(caller);
+      if (filter && m_Budget.IsCancelled())
+      {
+        filter->AbortGenerateDataOn();
+      }
+      return;
+    }
+
+    OptimizerType *optimizer = dynamic_cast< OptimizerType * >(caller);
+    if (optimizer == NULL)
+    {
+      return;
+    }
+
+    if (itk::StartEvent().CheckEvent(&event))
+    {
+      m_EvaluatedPosition = optimizer->GetCurrentPosition();
+    }
+    else if (itk::IterationEvent().CheckEvent(&event))
+    {
+      // the value belongs to the position before the step which invoked this event
+      if (!m_HasBest || (optimizer->GetValue() < m_BestValue))
+      {
+        m_HasBest = true;
+        m_BestValue = optimizer->GetValue();
+        m_BestParameters = m_EvaluatedPosition;
+      }
+      m_EvaluatedPosition = optimizer->GetCurrentPosition();
+
+      if (!m_Stopped && m_Budget.IsExhausted())
+      {
+        m_Stopped = true;
+        m_Status = m_Budget.GetStatus();
+        optimizer->StopOptimization();
+      }
+    }
+  }
+
+  void Execute(const itk::Object *caller, const itk::EventObject &event)
+  {
+    Execute(const_cast< itk::Object * >(caller), event);
+  }
+
+protected:
+  RegistrationBudgetObserver() :
+    m_Stopped(false), m_Status(RegistrationCompleted), m_HasBest(false), m_BestValue(0)
+  {
+  }
+
+private:
+  RegistrationBudget m_Budget;
+  bool m_Stopped;
+  RegistrationStatus m_Status;
+  bool m_HasBest;
+  double m_BestValue;
+  ParametersType m_BestParameters;
+  ParametersType m_EvaluatedPosition;
+};
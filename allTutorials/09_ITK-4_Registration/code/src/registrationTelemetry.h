@@ -0,0 +1,332 @@
+#pragma once
+
+#include "itkCommand.h"
+#include "itkRegularStepGradientDescentBaseOptimizer.h"
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstdio>
+#include <chrono>
+
+/**
+\brief Optimizer state needed to resume a registration
+*/
+struct RegistrationCheckpoint
+{
+  RegistrationCheckpoint() :
+    iteration(0), stepLength(0), value(0)
+  {
+  }
+
+  unsigned int iteration; //! number of iterations already done
+  double stepLength; //! current step length of the optimizer
+  double value; //! metric value at 'parameters'
+  itk::Optimizer::ParametersType parameters; //! transform parameters; always a position the metric was evaluated at
+};
+
+/**
+\brief Write a checkpoint; the file is replaced atomically so a killed job never leaves a partial checkpoint
+
+\return True if successful
+*/
+inline bool writeCheckpoint(const std::string &fileName, const RegistrationCheckpoint &checkpoint)
+{
+  const std::string temporaryFileName = fileName + ".tmp";
+  {
+    std::ofstream outfile(temporaryFileName.c_str());
+    if (!outfile)
+    {
+      return false;
+    }
+    outfile << std::setprecision(17);
+    outfile << "iteration " << checkpoint.iteration << "\n";
+    outfile << "stepLength " << checkpoint.stepLength << "\n";
+    outfile << "value " << checkpoint.value << "\n";
+    outfile << "parameters";
+    for (unsigned int i = 0; i < checkpoint.parameters.GetSize(); i++)
+    {
+      outfile << " " << checkpoint.parameters[i];
+    }
+    outfile << "\n";
+    if (!outfile)
+    {
+      return false;
+    }
+  }
+  std::remove(fileName.c_str()); // rename() does not overwrite on Windows
+  return (std::rename(temporaryFileName.c_str(), fileName.c_str()) == 0);
+}
+
+/**
+\brief Read a checkpoint written by writeCheckpoint()
+
+\return True if a complete checkpoint was read
+*/
+inline bool readCheckpoint(const std::string &fileName, RegistrationCheckpoint &checkpoint)
+{
+  std::ifstream infile(fileName.c_str());
+  bool hasIteration = false, hasStepLength = false, hasParameters = false;
+  for (std::string line; std::getline(infile, line);)
+  {
+    std::istringstream stream(line);
+    std::string key;
+    stream >> key;
+    if (key == "iteration")
+    {
+      hasIteration = static_cast< bool >(stream >> checkpoint.iteration);
+    }
+    else if (key == "stepLength")
+    {
+      hasStepLength = static_cast< bool >(stream >> checkpoint.stepLength);
+    }
+    else if (key == "value")
+    {
+      stream >> checkpoint.value;
+    }
+    else if (key == "parameters")
+    {
+      std::vector< double > parameters;
+      for (double p; stream >> p;)
+      {
+        parameters.push_back(p);
+      }
+      checkpoint.parameters.SetSize(parameters.size());
+      for (size_t i = 0; i < parameters.size(); i++)
+      {
+        checkpoint.parameters[i] = parameters[i];
+      }
+      hasParameters = !parameters.empty();
+    }
+  }
+  return hasIteration && hasStepLength && hasParameters;
+}
+
+/**
+\brief Escape a string for use inside a JSON string literal
+*/
+inline std::string escapeJson(const std::string &text)
+{
+  std::ostringstream escaped;
+  for (size_t i = 0; i < text.size(); i++)
+  {
+    const unsigned char c = static_cast< unsigned char >(text[i]);
+    switch (c)
+    {
+    case '"':
+      escaped << "\\\"";
+      break;
+    case '\\':
+      escaped << "\\\\";
+      break;
+    case '\n':
+      escaped << "\\n";
+      break;
+    case '\r':
+      escaped << "\\r";
+      break;
+    case '\t':
+      escaped << "\\t";
+      break;
+    default:
+      if (c < 0x20)
+      {
+        escaped << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast< unsigned int >(c) <<
+          std::dec << std::setfill(' ');
+      }
+      else
+      {
+        escaped << text[i];
+      }
+    }
+  }
+  return escaped.str();
+}
+
+/**
+\brief Observer which streams per-iteration telemetry of a gradient descent optimizer and writes checkpoints
+
+Every iteration produces one record with the iteration number, metric value, step length, gradient magnitude
+and the wall time of the iteration, either as a CSV row or as a JSON line. The optimizer evaluates the metric
+before it steps, so the value and gradient of record n are those of the position reached after n - 1 steps.
+Every 'checkpointInterval' iterations the last evaluated position and its value are written with
+writeCheckpoint(); a resumed run repeats the step which followed it. When the optimizer has stopped, the caller
+writes the final checkpoint with WriteFinalCheckpoint(), with the parameters the registration ends with.
+*/
+class RegistrationTelemetryObserver : public itk::Command
+{
+public:
+  typedef RegistrationTelemetryObserver Self;
+  typedef itk::Command Superclass;
+  typedef itk::SmartPointer< Self > Pointer;
+  itkNewMacro(Self);
+
+  typedef itk::RegularStepGradientDescentBaseOptimizer OptimizerType;
+
+  enum TelemetryFormat
+  {
+    CSV,
+    JSON
+  };
+
+  //! Open the telemetry stream; the header is only written to new CSV files so resumed runs append to them
+  bool SetTelemetryFile(const std::string &fileName, TelemetryFormat format, bool append)
+  {
+    m_Format = format;
+    bool writeHeader = (m_Format == CSV);
+    if (append)
+    {
+      std::ifstream existing(fileName.c_str());
+      writeHeader = writeHeader && (existing.peek() == std::ifstream::traits_type::eof());
+    }
+    m_Telemetry.open(fileName.c_str(), append ? std::ios::app : std::ios::trunc);
+    if (m_Telemetry && writeHeader)
+    {
+      m_Telemetry << "iteration,value,stepLength,gradientMagnitude,iterationSeconds\n";
+    }
+    return static_cast< bool >(m_Telemetry);
+  }
+
+  //! Write a checkpoint to 'fileName' every 'interval' iterations; 0 only writes it when the optimizer stops
+  void SetCheckpoint(const std::string &fileName, unsigned int interval)
+  {
+    m_CheckpointFileName = fileName;
+    m_CheckpointInterval = interval;
+  }
+
+  /**
+  \brief Write the checkpoint of a stopped optimizer
+
+  \param parameters The result of the registration, i.e., what is also written to its transform file
+  \param value Metric value at 'parameters'
+  */
+  void WriteFinalCheckpoint(const itk::Optimizer::ParametersType &parameters, double value)
+  {
+    this->WriteCheckpoint(m_EndIteration, m_EndStepLength, value, parameters);
+  }
+
+  //! Number of iterations done before the optimizer was started, i.e., the iteration of a resumed checkpoint
+  void SetIterationOffset(unsigned int offset)
+  {
+    m_IterationOffset = offset;
+  }
+
+  void Execute(itk::Object *caller, const itk::EventObject &event)
+  {
+    Execute(static_cast< const itk::Object * >(caller), event);
+  }
+
+  void Execute(const itk::Object *caller, const itk::EventObject &event)
+  {
+    const OptimizerType *optimizer = dynamic_cast< const OptimizerType * >(caller);
+    if (optimizer == NULL)
+    {
+      return;
+    }
+
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (itk::StartEvent().CheckEvent(&event))
+    {
+      m_LastTime = now;
+      m_NextPosition = optimizer->GetCurrentPosition();
+      return;
+    }
+
+    // IterationEvent is invoked before the optimizer increments its iteration counter
+    const unsigned int iteration = m_IterationOffset + static_cast< unsigned int >(optimizer->GetCurrentIteration());
+    if (itk::IterationEvent().CheckEvent(&event))
+    {
+      const unsigned int completed = iteration + 1;
+      const double seconds = std::chrono::duration< double >(now - m_LastTime).count();
+      m_LastTime = now;
+      this->WriteRecord(completed, optimizer, seconds);
+
+      // the optimizer already stepped away from the position its value belongs to
+      m_EvaluatedIteration = iteration;
+      m_EvaluatedValue = optimizer->GetValue();
+      m_EvaluatedStepLength = optimizer->GetCurrentStepLength();
+      m_EvaluatedPosition = m_NextPosition;
+      m_NextPosition = optimizer->GetCurrentPosition();
+      if ((m_CheckpointInterval > 0) && (completed % m_CheckpointInterval == 0))
+      {
+        this->WriteCheckpoint(m_EvaluatedIteration, m_EvaluatedStepLength, m_EvaluatedValue, m_EvaluatedPosition);
+      }
+    }
+    else if (itk::EndEvent().CheckEvent(&event))
+    {
+      if (m_Telemetry.is_open() && (m_Format == JSON))
+      {
+        m_Telemetry << "{\"event\":\"end\",\"iteration\":" << iteration <<
+          ",\"stopCondition\":\"" << escapeJson(optimizer->GetStopConditionDescription()) << "\"}" << std::endl;
+      }
+      m_EndIteration = iteration;
+      m_EndStepLength = optimizer->GetCurrentStepLength();
+    }
+  }
+
+protected:
+  RegistrationTelemetryObserver() :
+    m_Format(CSV), m_CheckpointInterval(0), m_IterationOffset(0), m_LastTime(std::chrono::steady_clock::now()),
+    m_EvaluatedIteration(0), m_EvaluatedValue(0), m_EvaluatedStepLength(0),
+    m_EndIteration(0), m_EndStepLength(0)
+  {
+  }
+
+private:
+  void WriteRecord(unsigned int iteration, const OptimizerType *optimizer, double seconds)
+  {
+    if (!m_Telemetry.is_open())
+    {
+      return;
+    }
+    m_Telemetry << std::setprecision(10);
+    if (m_Format == CSV)
+    {
+      m_Telemetry << iteration << "," << optimizer->GetValue() << "," << optimizer->GetCurrentStepLength() << "," <<
+        optimizer->GetGradient().magnitude() << "," << seconds;
+    }
+    else
+    {
+      m_Telemetry << "{\"iteration\":" << iteration << ",\"value\":" << optimizer->GetValue() <<
+        ",\"stepLength\":" << optimizer->GetCurrentStepLength() <<
+        ",\"gradientMagnitude\":" << optimizer->GetGradient().magnitude() <<
+        ",\"iterationSeconds\":" << seconds << "}";
+    }
+    m_Telemetry << std::endl; // flushed so that a killed job still leaves its telemetry
+  }
+
+  void WriteCheckpoint(unsigned int iteration, double stepLength, double value,
+    const itk::Optimizer::ParametersType &parameters)
+  {
+    if (m_CheckpointFileName.empty())
+    {
+      return;
+    }
+    RegistrationCheckpoint checkpoint;
+    checkpoint.iteration = iteration;
+    checkpoint.stepLength = stepLength;
+    checkpoint.value = value;
+    checkpoint.parameters = parameters;
+    if (!writeCheckpoint(m_CheckpointFileName, checkpoint))
+    {
+      std::cerr << "Could not write checkpoint '" << m_CheckpointFileName << "'\n";
+    }
+  }
+
+  std::ofstream m_Telemetry;
+  TelemetryFormat m_Format;
+  std::string m_CheckpointFileName;
+  unsigned int m_CheckpointInterval;
+  unsigned int m_IterationOffset;
+  std::chrono::steady_clock::time_point m_LastTime;
+  unsigned int m_EvaluatedIteration; //! iterations done to reach m_EvaluatedPosition
+  double m_EvaluatedValue; //! metric value at m_EvaluatedPosition
+  double m_EvaluatedStepLength; //! step length of the step which followed m_EvaluatedPosition
+  itk::Optimizer::ParametersType m_EvaluatedPosition; //! last position the metric was evaluated at
+  itk::Optimizer::ParametersType m_NextPosition; //! position the metric is evaluated at in the next iteration
+  unsigned int m_EndIteration; //! iterations done when the optimizer stopped
+  double m_EndStepLength; //! step length when the optimizer stopped
+};
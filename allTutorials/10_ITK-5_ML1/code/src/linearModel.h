@@ -0,0 +1,311 @@
+#pragma once
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/ml/ml.hpp"
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cmath>
+
+/**
+\brief A two-class linear classifier in closed form: label = (w.x + b > 0) ? positiveLabel : negativeLabel
+*/
+struct LinearModel
+{
+  LinearModel() :
+    bias(0), positiveLabel(1), negativeLabel(-1)
+  {
+  }
+
+  std::vector< float > weights; //! one weight per feature
+  float bias; //! offset of the decision function
+  float positiveLabel; //! label of samples with a positive decision value
+  float negativeLabel; //! label of all other samples
+
+  float Label(float decisionValue) const
+  {
+    return (decisionValue > 0) ? positiveLabel : negativeLabel;
+  }
+};
+
+/**
+\brief Write a model with cv::FileStorage (.yml or .xml)
+
+\return False if the file cannot be written
+*/
+inline bool saveLinearModel(const LinearModel &model, const std::string &fileName)
+{
+  cv::FileStorage storage(fileName, cv::FileStorage::WRITE);
+  if (!storage.isOpened())
+  {
+    return false;
+  }
+  storage << "weights" << model.weights;
+  storage << "bias" << model.bias;
+  storage << "positiveLabel" << model.positiveLabel;
+  storage << "negativeLabel" << model.negativeLabel;
+  return true;
+}
+
+/**
+\brief Read a model written by saveLinearModel()
+
+\return False if the file cannot be read or has no weights
+*/
+inline bool loadLinearModel(LinearModel &model, const std::string &fileName)
+{
+  cv::FileStorage storage(fileName, cv::FileStorage::READ);
+  if (!storage.isOpened() || storage["weights"].empty())
+  {
+    return false;
+  }
+  storage["weights"] >> model.weights;
+  storage["bias"] >> model.bias;
+  storage["positiveLabel"] >> model.positiveLabel;
+  storage["negativeLabel"] >> model.negativeLabel;
+  return !model.weights.empty();
+}
+
+/**
+\brief Collapse a trained two-class SVM with a linear kernel into a weight vector and a bias
+
+CvSVM keeps its decision function (support vectors, coefficients, rho) protected, so it is recovered through
+the public predict(): with a linear kernel the decision value is an affine function of the sample, so it is
+probed at the origin (bias) and at every unit vector (bias + weight). The labels are read back at points whose
+decision value is +1 and -1.
+
+\param svm The trained classifier
+\param model Overwritten with the extracted model
+
+\return False if the SVM is not a two-class classifier with a linear kernel
+*/
+inline bool extractLinearModel(const CvSVM &svm, LinearModel &model)
+{
+  const CvSVMParams params = svm.get_params();
+  const int numberOfFeatures = svm.get_var_count();
+  if ((params.kernel_type != CvSVM::LINEAR) || (numberOfFeatures <= 0) || (svm.get_support_vector_count() == 0) ||
+    ((params.svm_type != CvSVM::C_SVC) && (params.svm_type != CvSVM::NU_SVC)))
+  {
+    return false;
+  }
+
+  std::vector< float > probe(numberOfFeatures, 0.0f);
+  model.bias = svm.predict(&probe[0], numberOfFeatures, true);
+  model.weights.assign(numberOfFeatures, 0.0f);
+  double squaredNorm = 0;
+  for (int i = 0; i < numberOfFeatures; i++)
+  {
+    probe[i] = 1.0f;
+    model.weights[i] = svm.predict(&probe[0], numberOfFeatures, true) - model.bias;
+    probe[i] = 0.0f;
+    squaredNorm += static_cast< double >(model.weights[i]) * model.weights[i];
+  }
+
+  // x = w * (t - b) / |w|^2 has the decision value t
+  for (int side = 0; side < 2; side++)
+  {
+    const double target = (side == 0) ? 1.0 : -1.0;
+    for (int i = 0; i < numberOfFeatures; i++)
+    {
+      probe[i] = (squaredNorm > 0) ? static_cast< float >(model.weights[i] * (target - model.bias) / squaredNorm) : 0.0f;
+    }
+    const float label = svm.predict(&probe[0], numberOfFeatures, false);
+    (side == 0 ? model.positiveLabel : model.negativeLabel) = label;
+  }
+
+  // with more than 2 classes predict() returns labels instead of decision values, which are not affine
+  double expected = model.bias;
+  for (int i = 0; i < numberOfFeatures; i++)
+  {
+    probe[i] = 0.5f * static_cast< float >(i + 1);
+    expected += static_cast< double >(model.weights[i]) * probe[i];
+  }
+  const double actual = svm.predict(&probe[0], numberOfFeatures, true);
+  if (std::abs(actual - expected) > 1e-3 * (1.0 + std::abs(expected)))
+  {
+    return false;
+  }
+  return (squaredNorm == 0) || (model.positiveLabel != model.negativeLabel);
+}
+
+/**
+\brief Parallel body of linearModelPredict(); every range is a block of sample rows
+*/
+class LinearModelPredictBody : public cv::ParallelLoopBody
+{
+public:
+  LinearModelPredictBody(const LinearModel &model, const cv::Mat &samples, cv::Mat &responses, bool returnDFVal, int blockSize) :
+    m_Model(model), m_Samples(samples), m_Responses(responses), m_ReturnDFVal(returnDFVal), m_BlockSize(blockSize)
+  {
+  }
+
+  void operator()(const cv::Range &blocks) const
+  {
+    const int numberOfFeatures = static_cast< int >(m_Model.weights.size());
+    const float *weights = &m_Model.weights[0];
+    float *responses = m_Responses.ptr< float >(0);
+    for (int block = blocks.start; block < blocks.end; block++)
+    {
+      const int begin = block * m_BlockSize, end = std::min(begin + m_BlockSize, m_Samples.rows);
+      for (int row = begin; row < end; row++)
+      {
+        const float *sample = m_Samples.ptr< float >(row);
+        float value = m_Model.bias;
+        for (int i = 0; i < numberOfFeatures; i++)
+        {
+          value += weights[i] * sample[i];
+        }
+        responses[row] = value;
+      }
+      if (!m_ReturnDFVal)
+      {
+        for (int row = begin; row < end; row++)
+        {
+          responses[row] = m_Model.Label(responses[row]);
+        }
+      }
+    }
+  }
+
+private:
+  LinearModelPredictBody &operator=(const LinearModelPredictBody &); // purposely not implemented
+
+  const LinearModel &m_Model;
+  const cv::Mat &m_Samples;
+  cv::Mat &m_Responses;
+  bool m_ReturnDFVal;
+  int m_BlockSize;
+};
+
+/**
+\brief Predict many samples stored one per row; a drop-in replacement of svmPredictBatch() for linear models
+
+\param model The linear model, see extractLinearModel()
+\param samples One sample per row, [n x model.weights.size()]; converted to CV_32F if needed
+\param responses Overwritten with a [n x 1] CV_32F matrix of labels or decision values
+\param returnDFVal Return the decision value instead of the label
+\param blockSize Number of rows predicted by one parallel task
+\param parallel False predicts the blocks on the calling thread, e.g., from a worker which already has its share of the threads
+*/
+inline void linearModelPredict(const LinearModel &model, const cv::Mat &samples, cv::Mat &responses, bool returnDFVal = false,
+  int blockSize = 4096, bool parallel = true)
+{
+  cv::Mat floatSamples = samples;
+  if (samples.type() != CV_32FC1)
+  {
+    samples.reshape(1).convertTo(floatSamples, CV_32F);
+  }
+  CV_Assert(floatSamples.cols == static_cast< int >(model.weights.size()));
+
+  responses.create(floatSamples.rows, 1, CV_32FC1);
+  if (floatSamples.rows == 0)
+  {
+    return;
+  }
+
+  blockSize = std::max(1, blockSize);
+  const int numberOfBlocks = (floatSamples.rows + blockSize - 1) / blockSize;
+  const LinearModelPredictBody body(model, floatSamples, responses, returnDFVal, blockSize);
+  if (parallel)
+  {
+    cv::parallel_for_(cv::Range(0, numberOfBlocks), body);
+  }
+  else
+  {
+    body(cv::Range(0, numberOfBlocks));
+  }
+}
+
+/**
+\brief Parallel body of linearModelPredictPlanes(); every range is a block of voxels
+*/
+template < typename TPixelType >
+class LinearModelPredictPlanesBody : public cv::ParallelLoopBody
+{
+public:
+  enum
+  {
+    BlockSize = 2048 //! the block of decision values stays in L1 while every plane is added to it
+  };
+
+  LinearModelPredictPlanesBody(const LinearModel &model, const std::vector< const TPixelType * > &planes, size_t count,
+    float *responses, bool returnDFVal) :
+    m_Model(model), m_Planes(planes), m_Count(count), m_Responses(responses), m_ReturnDFVal(returnDFVal)
+  {
+  }
+
+  void operator()(const cv::Range &blocks) const
+  {
+    for (int block = blocks.start; block < blocks.end; block++)
+    {
+      const size_t begin = static_cast< size_t >(block) * BlockSize, end = std::min(begin + BlockSize, m_Count);
+      float *responses = m_Responses + begin;
+      const size_t length = end - begin;
+
+      std::fill(responses, responses + length, m_Model.bias);
+      for (size_t plane = 0; plane < m_Planes.size(); plane++)
+      {
+        // unit stride multiply-add over contiguous buffers; vectorized by the compiler
+        const TPixelType *values = m_Planes[plane] + begin;
+        const float weight = m_Model.weights[plane];
+        for (size_t i = 0; i < length; i++)
+        {
+          responses[i] += weight * static_cast< float >(values[i]);
+        }
+      }
+      if (!m_ReturnDFVal)
+      {
+        for (size_t i = 0; i < length; i++)
+        {
+          responses[i] = m_Model.Label(responses[i]);
+        }
+      }
+    }
+  }
+
+private:
+  LinearModelPredictPlanesBody &operator=(const LinearModelPredictPlanesBody &); // purposely not implemented
+
+  const LinearModel &m_Model;
+  const std::vector< const TPixelType * > &m_Planes;
+  size_t m_Count;
+  float *m_Responses;
+  bool m_ReturnDFVal;
+};
+
+/**
+\brief Predict every voxel of a set of co-registered images directly from their buffers
+
+Feature i of a voxel is the value of that voxel in planes[i], e.g., the buffers of the T1, T2, FLAIR and PD
+images. The volume is processed in blocks; each block reads every plane once and writes its responses once,
+so the whole volume is classified in a single pass over memory.
+
+\param model The linear model, see extractLinearModel(); needs one weight per plane
+\param planes Pointers to 'count' values per feature, e.g., itk::Image::GetBufferPointer()
+\param count Number of voxels
+\param responses Overwritten with 'count' labels or decision values; must hold 'count' values
+\param returnDFVal Return the decision value instead of the label
+\param parallel False predicts the blocks on the calling thread, e.g., a scanline of an ITK filter thread
+*/
+template < typename TPixelType >
+void linearModelPredictPlanes(const LinearModel &model, const std::vector< const TPixelType * > &planes, size_t count,
+  float *responses, bool returnDFVal = false, bool parallel = true)
+{
+  CV_Assert(planes.size() == model.weights.size());
+  if (count == 0)
+  {
+    return;
+  }
+  const size_t blockSize = LinearModelPredictPlanesBody< TPixelType >::BlockSize;
+  const int numberOfBlocks = static_cast< int >((count + blockSize - 1) / blockSize);
+  const LinearModelPredictPlanesBody< TPixelType > body(model, planes, count, responses, returnDFVal);
+  if (parallel)
+  {
+    cv::parallel_for_(cv::Range(0, numberOfBlocks), body);
+  }
+  else
+  {
+    body(cv::Range(0, numberOfBlocks));
+  }
+}
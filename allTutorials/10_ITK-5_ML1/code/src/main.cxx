@@ -13,6 +13,10 @@
 #include "opencv2/ml/ml.hpp"
 #include "opencv2/highgui/highgui.hpp"
 
+#include "svmBatchPredict.h"
+#include "linearModel.h"
+#include "openCVImageView.h"
+
 #define ROWS 4
 #define COLS 2
 
@@ -71,7 +75,7 @@ int main(int argc, char *argv[])
     typedef itk::ImportImageFilter< PixelType, 2 > ImportFilterType;
     ImportFilterType::Pointer import_traning = ImportFilterType::New(), import_labels = ImportFilterType::New();
     import_traning->SetRegion(region); // can be substituted by import_traning->SetOrigin() and import_traning->SetSize()
-    import_traning->SetImportPointer(training_mat.data_block(), ROWS * COLS, true);
+    import_traning->SetImportPointer(training_mat.data_block(), ROWS * COLS, false); // the matrix keeps ownership of its data
     import_traning->Update();
 
     // initialize and allocate memory to hold training data
@@ -79,20 +83,22 @@ int main(int argc, char *argv[])
     // in the real world scenario, this is where you would hold your image data.
     // Take a look at http://itk.org/Doxygen/html/ImageIteratorsPage.html for details on how to iterate over an image.
 
-    cv::Mat training_data = itk::OpenCVImageBridge::ITKImageToCVMat< ImageType >(training_itk);
+    // view the image buffer as an OpenCV matrix; nothing is copied and the view keeps the image alive.
+    // The buffer holds the samples row by row (vnl is row major), so it is viewed with one sample per row
+    CVMatView< ImageType > training_view = itkImageAsCVMat< ImageType >(training_itk, ROWS);
+    cv::Mat training_data = training_view.mat;
 
     // import labels
     region.SetSize(size_labels);
     region.SetIndex(start);
     import_labels->SetRegion(region); // can be substituted by import_traning->SetOrigin() and import_traning->SetSize()
-    import_labels->SetImportPointer(labels_vec.data_block(), ROWS * 1, true);
+    import_labels->SetImportPointer(labels_vec.data_block(), ROWS * 1, false);
     import_labels->Update();
 
-    cv::Mat labels_data = itk::OpenCVImageBridge::ITKImageToCVMat< ImageType >(import_labels->GetOutput());
-
-    // fix orientation. This is required because of the difference in the way OpenCV and ITK handle axes
-    training_data = training_data.reshape(1, ROWS);
-    cv::transpose(labels_data, labels_data); // cane be substituted by labels_data = labels_data.reshape(1, 4);
+    // one label per row; viewing the buffer with ROWS rows replaces the reshape/transpose needed after
+    // itk::OpenCVImageBridge::ITKImageToCVMat(), which copies and keeps ITK's x axis along the columns
+    CVMatView< ImageType > labels_view = itkImageAsCVMat< ImageType >(import_labels->GetOutput(), ROWS);
+    cv::Mat labels_data = labels_view.mat;
 
     // Set up SVM's parameters. There are different parameters for different classifiers. Please see documentation for details
     cv::SVMParams params;
@@ -107,12 +113,30 @@ int main(int argc, char *argv[])
     cv::Mat image = cv::Mat::zeros(height, width, CV_8UC3); // this image is constructed purely for visualization purposes
 
     cv::Vec3b green(0, 255, 0), blue(255, 0, 0); // OpenCV's color space is BGR while ITK's is RGB
+    // construct one sample per pixel from the cols and rows indices and predict them all in one call
+    cv::Mat grid(image.rows * image.cols, 2, CV_32FC1), responses;
+    for (int i = 0; i < image.rows; ++i)
+      for (int j = 0; j < image.cols; ++j)
+      {
+        float *sample = grid.ptr<float>(i * image.cols + j);
+        sample[0] = static_cast<float>(j);
+        sample[1] = static_cast<float>(i);
+      }
+    LinearModel linearModel;
+    if (extractLinearModel(svm, linearModel)) // a linear SVM is just a weight vector and a bias
+    {
+      linearModelPredict(linearModel, grid, responses);
+    }
+    else
+    {
+      svmPredictBatch(svm, grid, responses);
+    }
+
     // Show the decision regions given by the SVM
     for (int i = 0; i < image.rows; ++i)
       for (int j = 0; j < image.cols; ++j)
       {
-        cv::Mat sampleMat = (cv::Mat_<float>(1, 2) << j, i); // construct a sample from the rows and cols indices
-        float response = svm.predict(sampleMat);
+        float response = responses.at<float>(i * image.cols + j);
 
         if (response == 1)
           image.at<cv::Vec3b>(i, j) = green; 
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "itkImage.h"
+#include "itkImageRegionConstIterator.h"
+
+#include "opencv2/core/core.hpp"
+
+#include <climits>
+
+/**
+\brief OpenCV depth of an ITK pixel type; Supported is false for pixel types without an OpenCV equivalent
+*/
+template < typename TPixelType >
+struct OpenCVPixelTraits
+{
+  enum { Supported = 0, Depth = CV_64F };
+};
+
+template <> struct OpenCVPixelTraits< unsigned char > { enum { Supported = 1, Depth = CV_8U }; };
+template <> struct OpenCVPixelTraits< char > { enum { Supported = 1, Depth = CV_8S }; };
+template <> struct OpenCVPixelTraits< signed char > { enum { Supported = 1, Depth = CV_8S }; };
+template <> struct OpenCVPixelTraits< unsigned short > { enum { Supported = 1, Depth = CV_16U }; };
+template <> struct OpenCVPixelTraits< short > { enum { Supported = 1, Depth = CV_16S }; };
+template <> struct OpenCVPixelTraits< int > { enum { Supported = 1, Depth = CV_32S }; };
+template <> struct OpenCVPixelTraits< float > { enum { Supported = 1, Depth = CV_32F }; };
+template <> struct OpenCVPixelTraits< double > { enum { Supported = 1, Depth = CV_64F }; };
+
+/**
+\brief A cv::Mat on the buffer of an ITK image, together with the image which owns that buffer
+
+cv::Mat cannot reference count memory it did not allocate, so the view keeps a SmartPointer to the image;
+the buffer stays valid for as long as the view (not just 'mat') exists. If the pixel type has no OpenCV
+equivalent, 'mat' is a CV_64F copy and 'owner' is NULL.
+*/
+template < typename TImageType >
+struct CVMatView
+{
+  cv::Mat mat; //! header on the image buffer, or a copy; writing to it writes to the image unless it is a copy
+  typename TImageType::ConstPointer owner; //! keeps the image buffer alive; NULL if 'mat' is a copy
+
+  bool IsCopy() const
+  {
+    return owner.IsNull();
+  }
+};
+
+/**
+\brief Wrap the buffer of a scalar ITK image as a single channel cv::Mat without copying
+
+By default a row of the matrix is a line along x, i.e., a [size[1]*size[2]*... x size[0]] matrix, which is
+what itk::OpenCVImageBridge::ITKImageToCVMat() gives for 2D images. 'rows' reshapes the (contiguous) buffer
+instead, e.g., rows = number of voxels gives a column vector and a buffer of samples stored row by row can
+be viewed as a [samples x features] matrix.
+
+\param image The image; must stay unmodified in size while the view exists
+\param rows Number of rows of the view; 0 keeps the image layout. Has to divide the number of pixels
+
+\return The view
+*/
+template < typename TImageType >
+CVMatView< TImageType > itkImageAsCVMat(const TImageType *image, int rows = 0)
+{
+  typedef typename TImageType::PixelType PixelType;
+  typedef OpenCVPixelTraits< PixelType > TraitsType;
+
+  const typename TImageType::SizeType &size = image->GetBufferedRegion().GetSize();
+  const itk::SizeValueType numberOfPixels = image->GetBufferedRegion().GetNumberOfPixels();
+  if (numberOfPixels > static_cast< itk::SizeValueType >(INT_MAX)) // cv::Mat counts rows and columns in int
+  {
+    itkGenericExceptionMacro(<< "Cannot view " << numberOfPixels << " pixels as a cv::Mat; at most " << INT_MAX <<
+      " are supported");
+  }
+  const int total = static_cast< int >(numberOfPixels);
+  if (rows <= 0)
+  {
+    rows = (size[0] > 0) ? total / static_cast< int >(size[0]) : 0;
+  }
+  if ((rows == 0) || (total % rows != 0))
+  {
+    itkGenericExceptionMacro(<< "Cannot view " << total << " pixels as " << rows << " rows");
+  }
+  const int cols = total / rows;
+
+  CVMatView< TImageType > view;
+  if (TraitsType::Supported)
+  {
+    view.owner = image;
+    view.mat = cv::Mat(rows, cols, CV_MAKETYPE(TraitsType::Depth, 1), const_cast< PixelType * >(image->GetBufferPointer()));
+  }
+  else
+  {
+    view.mat.create(rows, cols, CV_64FC1);
+    double *values = view.mat.ptr< double >(0);
+    itk::ImageRegionConstIterator< TImageType > it(image, image->GetBufferedRegion());
+    for (it.GoToBegin(); !it.IsAtEnd(); ++it)
+    {
+      *values++ = static_cast< double >(it.Get());
+    }
+  }
+  return view;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/ml/ml.hpp"
+
+#include <algorithm>
+
+/**
+\brief Parallel body of svmPredictBatch(); every range is a block of sample rows
+*/
+class SVMPredictBatchBody : public cv::ParallelLoopBody
+{
+public:
+  SVMPredictBatchBody(const CvSVM &svm, const cv::Mat &samples, cv::Mat &responses, bool returnDFVal, int blockSize) :
+    m_SVM(svm), m_Samples(samples), m_Responses(responses), m_ReturnDFVal(returnDFVal), m_BlockSize(blockSize)
+  {
+  }
+
+  void operator()(const cv::Range &blocks) const
+  {
+    const int rowLength = m_Samples.cols;
+    for (int block = blocks.start; block < blocks.end; block++)
+    {
+      const int begin = block * m_BlockSize, end = std::min(begin + m_BlockSize, m_Samples.rows);
+      float *responses = m_Responses.ptr< float >(0);
+      for (int row = begin; row < end; row++)
+      {
+        // the raw pointer overload avoids building a cv::Mat header for every sample
+        responses[row] = m_SVM.predict(m_Samples.ptr< float >(row), rowLength, m_ReturnDFVal);
+      }
+    }
+  }
+
+private:
+  SVMPredictBatchBody &operator=(const SVMPredictBatchBody &); // purposely not implemented
+
+  const CvSVM &m_SVM;
+  const cv::Mat &m_Samples;
+  cv::Mat &m_Responses;
+  bool m_ReturnDFVal;
+  int m_BlockSize;
+};
+
+/**
+\brief Predict the responses of many samples with a trained SVM in one call
+
+The samples are split into blocks of 'blockSize' rows which are predicted in parallel with cv::parallel_for_.
+Samples which are not CV_32F are converted once up front.
+
+\param svm The trained classifier
+\param samples One sample per row; the number of columns has to match the training data
+\param responses Overwritten with a [samples.rows x 1] CV_32F matrix of responses
+\param returnDFVal Return the decision function value instead of the class label (2-class problems only)
+\param blockSize Number of rows predicted by one parallel task
+*/
+inline void svmPredictBatch(const CvSVM &svm, const cv::Mat &samples, cv::Mat &responses, bool returnDFVal = false,
+  int blockSize = 4096)
+{
+  cv::Mat floatSamples = samples;
+  if (samples.type() != CV_32FC1)
+  {
+    samples.reshape(1).convertTo(floatSamples, CV_32F);
+  }
+
+  responses.create(floatSamples.rows, 1, CV_32FC1);
+  if (floatSamples.rows == 0)
+  {
+    return;
+  }
+
+  blockSize = std::max(1, blockSize);
+  const int numberOfBlocks = (floatSamples.rows + blockSize - 1) / blockSize;
+  cv::parallel_for_(cv::Range(0, numberOfBlocks), SVMPredictBatchBody(svm, floatSamples, responses, returnDFVal, blockSize));
+}
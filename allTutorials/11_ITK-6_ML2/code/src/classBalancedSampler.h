@@ -0,0 +1,236 @@
+#pragma once
+
+#include "opencv2/core/core.hpp"
+
+#include <vector>
+#include <map>
+#include <random>
+#include <algorithm>
+#include <cstring>
+
+/**
+\brief Reservoir which keeps the 'capacity' items with the smallest random keys seen so far
+
+Giving every item of a stream an independent uniform key and keeping the smallest keys is a uniform sample
+without replacement (bottom-k sampling). Unlike the classic reservoir algorithm, the union of several such
+reservoirs can be reduced to a uniform sample of the union again, which lets subjects be sampled
+independently and merged later.
+*/
+template < typename TPayload >
+class BottomKReservoir
+{
+public:
+  typedef std::pair< double, TPayload > ItemType; //! (key, payload)
+
+  explicit BottomKReservoir(size_t capacity = 0) :
+    m_Capacity(capacity)
+  {
+  }
+
+  void SetCapacity(size_t capacity)
+  {
+    m_Capacity = capacity;
+  }
+
+  //! Offer an item; returns false if it was rejected right away
+  bool Offer(double key, const TPayload &payload)
+  {
+    if (m_Items.size() < m_Capacity)
+    {
+      m_Items.push_back(ItemType(key, payload));
+      std::push_heap(m_Items.begin(), m_Items.end(), KeyLess());
+      return true;
+    }
+    if (m_Items.empty() || (key >= m_Items.front().first))
+    {
+      return false;
+    }
+    std::pop_heap(m_Items.begin(), m_Items.end(), KeyLess()); // the largest key is moved to the back
+    m_Items.back() = ItemType(key, payload);
+    std::push_heap(m_Items.begin(), m_Items.end(), KeyLess());
+    return true;
+  }
+
+  //! Kept items in no particular order
+  const std::vector< ItemType > &GetItems() const
+  {
+    return m_Items;
+  }
+
+private:
+  struct KeyLess
+  {
+    bool operator()(const ItemType &a, const ItemType &b) const
+    {
+      return a.first < b.first;
+    }
+  };
+
+  size_t m_Capacity;
+  std::vector< ItemType > m_Items; //! max-heap on the key
+};
+
+/**
+\brief Random keys for the voxels of one subject
+
+The generator is seeded from the global seed and the position of the subject, so the keys (and hence the
+sample) do not depend on which worker processes the subject or when.
+*/
+class SubjectKeyGenerator
+{
+public:
+  SubjectKeyGenerator(unsigned int seed, size_t subject) :
+    m_Distribution(0.0, 1.0)
+  {
+    std::seed_seq sequence{ seed, static_cast< unsigned int >(subject), static_cast< unsigned int >(subject >> 16 >> 16) };
+    m_Generator.seed(sequence);
+  }
+
+  double operator()()
+  {
+    return m_Distribution(m_Generator);
+  }
+
+private:
+  std::mt19937_64 m_Generator;
+  std::uniform_real_distribution< double > m_Distribution;
+};
+
+/**
+\brief Per-class reservoirs of feature rows; memory is capacity x classes rows, whatever the stream length
+
+Rows are offered together with their label and random key. GetSamples() returns the kept rows ordered by key,
+i.e., in random but reproducible order, optionally reduced to the size of the smallest class.
+*/
+class ClassBalancedReservoirSampler
+{
+public:
+  ClassBalancedReservoirSampler(size_t capacityPerClass, int numberOfFeatures) :
+    m_Capacity(capacityPerClass), m_NumberOfFeatures(numberOfFeatures)
+  {
+  }
+
+  size_t GetCapacityPerClass() const
+  {
+    return m_Capacity;
+  }
+
+  //! Offer every row of a block; 'keys' holds one key per row
+  void Offer(const cv::Mat &samples, const cv::Mat &labels, const std::vector< double > &keys)
+  {
+    CV_Assert((samples.cols == m_NumberOfFeatures) && (samples.type() == CV_32FC1));
+    for (int row = 0; row < samples.rows; row++)
+    {
+      this->Offer(labels.at< float >(row), keys[row], samples.ptr< float >(row));
+    }
+  }
+
+  void Offer(float label, double key, const float *sample)
+  {
+    ClassReservoir &reservoir = this->GetReservoir(label);
+    size_t slot = reservoir.rows.rows;
+    if (static_cast< size_t >(reservoir.rows.rows) >= m_Capacity)
+    {
+      // full: the row replaces the one with the largest key if its key is smaller
+      const std::vector< BottomKReservoir< size_t >::ItemType > &items = reservoir.slots.GetItems();
+      if (items.empty() || (key >= items.front().first))
+      {
+        return;
+      }
+      slot = items.front().second;
+    }
+    else
+    {
+      reservoir.rows.push_back(cv::Mat(1, m_NumberOfFeatures, CV_32FC1));
+    }
+    reservoir.slots.Offer(key, slot);
+    std::memcpy(reservoir.rows.ptr< float >(static_cast< int >(slot)), sample, m_NumberOfFeatures * sizeof(float));
+  }
+
+  //! Number of rows kept per label
+  std::map< float, size_t > GetClassCounts() const
+  {
+    std::map< float, size_t > counts;
+    for (std::map< float, ClassReservoir >::const_iterator it = m_Reservoirs.begin(); it != m_Reservoirs.end(); ++it)
+    {
+      counts[it->first] = it->second.slots.GetItems().size();
+    }
+    return counts;
+  }
+
+  /**
+  \brief Get the kept rows
+
+  \param samples Overwritten with the kept rows, ordered by key
+  \param labels Overwritten with their labels
+  \param balance Keep only as many rows per class as the smallest class has; the rows with the smallest keys
+  are kept, which is again a uniform sample
+  */
+  void GetSamples(cv::Mat &samples, cv::Mat &labels, bool balance) const
+  {
+    size_t perClass = m_Capacity;
+    if (balance)
+    {
+      for (std::map< float, ClassReservoir >::const_iterator it = m_Reservoirs.begin(); it != m_Reservoirs.end(); ++it)
+      {
+        perClass = std::min(perClass, it->second.slots.GetItems().size());
+      }
+    }
+
+    // (key, label, slot) of every kept row
+    struct KeptRow
+    {
+      double key;
+      float label;
+      size_t slot;
+      bool operator<(const KeptRow &other) const
+      {
+        return key < other.key;
+      }
+    };
+    std::vector< KeptRow > kept;
+    for (std::map< float, ClassReservoir >::const_iterator it = m_Reservoirs.begin(); it != m_Reservoirs.end(); ++it)
+    {
+      std::vector< BottomKReservoir< size_t >::ItemType > items = it->second.slots.GetItems();
+      std::sort(items.begin(), items.end());
+      for (size_t i = 0; i < std::min(perClass, items.size()); i++)
+      {
+        KeptRow row = { items[i].first, it->first, items[i].second };
+        kept.push_back(row);
+      }
+    }
+    std::sort(kept.begin(), kept.end());
+
+    samples.create(static_cast< int >(kept.size()), m_NumberOfFeatures, CV_32FC1);
+    labels.create(static_cast< int >(kept.size()), 1, CV_32FC1);
+    for (size_t i = 0; i < kept.size(); i++)
+    {
+      const cv::Mat &rows = m_Reservoirs.find(kept[i].label)->second.rows;
+      std::memcpy(samples.ptr< float >(static_cast< int >(i)), rows.ptr< float >(static_cast< int >(kept[i].slot)),
+        m_NumberOfFeatures * sizeof(float));
+      labels.at< float >(static_cast< int >(i)) = kept[i].label;
+    }
+  }
+
+private:
+  struct ClassReservoir
+  {
+    cv::Mat rows; //! one feature row per slot
+    BottomKReservoir< size_t > slots; //! (key, slot) of the kept rows
+  };
+
+  ClassReservoir &GetReservoir(float label)
+  {
+    std::map< float, ClassReservoir >::iterator it = m_Reservoirs.find(label);
+    if (it == m_Reservoirs.end())
+    {
+      it = m_Reservoirs.insert(std::make_pair(label, ClassReservoir())).first;
+      it->second.slots.SetCapacity(m_Capacity);
+    }
+    return it->second;
+  }
+
+  size_t m_Capacity;
+  int m_NumberOfFeatures;
+  std::map< float, ClassReservoir > m_Reservoirs; //! by label
+};
@@ -0,0 +1,286 @@
+#pragma once
+
+#include "opencv2/core/core.hpp"
+
+#include "linearModel.h"
+#include "linearSVMTrainer.h"
+#include "classBalancedSampler.h"
+#include "randomFourierFeatures.h"
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+/**
+\brief The extracted rows of one subject, e.g., a block of extractTrainingData() or of a FeatureCache
+*/
+struct SubjectSamples
+{
+  std::string id;
+  cv::Mat samples, labels; //! may be views on a mapped feature cache
+  std::vector< double > keys; //! sampling key of every row; empty if the training set keeps all voxels
+};
+
+/**
+\brief Result of one fold of SubjectCrossValidation
+*/
+struct CrossValidationFold
+{
+  CrossValidationFold() :
+    fold(0), trainingRows(0), testRows(0), epochs(0), converged(false), accuracy(0), dice(0), seconds(0)
+  {
+  }
+
+  unsigned int fold;
+  std::vector< std::string > testSubjects;
+  size_t trainingRows, testRows;
+  unsigned int epochs; //! of the linear trainer
+  bool converged;
+  double accuracy; //! fraction of correctly labeled test rows
+  double dice; //! 2 TP / (2 TP + FP + FN) of the positive (lesion) label over all test rows
+  double seconds; //! wall time of building the training set, fitting the feature map, training and testing
+  std::string error; //! empty unless the fold could not be trained, e.g., a single label in its training set
+};
+
+/**
+\brief Subject-level k-fold cross-validation of the linear SVM on already extracted subjects
+
+Subjects, not voxels, are split into folds, since neighboring voxels of one subject are strongly correlated
+and would make a voxel-level split optimistic. The assignment is a seeded shuffle, so a seed gives the same
+folds for every parameter setting that is compared. Every fold builds its training set from the blocks of the
+other subjects, exactly as the full training set is built (merged reservoirs if there are keys and
+samplesPerClass > 0, all rows otherwise), fits the random Fourier features, if any, on that training set
+only, trains with LinearSVMTrainer and labels all rows of its own subjects. Nothing is read from disk again.
+
+The blocks have to hold every foreground voxel (see TrainingSetOptions::keepAllRows), so the held-out subjects
+are scored on their whole foregrounds as inference would label them, not on a class-stratified sample; Run()
+refuses sampled blocks. Folds run concurrently on a pool of numberOfThreads threads; each fold only reads the
+shared blocks and writes its own result, and maps and predicts on its own thread, so the results do not depend
+on the number of threads and the folds stay within them.
+*/
+class SubjectCrossValidation
+{
+public:
+  SubjectCrossValidation() :
+    m_Subjects(NULL), m_NumberOfFolds(5), m_NumberOfThreads(1), m_Seed(0), m_SamplesPerClass(0), m_BalanceClasses(true),
+    m_WeightClasses(false), m_NumberOfRandomFeatures(0), m_Gamma(0), m_RandomFeatureSeed(0)
+  {
+  }
+
+  //! The subjects; not copied, so they have to outlive Run()
+  void SetSubjects(const std::vector< SubjectSamples > *subjects)
+  {
+    m_Subjects = subjects;
+  }
+
+  void SetNumberOfFolds(unsigned int numberOfFolds)
+  {
+    m_NumberOfFolds = std::max(2u, numberOfFolds);
+  }
+
+  /**
+  \brief Folds trained at the same time
+
+  Every running fold holds its own training and test set: with sampling at most samplesPerClass rows per label,
+  without it a copy of (k - 1) / k of all rows. Without sampling, k folds on k threads therefore need about k
+  times the memory of the extracted rows on top of them; use fewer threads for large cohorts.
+  */
+  void SetNumberOfThreads(unsigned int numberOfThreads)
+  {
+    m_NumberOfThreads = std::max(1u, numberOfThreads);
+  }
+
+  //! Seed of the assignment of subjects to folds
+  void SetSeed(unsigned int seed)
+  {
+    m_Seed = seed;
+  }
+
+  //! How the training set of a fold is sampled, see TrainingSetOptions
+  void SetSampling(size_t samplesPerClass, bool balanceClasses)
+  {
+    m_SamplesPerClass = samplesPerClass;
+    m_BalanceClasses = balanceClasses;
+  }
+
+  void SetTrainerParameters(const LinearSVMTrainerParameters &parameters, bool weightClasses)
+  {
+    m_TrainerParameters = parameters;
+    m_WeightClasses = weightClasses;
+  }
+
+  /**
+  \brief Optional; every fold fits a RandomFourierFeatureMap on its training set and maps its training and test rows
+
+  Fitting per fold keeps the statistics of the test subjects out of the standardization of the map.
+
+  \param numberOfOutputs Random features; 0 trains on the extracted features
+  \param gamma See RandomFourierFeatureMap::Fit()
+  \param seed See RandomFourierFeatureMap::Fit()
+  */
+  void SetRandomFeatures(int numberOfOutputs, double gamma, unsigned int seed)
+  {
+    m_NumberOfRandomFeatures = std::max(0, numberOfOutputs);
+    m_Gamma = gamma;
+    m_RandomFeatureSeed = seed;
+  }
+
+  //! Run all folds; one result per fold, in fold order
+  std::vector< CrossValidationFold > Run() const
+  {
+    if ((m_Subjects == NULL) || (m_Subjects->size() < m_NumberOfFolds))
+    {
+      CV_Error(CV_StsBadArg, "Cross-validation needs at least one subject per fold");
+    }
+    for (size_t s = 0; s < m_Subjects->size(); s++)
+    {
+      const SubjectSamples &subject = (*m_Subjects)[s];
+      if ((m_SamplesPerClass > 0) && (subject.keys.size() != static_cast< size_t >(subject.samples.rows)))
+      {
+        CV_Error(CV_StsBadArg, "Cross-validation with sampling needs all rows of every subject with their keys");
+      }
+    }
+
+    // shuffled subjects are dealt to the folds in turn, so fold sizes differ by at most one
+    std::vector< unsigned int > order(m_Subjects->size()), assignment(m_Subjects->size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+      order[i] = static_cast< unsigned int >(i);
+    }
+    std::mt19937 generator(m_Seed);
+    std::shuffle(order.begin(), order.end(), generator);
+    for (size_t i = 0; i < order.size(); i++)
+    {
+      assignment[order[i]] = static_cast< unsigned int >(i % m_NumberOfFolds);
+    }
+
+    std::vector< CrossValidationFold > folds(m_NumberOfFolds);
+    std::atomic< unsigned int > nextFold(0);
+    auto worker = [&]()
+    {
+      for (unsigned int f = nextFold++; f < m_NumberOfFolds; f = nextFold++)
+      {
+        folds[f] = this->RunFold(f, assignment);
+      }
+    };
+    std::vector< std::thread > threads;
+    for (unsigned int t = 0; t < std::min(m_NumberOfThreads, m_NumberOfFolds); t++)
+    {
+      threads.push_back(std::thread(worker));
+    }
+    for (size_t t = 0; t < threads.size(); t++)
+    {
+      threads[t].join();
+    }
+    return folds;
+  }
+
+private:
+  CrossValidationFold RunFold(unsigned int fold, const std::vector< unsigned int > &assignment) const
+  {
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const std::vector< SubjectSamples > &subjects = *m_Subjects;
+    CrossValidationFold result;
+    result.fold = fold;
+
+    // everything runs on a pool thread, so any exception, e.g., std::bad_alloc while copying the sets, has to end
+    // up in the result of the fold
+    try
+    {
+      cv::Mat trainingSamples, trainingLabels, testSamples, testLabels;
+      const bool sampled = (m_SamplesPerClass > 0);
+      ClassBalancedReservoirSampler sampler(m_SamplesPerClass, subjects.empty() ? 0 : subjects[0].samples.cols);
+      for (size_t s = 0; s < subjects.size(); s++)
+      {
+        if (subjects[s].samples.rows == 0)
+        {
+          continue;
+        }
+        if (assignment[s] == fold)
+        {
+          result.testSubjects.push_back(subjects[s].id);
+          testSamples.push_back(subjects[s].samples);
+          testLabels.push_back(subjects[s].labels);
+        }
+        else if (sampled)
+        {
+          sampler.Offer(subjects[s].samples, subjects[s].labels, subjects[s].keys);
+        }
+        else
+        {
+          trainingSamples.push_back(subjects[s].samples);
+          trainingLabels.push_back(subjects[s].labels);
+        }
+      }
+      if (sampled)
+      {
+        sampler.GetSamples(trainingSamples, trainingLabels, m_BalanceClasses);
+      }
+      result.trainingRows = trainingSamples.rows;
+      result.testRows = testSamples.rows;
+
+      // the map of the fold is fitted on its training rows only; the threads of the pool are already busy with folds
+      if (m_NumberOfRandomFeatures > 0)
+      {
+        RandomFourierFeatureMap featureMap;
+        featureMap.Fit(trainingSamples, m_NumberOfRandomFeatures, m_Gamma, m_RandomFeatureSeed);
+        featureMap.Transform(trainingSamples, trainingSamples, false);
+        featureMap.Transform(testSamples, testSamples, false);
+      }
+
+      LinearModel model;
+      LinearSVMTrainer trainer;
+      trainer.SetParameters(m_TrainerParameters);
+      if (m_WeightClasses)
+      {
+        trainer.BalanceClassWeights(trainingLabels);
+      }
+      const LinearSVMTrainer::Result training = trainer.Train(trainingSamples, trainingLabels, model);
+      result.epochs = training.epochs;
+      result.converged = training.converged;
+
+      size_t correct = 0, truePositives = 0, falsePositives = 0, falseNegatives = 0;
+      if (testSamples.rows > 0)
+      {
+        cv::Mat predicted;
+        linearModelPredict(model, testSamples, predicted, false, 4096, false);
+        for (int row = 0; row < testSamples.rows; row++)
+        {
+          const bool isPositive = (testLabels.at< float >(row) == model.positiveLabel);
+          const bool predictedPositive = (predicted.at< float >(row) == model.positiveLabel);
+          correct += (predicted.at< float >(row) == testLabels.at< float >(row)) ? 1 : 0;
+          truePositives += (isPositive && predictedPositive) ? 1 : 0;
+          falsePositives += (!isPositive && predictedPositive) ? 1 : 0;
+          falseNegatives += (isPositive && !predictedPositive) ? 1 : 0;
+        }
+      }
+      const size_t overlap = 2 * truePositives + falsePositives + falseNegatives;
+      result.accuracy = static_cast< double >(correct) / std::max< size_t >(1, result.testRows);
+      result.dice = (overlap > 0) ? 2.0 * truePositives / overlap : 1.0; // no lesion and none found
+    }
+    catch (cv::Exception &e)
+    {
+      result.error = e.what();
+    }
+    catch (std::exception &e)
+    {
+      result.error = e.what();
+    }
+    result.seconds = std::chrono::duration< double >(std::chrono::steady_clock::now() - start).count();
+    return result;
+  }
+
+  const std::vector< SubjectSamples > *m_Subjects;
+  unsigned int m_NumberOfFolds, m_NumberOfThreads, m_Seed;
+  size_t m_SamplesPerClass;
+  bool m_BalanceClasses;
+  LinearSVMTrainerParameters m_TrainerParameters;
+  bool m_WeightClasses;
+  int m_NumberOfRandomFeatures;
+  double m_Gamma;
+  unsigned int m_RandomFeatureSeed;
+};
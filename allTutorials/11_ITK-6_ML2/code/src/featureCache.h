@@ -0,0 +1,469 @@
+#pragma once
+
+#include "opencv2/core/core.hpp"
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "fileModificationTime.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/**
+\brief 64 bit FNV-1a hash; pass the previous result as 'hash' to hash several pieces as one stream
+*/
+inline unsigned long long fnv1aHash(const void *data, size_t length, unsigned long long hash = 14695981039346656037ULL)
+{
+  const unsigned char *bytes = static_cast< const unsigned char * >(data);
+  for (size_t i = 0; i < length; i++)
+  {
+    hash = (hash ^ bytes[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+inline unsigned long long fnv1aHash(const std::string &text, unsigned long long hash = 14695981039346656037ULL)
+{
+  return fnv1aHash(text.c_str(), text.length() + 1, hash); // with the terminator, so "ab"+"c" != "a"+"bc"
+}
+
+/**
+\brief Hash of the name, size, modification time and first bytes of a file; changes whenever the file is rewritten
+
+The modification time is taken to the nanosecond (see fileModificationTime()), so a file rewritten within a
+second with the same size is told apart. The first block holds the image header (size, spacing, orientation,
+pixel type) and is hashed as content; the rest of the file is not, since that would mean reading every input
+on every run.
+*/
+inline unsigned long long fileSignature(const std::string &fileName, unsigned long long hash = 14695981039346656037ULL)
+{
+  hash = fnv1aHash(fileName, hash);
+  struct stat status;
+  if (stat(fileName.c_str(), &status) != 0)
+  {
+    return fnv1aHash(std::string("<missing>"), hash);
+  }
+  const unsigned long long size = static_cast< unsigned long long >(status.st_size), modified = fileModificationTime(status);
+  hash = fnv1aHash(&size, sizeof(size), hash);
+  hash = fnv1aHash(&modified, sizeof(modified), hash);
+
+  unsigned char head[4096];
+  std::FILE *file = std::fopen(fileName.c_str(), "rb");
+  if (!file)
+  {
+    return fnv1aHash(std::string("<unreadable>"), hash);
+  }
+  const size_t length = std::fread(head, 1, sizeof(head), file);
+  std::fclose(file);
+  return fnv1aHash(head, length, hash);
+}
+
+/**
+\brief Binary cache of the per-subject feature blocks of a training set
+
+Layout (native byte order, every section starts at a multiple of 64 bytes):
+- Header: magic, version, key, number of features, rows, subjects and whether sampling keys are stored
+- Samples: [rows x features] float, the blocks of all subjects one after the other in subject order
+- Labels: [rows] float
+- Keys: [rows] double, the sampling keys of ClassBalancedReservoirSampler; only if stored
+- Subjects: first row, number of rows and ID of every subject
+
+The key identifies the inputs and the extraction settings (see fileSignature() and fnv1aHash()); a cache with
+another key or version is ignored. Open() maps the file read-only, so GetSamples() is a cv::Mat directly on
+the file, paged in by the OS, without parsing or copying.
+*/
+class FeatureCache
+{
+public:
+  enum
+  {
+    Version = 1,
+    Alignment = 64
+  };
+
+  FeatureCache() :
+    m_Data(NULL), m_Length(0), m_Header(NULL)
+#if defined(_WIN32)
+    , m_File(INVALID_HANDLE_VALUE), m_Mapping(NULL)
+#endif
+  {
+  }
+
+  ~FeatureCache()
+  {
+    this->Close();
+  }
+
+  /**
+  \brief Map a cache file
+
+  \return False if the file does not exist, is damaged, or has another version or key
+  */
+  bool Open(const std::string &fileName, unsigned long long key)
+  {
+    this->Close();
+    if (!this->Map(fileName) || (m_Length < sizeof(Header)))
+    {
+      this->Close();
+      return false;
+    }
+    m_Header = reinterpret_cast< const Header * >(m_Data);
+    if ((std::memcmp(m_Header->magic, "ML2FEAT", 8) != 0) || (m_Header->version != Version) || (m_Header->key != key) ||
+      (m_Header->samplesOffset + m_Header->rows * m_Header->numberOfFeatures * sizeof(float) > m_Header->labelsOffset) ||
+      (m_Header->labelsOffset + m_Header->rows * sizeof(float) > m_Header->keysOffset) ||
+      (m_Header->keysOffset + (m_Header->hasKeys ? m_Header->rows * sizeof(double) : 0) > m_Header->subjectsOffset) ||
+      (m_Length < m_Header->subjectsOffset))
+    {
+      this->Close();
+      return false;
+    }
+
+    // subject table
+    const char *table = m_Data + m_Header->subjectsOffset, *end = m_Data + m_Length;
+    for (unsigned long long s = 0; s < m_Header->numberOfSubjects; s++)
+    {
+      SubjectEntry entry;
+      unsigned long long idLength;
+      if (table + 3 * sizeof(unsigned long long) > end)
+      {
+        this->Close();
+        return false;
+      }
+      std::memcpy(&entry.firstRow, table, sizeof(unsigned long long));
+      std::memcpy(&entry.rows, table + sizeof(unsigned long long), sizeof(unsigned long long));
+      std::memcpy(&idLength, table + 2 * sizeof(unsigned long long), sizeof(unsigned long long));
+      table += 3 * sizeof(unsigned long long);
+      if ((table + idLength > end) || (entry.firstRow + entry.rows > m_Header->rows))
+      {
+        this->Close();
+        return false;
+      }
+      entry.id.assign(table, static_cast< size_t >(idLength));
+      table += idLength;
+      m_Subjects.push_back(entry);
+    }
+    return true;
+  }
+
+  void Close()
+  {
+    m_Subjects.clear();
+    m_Header = NULL;
+#if defined(_WIN32)
+    if (m_Data)
+    {
+      UnmapViewOfFile(m_Data);
+    }
+    if (m_Mapping)
+    {
+      CloseHandle(m_Mapping);
+    }
+    if (m_File != INVALID_HANDLE_VALUE)
+    {
+      CloseHandle(m_File);
+    }
+    m_Mapping = NULL;
+    m_File = INVALID_HANDLE_VALUE;
+#else
+    if (m_Data)
+    {
+      munmap(const_cast< char * >(m_Data), m_Length);
+    }
+#endif
+    m_Data = NULL;
+    m_Length = 0;
+  }
+
+  bool IsOpen() const
+  {
+    return m_Header != NULL;
+  }
+
+  //! All samples, [rows x features] CV_32F on the mapped file; valid until Close(), must not be written to
+  cv::Mat GetSamples() const
+  {
+    return cv::Mat(static_cast< int >(m_Header->rows), static_cast< int >(m_Header->numberOfFeatures), CV_32FC1,
+      const_cast< char * >(m_Data + m_Header->samplesOffset));
+  }
+
+  //! All labels, [rows x 1] CV_32F on the mapped file
+  cv::Mat GetLabels() const
+  {
+    return cv::Mat(static_cast< int >(m_Header->rows), 1, CV_32FC1, const_cast< char * >(m_Data + m_Header->labelsOffset));
+  }
+
+  //! Sampling keys of all rows, or NULL if none are stored
+  const double *GetKeys() const
+  {
+    return m_Header->hasKeys ? reinterpret_cast< const double * >(m_Data + m_Header->keysOffset) : NULL;
+  }
+
+  size_t GetNumberOfSubjects() const
+  {
+    return m_Subjects.size();
+  }
+
+  const std::string &GetSubjectID(size_t subject) const
+  {
+    return m_Subjects[subject].id;
+  }
+
+  //! Rows of GetSamples() which belong to a subject
+  cv::Range GetSubjectRows(size_t subject) const
+  {
+    const int first = static_cast< int >(m_Subjects[subject].firstRow);
+    return cv::Range(first, first + static_cast< int >(m_Subjects[subject].rows));
+  }
+
+private:
+  friend class FeatureCacheWriter;
+
+  //! Fixed size file header; the offsets are in bytes from the start of the file
+  struct Header
+  {
+    char magic[8];
+    unsigned int version;
+    unsigned int numberOfFeatures;
+    unsigned long long key;
+    unsigned long long rows;
+    unsigned long long numberOfSubjects;
+    unsigned long long hasKeys;
+    unsigned long long samplesOffset, labelsOffset, keysOffset, subjectsOffset;
+  };
+
+  struct SubjectEntry
+  {
+    std::string id;
+    unsigned long long firstRow, rows;
+  };
+
+  static unsigned long long Align(unsigned long long offset)
+  {
+    return (offset + Alignment - 1) / Alignment * Alignment;
+  }
+
+  bool Map(const std::string &fileName)
+  {
+#if defined(_WIN32)
+    m_File = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+    if ((m_File == INVALID_HANDLE_VALUE) || !GetFileSizeEx(m_File, &size) || (size.QuadPart == 0))
+    {
+      return false;
+    }
+    m_Mapping = CreateFileMappingA(m_File, NULL, PAGE_READONLY, 0, 0, NULL);
+    m_Data = m_Mapping ? static_cast< const char * >(MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0)) : NULL;
+    m_Length = static_cast< size_t >(size.QuadPart);
+    return m_Data != NULL;
+#else
+    const int file = open(fileName.c_str(), O_RDONLY);
+    struct stat status;
+    if ((file < 0) || (fstat(file, &status) != 0) || (status.st_size == 0))
+    {
+      if (file >= 0)
+      {
+        close(file);
+      }
+      return false;
+    }
+    void *data = mmap(NULL, static_cast< size_t >(status.st_size), PROT_READ, MAP_SHARED, file, 0);
+    close(file); // the mapping keeps the file open
+    if (data == MAP_FAILED)
+    {
+      return false;
+    }
+    m_Data = static_cast< const char * >(data);
+    m_Length = static_cast< size_t >(status.st_size);
+    return true;
+#endif
+  }
+
+  const char *m_Data; //! start of the mapped file
+  size_t m_Length; //! length of the mapped file in bytes
+  const Header *m_Header; //! NULL unless a valid cache is open
+  std::vector< SubjectEntry > m_Subjects;
+#if defined(_WIN32)
+  HANDLE m_File, m_Mapping;
+#endif
+};
+
+/**
+\brief Write a FeatureCache while the subject blocks are merged
+
+The samples are streamed to '<fileName>.tmp' as they arrive; labels and keys are kept until Commit(), which
+appends them, writes the header and renames the file, so a cache which exists is always complete.
+*/
+class FeatureCacheWriter
+{
+public:
+  FeatureCacheWriter() :
+    m_File(NULL), m_Position(0), m_Key(0), m_NumberOfFeatures(0), m_HasKeys(false), m_Rows(0)
+  {
+  }
+
+  ~FeatureCacheWriter()
+  {
+    this->Abort();
+  }
+
+  /**
+  \brief Start a cache
+
+  \param fileName The cache file
+  \param key Key of the inputs and settings, checked by FeatureCache::Open()
+  \param numberOfFeatures Columns of the sample blocks
+  \param hasKeys Whether AddSubject() gets sampling keys
+  */
+  bool Open(const std::string &fileName, unsigned long long key, int numberOfFeatures, bool hasKeys)
+  {
+    this->Abort();
+    m_FileName = fileName;
+    m_File = std::fopen((fileName + ".tmp").c_str(), "wb");
+    if (!m_File)
+    {
+      return false;
+    }
+    m_Key = key;
+    m_NumberOfFeatures = numberOfFeatures;
+    m_HasKeys = hasKeys;
+    m_Rows = 0;
+    m_Position = 0;
+    m_Labels.clear();
+    m_Keys.clear();
+    m_Subjects.clear();
+    return this->Pad(FeatureCache::Align(sizeof(FeatureCache::Header))); // the header is written by Commit()
+  }
+
+  bool IsOpen() const
+  {
+    return m_File != NULL;
+  }
+
+  //! Append the block of the next subject; 'keys' holds one key per row if the cache stores keys
+  bool AddSubject(const std::string &id, const cv::Mat &samples, const cv::Mat &labels, const std::vector< double > &keys)
+  {
+    if (!m_File)
+    {
+      return false;
+    }
+    CV_Assert((samples.rows == 0) || ((samples.type() == CV_32FC1) && (samples.cols == m_NumberOfFeatures)));
+    CV_Assert(!m_HasKeys || (keys.size() == static_cast< size_t >(samples.rows)));
+
+    FeatureCache::SubjectEntry entry;
+    entry.id = id;
+    entry.firstRow = m_Rows;
+    entry.rows = static_cast< unsigned long long >(samples.rows);
+    for (int row = 0; row < samples.rows; row++)
+    {
+      if (!this->Write(samples.ptr< float >(row), m_NumberOfFeatures * sizeof(float)))
+      {
+        this->Abort();
+        return false;
+      }
+      m_Labels.push_back(labels.at< float >(row));
+    }
+    if (m_HasKeys)
+    {
+      m_Keys.insert(m_Keys.end(), keys.begin(), keys.end());
+    }
+    m_Rows += entry.rows;
+    m_Subjects.push_back(entry);
+    return true;
+  }
+
+  //! Finish the cache and move it into place
+  bool Commit()
+  {
+    if (!m_File)
+    {
+      return false;
+    }
+    FeatureCache::Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "ML2FEAT", 8);
+    header.version = FeatureCache::Version;
+    header.numberOfFeatures = static_cast< unsigned int >(m_NumberOfFeatures);
+    header.key = m_Key;
+    header.rows = m_Rows;
+    header.numberOfSubjects = m_Subjects.size();
+    header.hasKeys = m_HasKeys ? 1 : 0;
+    header.samplesOffset = FeatureCache::Align(sizeof(FeatureCache::Header));
+    header.labelsOffset = FeatureCache::Align(header.samplesOffset + m_Rows * m_NumberOfFeatures * sizeof(float));
+    header.keysOffset = FeatureCache::Align(header.labelsOffset + m_Rows * sizeof(float));
+    header.subjectsOffset = FeatureCache::Align(header.keysOffset + m_Keys.size() * sizeof(double));
+
+    bool ok = this->Pad(header.labelsOffset) && this->Write(m_Labels.empty() ? NULL : &m_Labels[0], m_Labels.size() * sizeof(float)) &&
+      this->Pad(header.keysOffset) && this->Write(m_Keys.empty() ? NULL : &m_Keys[0], m_Keys.size() * sizeof(double)) &&
+      this->Pad(header.subjectsOffset);
+    for (size_t s = 0; ok && (s < m_Subjects.size()); s++)
+    {
+      const unsigned long long idLength = m_Subjects[s].id.length();
+      ok = this->Write(&m_Subjects[s].firstRow, sizeof(unsigned long long)) && this->Write(&m_Subjects[s].rows, sizeof(unsigned long long)) &&
+        this->Write(&idLength, sizeof(idLength)) && this->Write(m_Subjects[s].id.c_str(), m_Subjects[s].id.length());
+    }
+    ok = ok && (std::fseek(m_File, 0, SEEK_SET) == 0) && (std::fwrite(&header, sizeof(header), 1, m_File) == 1);
+    ok = (std::fclose(m_File) == 0) && ok;
+    m_File = NULL;
+
+    const std::string temporary = m_FileName + ".tmp";
+    std::remove(m_FileName.c_str()); // rename() does not replace existing files on Windows
+    if (!ok || (std::rename(temporary.c_str(), m_FileName.c_str()) != 0))
+    {
+      std::remove(temporary.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  //! Discard the cache
+  void Abort()
+  {
+    if (m_File)
+    {
+      std::fclose(m_File);
+      m_File = NULL;
+      std::remove((m_FileName + ".tmp").c_str());
+    }
+  }
+
+private:
+  bool Write(const void *data, size_t length)
+  {
+    m_Position += length;
+    return (length == 0) || (std::fwrite(data, 1, length, m_File) == length);
+  }
+
+  //! Write zeros up to 'offset'
+  bool Pad(unsigned long long offset)
+  {
+    static const char zeros[FeatureCache::Alignment] = { 0 };
+    bool ok = (m_Position <= offset);
+    while (ok && (m_Position < offset))
+    {
+      ok = this->Write(zeros, static_cast< size_t >(std::min< unsigned long long >(offset - m_Position, sizeof(zeros))));
+    }
+    return ok;
+  }
+
+  std::FILE *m_File;
+  std::string m_FileName;
+  unsigned long long m_Position; //! bytes written so far; ftell() is 32 bit on some platforms
+  unsigned long long m_Key;
+  int m_NumberOfFeatures;
+  bool m_HasKeys;
+  unsigned long long m_Rows;
+  std::vector< float > m_Labels;
+  std::vector< double > m_Keys;
+  std::vector< FeatureCache::SubjectEntry > m_Subjects;
+};
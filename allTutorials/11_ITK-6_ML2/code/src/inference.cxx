@@ -0,0 +1,400 @@
+/**
+\brief 11_ITK-ML-2: Apply a trained lesion model to new subjects
+
+Every subject is scored by a streaming pipeline: the writer requests the output slab by slab, and every slab
+is read from the T1, T2, PD, FL and foreground images, scored and written before the next one is read. The
+output has the geometry of the inputs. Models trained with neighborhood features, intensity normalization or
+random Fourier features need whole volumes; their subjects are read completely and scored through the
+feature matrix of the foreground voxels instead.
+*/
+#include <vector>
+#include <string>
+#include <iostream>
+#include <cstdlib>
+#include <algorithm>
+#include <cmath>
+
+//! ITK headers
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+#include "itkImageIOFactory.h"
+#include "itkStreamingImageFilter.h"
+
+#include "subjectManifest.h"
+#include "linearModel.h"
+#include "itkLinearModelScoringImageFilter.h"
+#include "maskedFeatureExtractor.h"
+#include "neighborhoodFeatures.h"
+#include "intensityNormalization.h"
+#include "imageComponentType.h"
+#include "randomFourierFeatures.h"
+
+typedef float PixelType; // pre-define expected pixel type
+typedef itk::Image< PixelType, 3 > FloatImageType;
+typedef itk::Image< unsigned char, 3 > MaskImageType; // foreground masks are binary
+typedef itk::Image< unsigned char, 3 > LabelImageType;
+
+/**
+\brief Score one subject and write the result
+
+\param subject The subject; needs T1, T2, PD, FL and foreground images
+\param model The trained model; features are T1, T2, PD and FL as in training
+\param outputType Label, decision value or probability
+\param outputFile The file to write
+\param numberOfSlabs Number of pieces the volume is read, scored and written in
+
+The feature images are read with pixel type TInputImageType, e.g., their storage type.
+*/
+template < typename TInputImageType, typename TOutputImageType >
+void scoreSubject(const SubjectFiles &subject, const LinearModel &model,
+  typename itk::LinearModelScoringImageFilter< TInputImageType, MaskImageType, TOutputImageType >::OutputType outputType,
+  const std::string &outputFile, unsigned int numberOfSlabs)
+{
+  typedef itk::ImageFileReader< TInputImageType > ReaderType;
+  typedef itk::ImageFileReader< MaskImageType > MaskReaderType;
+  typedef itk::LinearModelScoringImageFilter< TInputImageType, MaskImageType, TOutputImageType > ScoringFilterType;
+  typedef itk::ImageFileWriter< TOutputImageType > WriterType;
+
+  // same feature order as in training
+  const SubjectFiles::FileType features[] = { SubjectFiles::T1, SubjectFiles::T2, SubjectFiles::PD, SubjectFiles::FL };
+  typename ScoringFilterType::Pointer scoring = ScoringFilterType::New();
+  scoring->SetModel(model);
+  scoring->SetOutputType(outputType);
+  std::vector< typename ReaderType::Pointer > readers; // an image does not keep its source alive
+  for (unsigned int f = 0; f < 4; f++)
+  {
+    readers.push_back(ReaderType::New());
+    readers.back()->SetFileName(subject.files[features[f]]);
+    scoring->SetFeatureImage(f, readers.back()->GetOutput());
+  }
+  typename MaskReaderType::Pointer maskReader = MaskReaderType::New();
+  maskReader->SetFileName(subject.files[SubjectFiles::Foreground]);
+  scoring->SetMaskImage(maskReader->GetOutput());
+
+  typename WriterType::Pointer writer = WriterType::New();
+  writer->SetFileName(outputFile);
+
+  // formats which can be written in pieces (e.g., .nii, .mha) get the slabs straight from the writer; for the
+  // others (e.g., .nii.gz) the slabs are assembled in memory first, which still streams the inputs
+  typedef itk::StreamingImageFilter< TOutputImageType, TOutputImageType > StreamingFilterType;
+  typename StreamingFilterType::Pointer streaming;
+  itk::ImageIOBase::Pointer io = itk::ImageIOFactory::CreateImageIO(outputFile.c_str(), itk::ImageIOFactory::WriteMode);
+  if (io.IsNotNull() && io->CanStreamWrite())
+  {
+    writer->SetInput(scoring->GetOutput());
+    writer->SetNumberOfStreamDivisions(numberOfSlabs);
+  }
+  else
+  {
+    streaming = StreamingFilterType::New();
+    streaming->SetInput(scoring->GetOutput());
+    streaming->SetNumberOfStreamDivisions(numberOfSlabs);
+    writer->SetInput(streaming->GetOutput());
+  }
+  writer->Update();
+}
+
+/**
+\brief Score one subject with a model which uses neighborhood features, normalized intensities or random features
+
+The intensities are matched to the reference landmarks, the features of the foreground voxels are computed
+exactly as in training, then mapped to random Fourier features if the model has them and predicted chunk by
+chunk (see linearModelPredict()); the responses of a chunk go straight to its voxels of an image with the
+geometry of the inputs, so neither the random features nor the responses of all voxels are held at once.
+
+\param subject The subject; needs T1, T2, PD, FL and foreground images
+\param model The trained model
+\param neighborhood The neighborhood features the model was trained with
+\param referenceLandmarks Landmarks of T1, T2, PD and FL the model was trained with; empty if not normalized
+\param featureMap Random Fourier feature map of the model; disabled if the model is linear in the features
+\param outputType Label, decision value or probability
+\param outputFile The file to write
+
+The feature images are read with pixel type TInputImageType, which has to be a real type if
+referenceLandmarks is set.
+*/
+template < typename TInputImageType, typename TOutputImageType >
+void scoreSubjectInMemory(const SubjectFiles &subject, const LinearModel &model, const NeighborhoodFeatureSettings &neighborhood,
+  const std::vector< IntensityLandmarks > &referenceLandmarks, const RandomFourierFeatureMap &featureMap,
+  typename itk::LinearModelScoringImageFilter< TInputImageType, MaskImageType, TOutputImageType >::OutputType outputType,
+  const std::string &outputFile)
+{
+  typedef itk::ImageFileReader< TInputImageType > ReaderType;
+  typedef itk::ImageFileReader< MaskImageType > MaskReaderType;
+  typedef itk::LinearModelScoringImageFilter< TInputImageType, MaskImageType, TOutputImageType > ScoringFilterType;
+
+  const SubjectFiles::FileType types[] = { SubjectFiles::T1, SubjectFiles::T2, SubjectFiles::PD, SubjectFiles::FL };
+  std::vector< typename TInputImageType::Pointer > images;
+  for (unsigned int i = 0; i < 4; i++)
+  {
+    typename ReaderType::Pointer reader = ReaderType::New();
+    reader->SetFileName(subject.files[types[i]]);
+    reader->Update();
+    images.push_back(reader->GetOutput());
+  }
+  typename MaskReaderType::Pointer maskReader = MaskReaderType::New();
+  maskReader->SetFileName(subject.files[SubjectFiles::Foreground]);
+  maskReader->Update();
+  const MaskImageType *mask = maskReader->GetOutput();
+  ForegroundIndex foreground; // shared by the normalization and the extraction; kept next to the mask for the next run
+  foreground.Load(mask, subject.files[SubjectFiles::Foreground]);
+  for (size_t i = 0; i < referenceLandmarks.size(); i++)
+  {
+    HistogramLandmarkNormalizer< TInputImageType, MaskImageType > normalizer;
+    normalizer.SetReference(referenceLandmarks[i]);
+    normalizer.Normalize(images[i], mask, &foreground);
+  }
+
+  MaskedFeatureExtractor< TInputImageType, MaskImageType > extractor;
+  NeighborhoodFeatureGenerator< TInputImageType, MaskImageType > generator;
+  generator.SetSettings(neighborhood);
+  for (unsigned int i = 0; i < 4; i++)
+  {
+    extractor.AddImage(images[i]);
+    generator.AddImage(images[i]);
+  }
+  extractor.SetMask(mask);
+  extractor.SetForegroundIndex(&foreground);
+  generator.SetMask(mask);
+  generator.SetForegroundIndex(&foreground);
+  const int count = static_cast< int >(extractor.CountSamples());
+  cv::Mat samples(count, static_cast< int >(extractor.GetNumberOfFeatures() + generator.GetNumberOfFeatures()), CV_32FC1);
+  if (count > 0)
+  {
+    extractor.Extract(samples.ptr< float >(0), samples.step1(), NULL);
+    generator.Extract(samples.ptr< float >(0) + extractor.GetNumberOfFeatures(), samples.step1());
+  }
+
+  typename TOutputImageType::Pointer output = TOutputImageType::New();
+  output->CopyInformation(mask);
+  output->SetRegions(mask->GetBufferedRegion());
+  output->Allocate();
+  output->FillBuffer(0);
+  typename TOutputImageType::PixelType *outputBuffer = output->GetBufferPointer();
+
+  // a chunk is one block of rows per thread; its features and responses reuse the same buffers for every chunk,
+  // and the foreground runs give the voxel of every row
+  const int chunkSize = RandomFourierFeatureMap::BlockSize * std::max(1, cv::getNumThreads());
+  cv::Mat features, responses;
+  size_t run = 0;
+  unsigned long long offset = foreground.IsEmpty() ? 0 : foreground.GetRun(0).begin;
+  for (int first = 0; first < count; first += chunkSize)
+  {
+    featureMap.Transform(samples.rowRange(first, std::min(first + chunkSize, count)), features);
+    linearModelPredict(model, features, responses, outputType != ScoringFilterType::LABEL);
+    for (int row = 0; row < responses.rows; row++, offset++)
+    {
+      if (offset == foreground.GetRun(run).end)
+      {
+        offset = foreground.GetRun(++run).begin;
+      }
+      const float response = responses.at< float >(row);
+      outputBuffer[offset] = static_cast< typename TOutputImageType::PixelType >(
+        (outputType == ScoringFilterType::PROBABILITY) ? 1.0 / (1.0 + std::exp(-static_cast< double >(response))) : response);
+    }
+  }
+
+  typedef itk::ImageFileWriter< TOutputImageType > WriterType;
+  typename WriterType::Pointer writer = WriterType::New();
+  writer->SetFileName(outputFile);
+  writer->SetInput(output);
+  writer->Update();
+}
+
+/**
+\brief Score one subject with its feature images read as TInputImageType, see scoreSubject() and scoreSubjectInMemory()
+
+\param streamed Whether the model can be applied slab by slab, i.e., it uses no neighborhood features, normalized
+intensities or random features
+\param outputName 'label', 'probability' or 'decision'
+*/
+template < typename TInputImageType >
+void scoreSubjectAs(const SubjectFiles &subject, const LinearModel &model, const NeighborhoodFeatureSettings &neighborhood,
+  const std::vector< IntensityLandmarks > &referenceLandmarks, const RandomFourierFeatureMap &featureMap, bool streamed,
+  const std::string &outputName,
+  const std::string &outputFile, unsigned int numberOfSlabs)
+{
+  typedef itk::LinearModelScoringImageFilter< TInputImageType, MaskImageType, LabelImageType > LabelScoringFilterType;
+  typedef itk::LinearModelScoringImageFilter< TInputImageType, MaskImageType, FloatImageType > ScoringFilterType;
+  const typename ScoringFilterType::OutputType outputType = (outputName == "probability") ? ScoringFilterType::PROBABILITY :
+    ScoringFilterType::DECISION_VALUE;
+  if (streamed && (outputName == "label"))
+  {
+    scoreSubject< TInputImageType, LabelImageType >(subject, model, LabelScoringFilterType::LABEL, outputFile, numberOfSlabs);
+  }
+  else if (streamed)
+  {
+    scoreSubject< TInputImageType, FloatImageType >(subject, model, outputType, outputFile, numberOfSlabs);
+  }
+  else if (outputName == "label")
+  {
+    scoreSubjectInMemory< TInputImageType, LabelImageType >(subject, model, neighborhood, referenceLandmarks, featureMap,
+      LabelScoringFilterType::LABEL, outputFile);
+  }
+  else
+  {
+    scoreSubjectInMemory< TInputImageType, FloatImageType >(subject, model, neighborhood, referenceLandmarks, featureMap,
+      outputType, outputFile);
+  }
+}
+
+// main entry of program
+int main(int argc, char *argv[])
+{
+  try // to catch exceptions
+  {
+    if (argc < 4)
+    {
+      std::cerr << "Usage: " << argv[0] << " <modelFile> <dataDirectory|manifestFile> <outputDirectory> [options]\n" <<
+        "  modelFile is written by ITK_Tutorial_ML-2; subjects need T1, T2, PD, FL and foreground images\n" <<
+        "Options:\n" <<
+        "  -output <label|probability|decision>  What is written per voxel (default: label)\n" <<
+        "  -slabs <n>      Number of pieces each volume is processed in; bounds the memory (default: 16)\n" <<
+        "  -extension <e>  Extension of the output files (default: .nii.gz)\n";
+      return EXIT_FAILURE;
+    }
+    const std::string modelFile = argv[1], input = argv[2];
+    std::string outputDirectory = argv[3], outputName = "label", extension = ".nii.gz";
+    unsigned int numberOfSlabs = 16;
+    for (int i = 4; i < argc; i++)
+    {
+      std::string option = argv[i];
+      if ((option == "-output") && (i + 1 < argc))
+      {
+        outputName = argv[++i];
+      }
+      else if ((option == "-slabs") && (i + 1 < argc))
+      {
+        numberOfSlabs = static_cast< unsigned int >(std::max(1, std::atoi(argv[++i])));
+      }
+      else if ((option == "-extension") && (i + 1 < argc))
+      {
+        extension = argv[++i];
+      }
+      else
+      {
+        std::cerr << "Unknown option '" << option << "'\n";
+        return EXIT_FAILURE;
+      }
+    }
+    if ((outputName != "label") && (outputName != "probability") && (outputName != "decision"))
+    {
+      std::cerr << "Unknown output '" << outputName << "'\n";
+      return EXIT_FAILURE;
+    }
+    if ((outputDirectory[outputDirectory.length() - 1] != '/') && (outputDirectory[outputDirectory.length() - 1] != '\\'))
+    {
+      outputDirectory += "/";
+    }
+
+    LinearModel model;
+    NeighborhoodFeatureSettings neighborhood;
+    std::vector< IntensityLandmarks > referenceLandmarks;
+    RandomFourierFeatureMap featureMap;
+    if (loadLinearModel(model, modelFile))
+    {
+      cv::FileStorage modelStorage(modelFile, cv::FileStorage::READ);
+      neighborhood.Read(modelStorage);
+      IntensityLandmarks::ReadSequence(modelStorage["intensityLandmarks"], referenceLandmarks);
+      featureMap.Read(modelStorage);
+    }
+    const size_t numberOfFeatures = 4 * (1 + neighborhood.GetNumberOfFeaturesPerImage());
+    if ((featureMap.IsEnabled() && ((featureMap.GetNumberOfInputs() != static_cast< int >(numberOfFeatures)) ||
+      (model.weights.size() != static_cast< size_t >(featureMap.GetNumberOfOutputs())))) ||
+      (!featureMap.IsEnabled() && (model.weights.size() != numberOfFeatures)))
+    {
+      std::cerr << "Could not read a model of T1, T2, PD and FL from '" << modelFile << "'.\n";
+      return EXIT_FAILURE;
+    }
+    if (!referenceLandmarks.empty() && (referenceLandmarks.size() != 4))
+    {
+      std::cerr << "The intensity landmarks of '" << modelFile << "' are not those of T1, T2, PD and FL.\n";
+      return EXIT_FAILURE;
+    }
+    // a slab cannot be normalized on its own: the landmarks come from the histogram of the whole foreground;
+    // the scoring filter only evaluates models which are linear in the intensities
+    const bool streamed = (neighborhood.GetNumberOfFeaturesPerImage() == 0) && referenceLandmarks.empty() && !featureMap.IsEnabled();
+
+    // the subjects: a saved manifest, or all subjects found in a directory
+    SubjectManifest manifest;
+    if (!manifest.Load(input))
+    {
+      manifest.Build(input + "/", SubjectManifest::ListDirectory(input));
+    }
+
+    const std::vector< SubjectFiles > &subjects = manifest.GetSubjects();
+    size_t scored = 0;
+    for (size_t s = 0; s < subjects.size(); s++)
+    {
+      const SubjectFiles &subject = subjects[s];
+      if (subject.files[SubjectFiles::T1].empty() || subject.files[SubjectFiles::T2].empty() || subject.files[SubjectFiles::PD].empty() ||
+        subject.files[SubjectFiles::FL].empty() || subject.files[SubjectFiles::Foreground].empty())
+      {
+        std::cerr << "Skipping subject '" << subject.id << "', which misses an image.\n";
+        continue;
+      }
+
+      const std::string outputFile = outputDirectory + subject.id + "." + outputName + extension;
+      try
+      {
+        // feature images keep their storage type; normalized intensities are new real values and need float
+        std::vector< std::string > modalities;
+        modalities.push_back(subject.files[SubjectFiles::T1]);
+        modalities.push_back(subject.files[SubjectFiles::T2]);
+        modalities.push_back(subject.files[SubjectFiles::PD]);
+        modalities.push_back(subject.files[SubjectFiles::FL]);
+        switch (referenceLandmarks.empty() ? commonComponentType(modalities) : itk::ImageIOBase::FLOAT)
+        {
+        case itk::ImageIOBase::UCHAR:
+          scoreSubjectAs< itk::Image< unsigned char, 3 > >(subject, model, neighborhood, referenceLandmarks, featureMap, streamed,
+            outputName, outputFile, numberOfSlabs);
+          break;
+        case itk::ImageIOBase::USHORT:
+          scoreSubjectAs< itk::Image< unsigned short, 3 > >(subject, model, neighborhood, referenceLandmarks, featureMap, streamed,
+            outputName, outputFile, numberOfSlabs);
+          break;
+        case itk::ImageIOBase::SHORT:
+          scoreSubjectAs< itk::Image< short, 3 > >(subject, model, neighborhood, referenceLandmarks, featureMap, streamed,
+            outputName, outputFile, numberOfSlabs);
+          break;
+        default:
+          scoreSubjectAs< FloatImageType >(subject, model, neighborhood, referenceLandmarks, featureMap, streamed,
+            outputName, outputFile, numberOfSlabs);
+          break;
+        }
+        std::cout << "Wrote '" << outputFile << "'.\n";
+        scored++;
+      }
+      catch (itk::ExceptionObject &e)
+      {
+        std::cerr << "Subject '" << subject.id << "' failed: " << e.what() << "\n";
+      }
+      catch (cv::Exception &e) // e.g., a CV_Assert of the model or feature map against the features
+      {
+        std::cerr << "Subject '" << subject.id << "' failed: " << e.what() << "\n";
+      }
+      catch (std::exception &e) // e.g., std::bad_alloc in the in-memory path; the next subject may still fit
+      {
+        std::cerr << "Subject '" << subject.id << "' failed: " << e.what() << "\n";
+      }
+    }
+    std::cout << "Scored " << scored << " of " << subjects.size() << " subjects.\n";
+    if (scored < subjects.size())
+    {
+      return EXIT_FAILURE;
+    }
+  }
+  catch (itk::ExceptionObject &error)
+  {
+    std::cerr << "Exception caught: " << error << "\n";
+    return EXIT_FAILURE;
+  }
+  catch (cv::Exception &error) // e.g., while reading the model
+  {
+    std::cerr << "Exception caught: " << error.what() << "\n";
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,406 @@
+#pragma once
+
+#include "itkImage.h"
+#include "itkMacro.h"
+
+#include "opencv2/core/core.hpp"
+
+#include "foregroundIndex.h"
+
+#include <vector>
+#include <string>
+#include <limits>
+#include <algorithm>
+
+/**
+\brief Intensities of an image at fixed percentiles of its foreground histogram
+*/
+struct IntensityLandmarks
+{
+  std::vector< double > percentiles; //! in [0, 100], increasing
+  std::vector< double > values; //! intensity at every percentile; empty if not computed
+
+  //! The landmarks of Nyul and Udupa: 1st, 10th, 20th, ..., 90th and 99th percentile
+  static std::vector< double > DefaultPercentiles()
+  {
+    std::vector< double > percentiles(1, 1.0);
+    for (int p = 10; p <= 90; p += 10)
+    {
+      percentiles.push_back(p);
+    }
+    percentiles.push_back(99.0);
+    return percentiles;
+  }
+
+  bool IsValid() const
+  {
+    return (values.size() >= 2) && (values.size() == percentiles.size());
+  }
+
+  //! Write as an unnamed mapping, e.g., an element of a sequence
+  void Write(cv::FileStorage &storage) const
+  {
+    storage << "{" << "percentiles" << percentiles << "values" << values << "}";
+  }
+
+  void Read(const cv::FileNode &node)
+  {
+    percentiles.clear();
+    values.clear();
+    if (!node.empty())
+    {
+      node["percentiles"] >> percentiles;
+      node["values"] >> values;
+    }
+  }
+
+  //! Write the landmarks of several images, e.g., one per modality, as a sequence called 'name'
+  static void WriteSequence(cv::FileStorage &storage, const std::string &name, const std::vector< IntensityLandmarks > &landmarks)
+  {
+    storage << name << "[";
+    for (size_t i = 0; i < landmarks.size(); i++)
+    {
+      landmarks[i].Write(storage);
+    }
+    storage << "]";
+  }
+
+  //! Read what WriteSequence() wrote; a missing node gives no landmarks
+  static void ReadSequence(const cv::FileNode &node, std::vector< IntensityLandmarks > &landmarks)
+  {
+    landmarks.clear();
+    if (node.empty() || !node.isSeq())
+    {
+      return;
+    }
+    landmarks.resize(node.size());
+    for (size_t i = 0; i < landmarks.size(); i++)
+    {
+      landmarks[i].Read(node[static_cast< int >(i)]);
+    }
+  }
+};
+
+/**
+\brief Parallel bodies of HistogramLandmarkNormalizer; every range is a block of voxels
+
+Every block writes into its own slot (range, histogram), so no two threads share memory; the slots are merged
+once afterwards. The caller makes the blocks large enough that there are only a few per thread, which bounds
+the memory of the slots by the number of threads rather than by the size of the image. With a
+ForegroundIndex, a block only visits the parts of the runs which fall into it.
+*/
+template < typename TPixelType, typename TMaskPixelType >
+class IntensityHistogramBody : public cv::ParallelLoopBody
+{
+public:
+  enum Pass
+  {
+    RANGE,
+    HISTOGRAM
+  };
+
+  IntensityHistogramBody(Pass pass, const TPixelType *values, const TMaskPixelType *mask, const ForegroundIndex *foreground,
+    size_t count, size_t blockSize, double minimum, double binWidth, std::vector< double > &minima, std::vector< double > &maxima,
+    std::vector< std::vector< double > > &histograms) :
+    m_Pass(pass), m_Values(values), m_Mask(mask), m_Foreground(foreground), m_Count(count), m_BlockSize(blockSize),
+    m_Minimum(minimum), m_BinWidth(binWidth), m_Minima(minima), m_Maxima(maxima), m_Histograms(histograms)
+  {
+  }
+
+  void operator()(const cv::Range &blocks) const
+  {
+    for (int block = blocks.start; block < blocks.end; block++)
+    {
+      const size_t begin = static_cast< size_t >(block) * m_BlockSize, end = std::min(begin + m_BlockSize, m_Count);
+      if (m_Pass == RANGE)
+      {
+        double minimum = std::numeric_limits< double >::max(), maximum = -std::numeric_limits< double >::max();
+        auto range = [&](size_t o)
+        {
+          minimum = std::min(minimum, static_cast< double >(m_Values[o]));
+          maximum = std::max(maximum, static_cast< double >(m_Values[o]));
+        };
+        this->ForEachForegroundVoxel(begin, end, range);
+        m_Minima[block] = minimum;
+        m_Maxima[block] = maximum;
+      }
+      else
+      {
+        std::vector< double > &histogram = m_Histograms[block];
+        const int lastBin = static_cast< int >(histogram.size()) - 1;
+        auto count = [&](size_t o)
+        {
+          const int bin = static_cast< int >((static_cast< double >(m_Values[o]) - m_Minimum) / m_BinWidth);
+          histogram[std::min(std::max(bin, 0), lastBin)] += 1;
+        };
+        this->ForEachForegroundVoxel(begin, end, count);
+      }
+    }
+  }
+
+private:
+  IntensityHistogramBody &operator=(const IntensityHistogramBody &); // purposely not implemented
+
+  //! Call function(offset) for the foreground voxels in [begin, end)
+  template < typename TFunction >
+  void ForEachForegroundVoxel(size_t begin, size_t end, TFunction &function) const
+  {
+    if (m_Foreground)
+    {
+      for (size_t r = m_Foreground->FindRun(begin); (r < m_Foreground->GetNumberOfRuns()) && (m_Foreground->GetRun(r).begin < end); r++)
+      {
+        const size_t first = std::max(begin, static_cast< size_t >(m_Foreground->GetRun(r).begin));
+        const size_t last = std::min(end, static_cast< size_t >(m_Foreground->GetRun(r).end));
+        for (size_t o = first; o < last; o++)
+        {
+          function(o);
+        }
+      }
+      return;
+    }
+    for (size_t o = begin; o < end; o++)
+    {
+      if (m_Mask[o] != 0)
+      {
+        function(o);
+      }
+    }
+  }
+
+  Pass m_Pass;
+  const TPixelType *m_Values;
+  const TMaskPixelType *m_Mask;
+  const ForegroundIndex *m_Foreground;
+  size_t m_Count, m_BlockSize;
+  double m_Minimum, m_BinWidth;
+  std::vector< double > &m_Minima, &m_Maxima;
+  std::vector< std::vector< double > > &m_Histograms;
+};
+
+/**
+\brief Apply a per-bin linear map, value = scale[bin] * value + offset[bin], to every voxel of a block
+*/
+template < typename TPixelType >
+class LookupTableApplyBody : public cv::ParallelLoopBody
+{
+public:
+  LookupTableApplyBody(TPixelType *values, size_t count, size_t blockSize, float minimum, float inverseBinWidth,
+    const std::vector< float > &scales, const std::vector< float > &offsets) :
+    m_Values(values), m_Count(count), m_BlockSize(blockSize), m_Minimum(minimum), m_InverseBinWidth(inverseBinWidth),
+    m_Scales(scales), m_Offsets(offsets)
+  {
+  }
+
+  void operator()(const cv::Range &blocks) const
+  {
+    const float *scales = &m_Scales[0], *offsets = &m_Offsets[0];
+    const float lastBin = static_cast< float >(m_Scales.size() - 1);
+    for (int block = blocks.start; block < blocks.end; block++)
+    {
+      const size_t begin = static_cast< size_t >(block) * m_BlockSize, end = std::min(begin + m_BlockSize, m_Count);
+      // no branches in the loop: the bin is clamped arithmetically, the map is a gather and a multiply-add
+      for (size_t o = begin; o < end; o++)
+      {
+        const float value = static_cast< float >(m_Values[o]);
+        const int bin = static_cast< int >(std::min(std::max((value - m_Minimum) * m_InverseBinWidth, 0.0f), lastBin));
+        m_Values[o] = static_cast< TPixelType >(scales[bin] * value + offsets[bin]);
+      }
+    }
+  }
+
+private:
+  LookupTableApplyBody &operator=(const LookupTableApplyBody &); // purposely not implemented
+
+  TPixelType *m_Values;
+  size_t m_Count, m_BlockSize;
+  float m_Minimum, m_InverseBinWidth;
+  const std::vector< float > &m_Scales, &m_Offsets;
+};
+
+/**
+\brief Piecewise linear histogram matching of an image to reference landmarks (Nyul and Udupa)
+
+The landmarks of the image are the intensities at fixed percentiles of its foreground histogram; the image is
+mapped linearly between consecutive landmarks onto the reference landmarks, and extrapolated beyond the first
+and last ones. The histogram is built with one histogram per slab of voxels, a few slabs per thread, filled in
+parallel and merged afterwards. The map is then tabulated per histogram bin as scale and offset and applied to all voxels in
+parallel, which is a single branch-free pass over the buffer. The table is exact except within the bins which
+contain a landmark, where the error is below a bin width of the mapped range. Given a ForegroundIndex of the
+mask, the histogram passes only visit its runs.
+*/
+template < typename TImageType, typename TMaskImageType = TImageType >
+class HistogramLandmarkNormalizer
+{
+public:
+  enum
+  {
+    NumberOfBins = 4096,
+    BlockSize = 65536, //! voxels per parallel task of the lookup table pass
+    SlabsPerThread = 4 //! slabs (each with its own histogram) per thread of the histogram passes, for load balance
+  };
+
+  /**
+  \brief Landmarks of the foreground of 'image'; values is empty if the foreground is empty or constant
+
+  \param foreground Optional index of 'mask', whose runs are visited instead of every voxel; may be NULL
+  */
+  static IntensityLandmarks ComputeLandmarks(const TImageType *image, const TMaskImageType *mask,
+    const ForegroundIndex *foreground = NULL, const std::vector< double > &percentiles = IntensityLandmarks::DefaultPercentiles())
+  {
+    double minimum, binWidth;
+    std::vector< double > histogram;
+    if (!ComputeHistogram(image, mask, foreground, minimum, binWidth, histogram))
+    {
+      IntensityLandmarks landmarks;
+      landmarks.percentiles = percentiles;
+      return landmarks;
+    }
+    return LandmarksOfHistogram(histogram, minimum, binWidth, percentiles);
+  }
+
+  void SetReference(const IntensityLandmarks &reference)
+  {
+    m_Reference = reference;
+  }
+
+  const IntensityLandmarks &GetReference() const
+  {
+    return m_Reference;
+  }
+
+  /**
+  \brief Match the intensities of 'image' to the reference, in place
+
+  \param image The image; all its voxels are mapped, so neighborhoods across the mask border stay consistent
+  \param mask The foreground the landmarks of 'image' are taken from
+  \param foreground Optional index of 'mask'; may be NULL
+
+  \return False if the image has no usable landmarks (empty or constant foreground); it is left unchanged
+  */
+  bool Normalize(TImageType *image, const TMaskImageType *mask, const ForegroundIndex *foreground = NULL) const
+  {
+    if (!m_Reference.IsValid())
+    {
+      itkGenericExceptionMacro(<< "No reference landmarks set");
+    }
+    double minimum, binWidth;
+    std::vector< double > histogram;
+    if (!ComputeHistogram(image, mask, foreground, minimum, binWidth, histogram))
+    {
+      return false;
+    }
+    const IntensityLandmarks landmarks = LandmarksOfHistogram(histogram, minimum, binWidth, m_Reference.percentiles);
+    const std::vector< double > &source = landmarks.values, &target = m_Reference.values;
+
+    // scale and offset of the segment which contains the center of every bin
+    std::vector< float > scales(NumberOfBins), offsets(NumberOfBins);
+    size_t segment = 0;
+    for (int b = 0; b < NumberOfBins; b++)
+    {
+      const double center = minimum + (b + 0.5) * binWidth;
+      while ((segment + 2 < source.size()) && (center >= source[segment + 1]))
+      {
+        segment++;
+      }
+      const double slope = (target[segment + 1] - target[segment]) / (source[segment + 1] - source[segment]);
+      scales[b] = static_cast< float >(slope);
+      offsets[b] = static_cast< float >(target[segment] - slope * source[segment]);
+    }
+
+    const size_t count = image->GetBufferedRegion().GetNumberOfPixels();
+    const int numberOfBlocks = static_cast< int >((count + BlockSize - 1) / BlockSize);
+    cv::parallel_for_(cv::Range(0, numberOfBlocks), LookupTableApplyBody< typename TImageType::PixelType >(image->GetBufferPointer(),
+      count, BlockSize, static_cast< float >(minimum), static_cast< float >(1.0 / binWidth), scales, offsets));
+    image->Modified();
+    return true;
+  }
+
+private:
+  static IntensityLandmarks LandmarksOfHistogram(const std::vector< double > &histogram, double minimum, double binWidth,
+    const std::vector< double > &percentiles)
+  {
+    IntensityLandmarks landmarks;
+    landmarks.percentiles = percentiles;
+    double total = 0;
+    for (size_t b = 0; b < histogram.size(); b++)
+    {
+      total += histogram[b];
+    }
+    // value at which the cumulative histogram reaches the percentile; voxels are spread evenly within a bin
+    double cumulative = 0;
+    size_t bin = 0;
+    for (size_t p = 0; p < percentiles.size(); p++)
+    {
+      const double rank = percentiles[p] / 100.0 * total;
+      while ((bin + 1 < histogram.size()) && (cumulative + histogram[bin] < rank))
+      {
+        cumulative += histogram[bin++];
+      }
+      const double fraction = (histogram[bin] > 0) ? std::min(std::max((rank - cumulative) / histogram[bin], 0.0), 1.0) : 0.0;
+      double value = minimum + (bin + fraction) * binWidth;
+      if (!landmarks.values.empty())
+      {
+        value = std::max(value, landmarks.values.back() + 1e-6 * binWidth); // the map needs increasing landmarks
+      }
+      landmarks.values.push_back(value);
+    }
+    return landmarks;
+  }
+
+  //! Histogram of the foreground between its minimum and maximum; false if it is empty or constant
+  static bool ComputeHistogram(const TImageType *image, const TMaskImageType *mask, const ForegroundIndex *foreground,
+    double &minimum, double &binWidth, std::vector< double > &histogram)
+  {
+    typedef IntensityHistogramBody< typename TImageType::PixelType, typename TMaskImageType::PixelType > BodyType;
+    if (image->GetBufferedRegion() != mask->GetBufferedRegion())
+    {
+      itkGenericExceptionMacro(<< "The image does not share the grid of the mask");
+    }
+    if (foreground && !foreground->SharesGrid(mask))
+    {
+      itkGenericExceptionMacro(<< "The foreground index does not share the grid of the mask");
+    }
+    const size_t count = image->GetBufferedRegion().GetNumberOfPixels();
+    if (count == 0)
+    {
+      return false;
+    }
+
+    // one slot per slab: the memory is threads x bins, independent of the size of the image
+    const size_t numberOfSlabs = std::min< size_t >(static_cast< size_t >(std::max(1, cv::getNumThreads())) * SlabsPerThread,
+      (count + BlockSize - 1) / BlockSize);
+    const size_t slabSize = (count + numberOfSlabs - 1) / numberOfSlabs;
+    std::vector< double > minima(numberOfSlabs), maxima(numberOfSlabs);
+    std::vector< std::vector< double > > histograms;
+
+    cv::parallel_for_(cv::Range(0, static_cast< int >(numberOfSlabs)), BodyType(BodyType::RANGE, image->GetBufferPointer(),
+      mask->GetBufferPointer(), foreground, count, slabSize, 0, 1, minima, maxima, histograms));
+    minimum = std::numeric_limits< double >::max();
+    double maximum = -std::numeric_limits< double >::max();
+    for (size_t slab = 0; slab < numberOfSlabs; slab++)
+    {
+      minimum = std::min(minimum, minima[slab]);
+      maximum = std::max(maximum, maxima[slab]);
+    }
+    if (!(maximum > minimum))
+    {
+      return false;
+    }
+
+    binWidth = (maximum - minimum) / NumberOfBins;
+    histograms.assign(numberOfSlabs, std::vector< double >(NumberOfBins, 0.0));
+    cv::parallel_for_(cv::Range(0, static_cast< int >(numberOfSlabs)), BodyType(BodyType::HISTOGRAM, image->GetBufferPointer(),
+      mask->GetBufferPointer(), foreground, count, slabSize, minimum, binWidth, minima, maxima, histograms));
+    histogram.assign(NumberOfBins, 0.0);
+    for (size_t slab = 0; slab < numberOfSlabs; slab++)
+    {
+      for (int b = 0; b < NumberOfBins; b++)
+      {
+        histogram[b] += histograms[slab][b];
+      }
+    }
+    return true;
+  }
+
+  IntensityLandmarks m_Reference;
+};
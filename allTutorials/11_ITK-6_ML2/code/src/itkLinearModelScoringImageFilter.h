@@ -0,0 +1,171 @@
+#pragma once
+
+#include "itkImageToImageFilter.h"
+#include "itkImageLinearConstIteratorWithIndex.h"
+#include "itkProgressReporter.h"
+
+#include "linearModel.h"
+
+#include <vector>
+#include <cmath>
+
+namespace itk
+{
+/**
+\brief Score every voxel of a set of co-registered feature images with a LinearModel
+
+Input i is the image of feature i of the model (for ML-2: T1, T2, PD, FL). Voxels where the optional mask is
+zero get the background value. The output is the label, the decision value w.x + b, or its logistic
+1 / (1 + exp(-(w.x + b))) as a lesion probability; the latter is monotone in the decision value but not
+calibrated.
+
+Each voxel only depends on the same voxel of the inputs, so the filter requests exactly its output region
+from every input. Together with a streaming writer (or itk::StreamingImageFilter) a volume is read, scored
+and written slab by slab, and memory stays bounded by the slab size whatever the size of the volume. Within a
+slab the usual ImageToImageFilter threads score scanlines directly on the input buffers.
+*/
+template < typename TInputImage, typename TMaskImage, typename TOutputImage = TInputImage >
+class LinearModelScoringImageFilter :
+  public ImageToImageFilter< TInputImage, TOutputImage >
+{
+public:
+  //! Standard class typedefs
+  typedef LinearModelScoringImageFilter Self;
+  typedef ImageToImageFilter< TInputImage, TOutputImage > Superclass;
+  typedef SmartPointer< Self > Pointer;
+  typedef SmartPointer< const Self > ConstPointer;
+
+  itkNewMacro(Self);
+  itkTypeMacro(LinearModelScoringImageFilter, ImageToImageFilter);
+
+  typedef TInputImage InputImageType;
+  typedef TMaskImage MaskImageType;
+  typedef TOutputImage OutputImageType;
+  typedef typename OutputImageType::RegionType OutputImageRegionType;
+  typedef typename OutputImageType::PixelType OutputPixelType;
+
+  enum OutputType
+  {
+    LABEL,
+    DECISION_VALUE,
+    PROBABILITY
+  };
+
+  //! The model; needs one weight per feature image
+  void SetModel(const LinearModel &model)
+  {
+    m_Model = model;
+    this->Modified();
+  }
+
+  const LinearModel &GetModel() const
+  {
+    return m_Model;
+  }
+
+  //! Image of feature 'index' of the model
+  void SetFeatureImage(unsigned int index, const InputImageType *image)
+  {
+    this->SetInput(index, image);
+  }
+
+  //! Optional; voxels where the mask is zero are not scored
+  itkSetInputMacro(MaskImage, MaskImageType);
+  itkGetInputMacro(MaskImage, MaskImageType);
+
+  itkSetMacro(OutputType, OutputType);
+  itkGetConstMacro(OutputType, OutputType);
+
+  //! Value of voxels outside the mask
+  itkSetMacro(BackgroundValue, OutputPixelType);
+  itkGetConstMacro(BackgroundValue, OutputPixelType);
+
+protected:
+  LinearModelScoringImageFilter() :
+    m_OutputType(LABEL), m_BackgroundValue(NumericTraits< OutputPixelType >::Zero)
+  {
+  }
+
+  virtual ~LinearModelScoringImageFilter()
+  {
+  }
+
+  void PrintSelf(std::ostream &os, Indent indent) const
+  {
+    Superclass::PrintSelf(os, indent);
+    os << indent << "Features: " << m_Model.weights.size() << std::endl;
+    os << indent << "OutputType: " << (m_OutputType == LABEL ? "label" : (m_OutputType == DECISION_VALUE ? "decision value" : "probability")) << std::endl;
+    os << indent << "BackgroundValue: " << static_cast< typename NumericTraits< OutputPixelType >::PrintType >(m_BackgroundValue) << std::endl;
+  }
+
+  void BeforeThreadedGenerateData()
+  {
+    if (this->GetNumberOfIndexedInputs() != m_Model.weights.size())
+    {
+      itkExceptionMacro(<< "The model has " << m_Model.weights.size() << " features but " << this->GetNumberOfIndexedInputs()
+        << " feature images are set");
+    }
+  }
+
+  void ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread, ThreadIdType threadId)
+  {
+    OutputImageType *output = this->GetOutput();
+    const MaskImageType *mask = this->GetMaskImage();
+    const size_t numberOfFeatures = m_Model.weights.size();
+    std::vector< const InputImageType * > inputs(numberOfFeatures);
+    for (size_t f = 0; f < numberOfFeatures; f++)
+    {
+      inputs[f] = this->GetInput(static_cast< unsigned int >(f));
+    }
+
+    const SizeValueType lineLength = outputRegionForThread.GetSize()[0];
+    std::vector< float > scores(lineLength);
+    std::vector< const typename InputImageType::PixelType * > lineValues(numberOfFeatures);
+    ProgressReporter progress(this, threadId, outputRegionForThread.GetNumberOfPixels() / std::max< SizeValueType >(lineLength, 1));
+    ImageLinearConstIteratorWithIndex< OutputImageType > it(output, outputRegionForThread);
+    it.SetDirection(0);
+    for (it.GoToBegin(); !it.IsAtEnd(); it.NextLine())
+    {
+      const typename OutputImageType::IndexType &lineStart = it.GetIndex();
+
+      // w.x + b of the whole scanline, one feature after the other over contiguous buffers; on this thread, which
+      // already is one of the filter's
+      for (size_t f = 0; f < numberOfFeatures; f++)
+      {
+        lineValues[f] = inputs[f]->GetBufferPointer() + inputs[f]->ComputeOffset(lineStart);
+      }
+      linearModelPredictPlanes(m_Model, lineValues, lineLength, &scores[0], true, false);
+
+      const typename MaskImageType::PixelType *maskLine = mask ? mask->GetBufferPointer() + mask->ComputeOffset(lineStart) : NULL;
+      OutputPixelType *line = output->GetBufferPointer() + output->ComputeOffset(lineStart);
+      for (SizeValueType i = 0; i < lineLength; i++)
+      {
+        line[i] = (maskLine && (maskLine[i] == 0)) ? m_BackgroundValue : this->ConvertScore(scores[i]);
+      }
+      progress.CompletedPixel(); // throws ProcessAborted once the filter is aborted
+    }
+  }
+
+private:
+  LinearModelScoringImageFilter(const Self &); // purposely not implemented
+  void operator=(const Self &); // purposely not implemented
+
+  inline OutputPixelType ConvertScore(float score) const
+  {
+    switch (m_OutputType)
+    {
+    case LABEL:
+      return static_cast< OutputPixelType >(m_Model.Label(score));
+    case DECISION_VALUE:
+      return static_cast< OutputPixelType >(score);
+    default:
+      return static_cast< OutputPixelType >(1.0 / (1.0 + std::exp(-static_cast< double >(score))));
+    }
+  }
+
+  LinearModel m_Model;
+  OutputType m_OutputType;
+  OutputPixelType m_BackgroundValue;
+};
+
+} // end namespace itk
@@ -0,0 +1,310 @@
+#pragma once
+
+#include "opencv2/core/core.hpp"
+
+#include "linearModel.h"
+
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+/**
+\brief Parameters of LinearSVMTrainer
+*/
+struct LinearSVMTrainerParameters
+{
+  LinearSVMTrainerParameters() :
+    C(1.0), positiveWeight(1.0), negativeWeight(1.0), maxEpochs(1000), tolerance(0.1), biasFeature(1.0), seed(0)
+  {
+  }
+
+  double C; //! penalty of a margin violation
+  double positiveWeight; //! C is multiplied with this for samples with the positive (larger) label
+  double negativeWeight; //! C is multiplied with this for samples with the negative (smaller) label
+  unsigned int maxEpochs; //! maximum number of passes over the samples
+  double tolerance; //! stop once the violation of the optimality conditions is below this (0.1 as in LIBLINEAR)
+  double biasFeature; //! constant feature which carries the bias; 0 trains without bias
+  unsigned int seed; //! seed of the order in which the samples are visited
+};
+
+/**
+\brief Two-class linear SVM (hinge loss, L2 regularization) trained by dual coordinate descent
+
+The solver of Hsieh et al., "A Dual Coordinate Descent Method for Large-scale Linear SVM" (ICML 2008), which
+is also the default of LIBLINEAR. Every step optimizes the dual variable of one sample in closed form and
+updates the weight vector in O(features), so an epoch is a single pass over the sample matrix and memory is
+one double per sample on top of the matrix, which is read in place. cv::SVM, in contrast, caches kernel rows
+and needs many passes, which does not scale to millions of voxels.
+
+Features are standardized on the fly (the statistics are computed in one pass) and the result is folded back,
+so the returned LinearModel works on the raw features, like one extracted from a CvSVM.
+*/
+class LinearSVMTrainer
+{
+public:
+  //! Result of Train()
+  struct Result
+  {
+    unsigned int epochs; //! passes over the samples
+    double violation; //! spread of the projected gradients in the last epoch; 0 at the optimum
+    bool converged; //! violation < tolerance, i.e., training stopped early
+  };
+
+  LinearSVMTrainer()
+  {
+  }
+
+  void SetParameters(const LinearSVMTrainerParameters &parameters)
+  {
+    m_Parameters = parameters;
+  }
+
+  const LinearSVMTrainerParameters &GetParameters() const
+  {
+    return m_Parameters;
+  }
+
+  //! Set positiveWeight and negativeWeight inversely proportional to the class sizes in 'labels'
+  void BalanceClassWeights(const cv::Mat &labels)
+  {
+    float positiveLabel, negativeLabel;
+    size_t positives = 0;
+    if (!GetLabels(labels, positiveLabel, negativeLabel))
+    {
+      return;
+    }
+    for (int i = 0; i < labels.rows; i++)
+    {
+      positives += (labels.at< float >(i) == positiveLabel) ? 1 : 0;
+    }
+    const size_t negatives = static_cast< size_t >(labels.rows) - positives;
+    m_Parameters.positiveWeight = (positives > 0) ? labels.rows / (2.0 * positives) : 1.0;
+    m_Parameters.negativeWeight = (negatives > 0) ? labels.rows / (2.0 * negatives) : 1.0;
+  }
+
+  /**
+  \brief Train on a sample matrix
+
+  \param samples One sample per row, [n x features] CV_32F; not copied
+  \param labels [n x 1] CV_32F with exactly two distinct values; the larger one is the positive label
+  \param model Overwritten with the trained model
+  \param warmStart Start from the dual variables of the previous call instead of 0. Only valid if 'samples'
+  and 'labels' are the same as in that call, e.g., when C or the class weights are tuned; variables
+  outside the new bounds are clipped
+
+  \return Epochs and convergence
+  */
+  Result Train(const cv::Mat &samples, const cv::Mat &labels, LinearModel &model, bool warmStart = false)
+  {
+    CV_Assert((samples.type() == CV_32FC1) && (labels.type() == CV_32FC1) && (labels.rows == samples.rows));
+    float positiveLabel, negativeLabel;
+    if (!GetLabels(labels, positiveLabel, negativeLabel))
+    {
+      CV_Error(CV_StsBadArg, "Training a two-class SVM needs samples of exactly two labels");
+    }
+    const int numberOfSamples = samples.rows, numberOfFeatures = samples.cols;
+    const double bias = m_Parameters.biasFeature;
+
+    this->ComputeStandardization(samples);
+
+    // diagonal of the dual Hessian, Q_ii = |x_i|^2
+    std::vector< double > diagonal(numberOfSamples);
+    std::vector< double > x(numberOfFeatures);
+    for (int i = 0; i < numberOfSamples; i++)
+    {
+      this->StandardizedSample(samples.ptr< float >(i), x);
+      double squaredNorm = bias * bias;
+      for (int f = 0; f < numberOfFeatures; f++)
+      {
+        squaredNorm += x[f] * x[f];
+      }
+      diagonal[i] = squaredNorm;
+    }
+
+    if (!warmStart || (m_Alpha.size() != static_cast< size_t >(numberOfSamples)))
+    {
+      m_Alpha.assign(numberOfSamples, 0.0);
+    }
+    const double upperBound[2] = { m_Parameters.C * m_Parameters.negativeWeight, m_Parameters.C * m_Parameters.positiveWeight };
+
+    // w = sum_i y_i alpha_i x_i; the last element belongs to the bias feature
+    std::vector< double > w(numberOfFeatures + 1, 0.0);
+    for (int i = 0; i < numberOfSamples; i++)
+    {
+      const int positive = (labels.at< float >(i) == positiveLabel) ? 1 : 0;
+      m_Alpha[i] = std::min(m_Alpha[i], upperBound[positive]);
+      if (m_Alpha[i] > 0)
+      {
+        this->StandardizedSample(samples.ptr< float >(i), x);
+        const double step = (positive ? 1.0 : -1.0) * m_Alpha[i];
+        for (int f = 0; f < numberOfFeatures; f++)
+        {
+          w[f] += step * x[f];
+        }
+        w[numberOfFeatures] += step * bias;
+      }
+    }
+
+    // samples whose dual variable sits at a bound and is likely to stay there are shrunk, i.e., moved behind
+    // activeSize and skipped until the active ones have converged
+    std::vector< int > order(numberOfSamples);
+    for (int i = 0; i < numberOfSamples; i++)
+    {
+      order[i] = i;
+    }
+    int activeSize = numberOfSamples;
+    double previousMax = std::numeric_limits< double >::max(), previousMin = -std::numeric_limits< double >::max();
+    std::mt19937 generator(m_Parameters.seed);
+
+    Result result;
+    result.epochs = 0;
+    result.violation = std::numeric_limits< double >::max();
+    result.converged = false;
+    while (result.epochs < m_Parameters.maxEpochs)
+    {
+      std::shuffle(order.begin(), order.begin() + activeSize, generator);
+      double maxProjectedGradient = -std::numeric_limits< double >::max(), minProjectedGradient = std::numeric_limits< double >::max();
+      for (int k = 0; k < activeSize; k++)
+      {
+        const int i = order[k];
+        const int positive = (labels.at< float >(i) == positiveLabel) ? 1 : 0;
+        const double y = positive ? 1.0 : -1.0, U = upperBound[positive];
+        this->StandardizedSample(samples.ptr< float >(i), x);
+
+        double decision = w[numberOfFeatures] * bias;
+        for (int f = 0; f < numberOfFeatures; f++)
+        {
+          decision += w[f] * x[f];
+        }
+        const double gradient = y * decision - 1.0;
+        double projectedGradient = gradient;
+        if (m_Alpha[i] <= 0)
+        {
+          if (gradient > previousMax)
+          {
+            std::swap(order[k--], order[--activeSize]);
+            continue;
+          }
+          projectedGradient = std::min(gradient, 0.0);
+        }
+        else if (m_Alpha[i] >= U)
+        {
+          if (gradient < previousMin)
+          {
+            std::swap(order[k--], order[--activeSize]);
+            continue;
+          }
+          projectedGradient = std::max(gradient, 0.0);
+        }
+        maxProjectedGradient = std::max(maxProjectedGradient, projectedGradient);
+        minProjectedGradient = std::min(minProjectedGradient, projectedGradient);
+
+        if ((projectedGradient != 0) && (diagonal[i] > 0))
+        {
+          const double previous = m_Alpha[i];
+          m_Alpha[i] = std::min(std::max(previous - gradient / diagonal[i], 0.0), U);
+          const double step = (m_Alpha[i] - previous) * y;
+          for (int f = 0; f < numberOfFeatures; f++)
+          {
+            w[f] += step * x[f];
+          }
+          w[numberOfFeatures] += step * bias;
+        }
+      }
+      result.epochs++;
+      result.violation = (activeSize > 0) ? maxProjectedGradient - minProjectedGradient : 0;
+      if (result.violation < m_Parameters.tolerance)
+      {
+        if (activeSize == numberOfSamples)
+        {
+          result.converged = true;
+          break;
+        }
+        // the active samples have converged; check all of them once more without shrinking
+        activeSize = numberOfSamples;
+        previousMax = std::numeric_limits< double >::max();
+        previousMin = -std::numeric_limits< double >::max();
+        continue;
+      }
+      previousMax = (maxProjectedGradient > 0) ? maxProjectedGradient : std::numeric_limits< double >::max();
+      previousMin = (minProjectedGradient < 0) ? minProjectedGradient : -std::numeric_limits< double >::max();
+    }
+
+    // fold the standardization back: w.((x - mean) / scale) + b = (w / scale).x + b - sum(w * mean / scale)
+    model.weights.resize(numberOfFeatures);
+    double modelBias = w[numberOfFeatures] * bias;
+    for (int f = 0; f < numberOfFeatures; f++)
+    {
+      const double weight = w[f] / m_Scale[f];
+      model.weights[f] = static_cast< float >(weight);
+      modelBias -= weight * m_Mean[f];
+    }
+    model.bias = static_cast< float >(modelBias);
+    model.positiveLabel = positiveLabel;
+    model.negativeLabel = negativeLabel;
+    return result;
+  }
+
+private:
+  //! The two labels; false unless 'labels' holds exactly two distinct values
+  static bool GetLabels(const cv::Mat &labels, float &positiveLabel, float &negativeLabel)
+  {
+    if (labels.rows == 0)
+    {
+      return false;
+    }
+    negativeLabel = positiveLabel = labels.at< float >(0);
+    for (int i = 1; i < labels.rows; i++)
+    {
+      const float label = labels.at< float >(i);
+      if ((label != negativeLabel) && (label != positiveLabel))
+      {
+        if (negativeLabel != positiveLabel)
+        {
+          return false;
+        }
+        negativeLabel = std::min(label, positiveLabel);
+        positiveLabel = std::max(label, positiveLabel);
+      }
+    }
+    return negativeLabel != positiveLabel;
+  }
+
+  //! Mean and standard deviation of every feature; constant features get a scale of 1
+  void ComputeStandardization(const cv::Mat &samples)
+  {
+    const int numberOfFeatures = samples.cols;
+    std::vector< double > sum(numberOfFeatures, 0.0), squaredSum(numberOfFeatures, 0.0);
+    for (int i = 0; i < samples.rows; i++)
+    {
+      const float *sample = samples.ptr< float >(i);
+      for (int f = 0; f < numberOfFeatures; f++)
+      {
+        sum[f] += sample[f];
+        squaredSum[f] += static_cast< double >(sample[f]) * sample[f];
+      }
+    }
+    m_Mean.assign(numberOfFeatures, 0.0);
+    m_Scale.assign(numberOfFeatures, 1.0);
+    for (int f = 0; (f < numberOfFeatures) && (samples.rows > 0); f++)
+    {
+      m_Mean[f] = sum[f] / samples.rows;
+      const double variance = squaredSum[f] / samples.rows - m_Mean[f] * m_Mean[f];
+      m_Scale[f] = (variance > 1e-12) ? std::sqrt(variance) : 1.0;
+    }
+  }
+
+  void StandardizedSample(const float *sample, std::vector< double > &x) const
+  {
+    for (size_t f = 0; f < x.size(); f++)
+    {
+      x[f] = (sample[f] - m_Mean[f]) / m_Scale[f];
+    }
+  }
+
+  LinearSVMTrainerParameters m_Parameters;
+  std::vector< double > m_Alpha; //! dual variables of the last Train(), one per sample
+  std::vector< double > m_Mean, m_Scale; //! standardization of the features
+};
@@ -5,6 +5,13 @@
 #include <string>
 #include <algorithm>
 #include <tuple>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <map>
+#include <cmath>
+#include <climits>
 
 //! ITK headers
 #include "itkImage.h"
@@ -27,6 +34,16 @@
 #include "opencv2/highgui/highgui.hpp"
 
 #include "cbicaUtilities.h"
+#include "subjectManifest.h"
+#include "maskedFeatureExtractor.h"
+#include "classBalancedSampler.h"
+#include "linearSVMTrainer.h"
+#include "featureCache.h"
+#include "neighborhoodFeatures.h"
+#include "intensityNormalization.h"
+#include "crossValidation.h"
+#include "imageComponentType.h"
+#include "randomFourierFeatures.h"
 
 #define ROWS 4
 #define COLS 2
@@ -144,263 +161,927 @@ std::string replaceString( const std::string &entireString,
 }  
 
 /**
-\brief Extract all file names in supplied directory
+\brief Read a list of subject IDs, one per line (quotes are removed)
 
-\return Vector of file names
+\param fileName CSV file with the subject IDs
+\param subjectIDs Overwritten with the IDs
+
+\return False if the file is a saved SubjectManifest (or cannot be read) instead of a list of IDs
 */
-std::vector< std::string > filesInDirectory( const std::string &dirName )  
-{  
-  std::vector< std::string > allFiles;  
-  std::string dirName_wrap = dirName;  
-  if (dirName_wrap[dirName_wrap.length()-1] != '/')  
-  {  
-    dirName_wrap.append("/");  
-  }  
-  #if defined(_WIN32)  
-  {  
-    dirName_wrap.append("*.*");  
-    char* search_path = cbica::constCharToChar(dirName_wrap.c_str());  
-    WIN32_FIND_DATA fd;   
-    HANDLE hFind = ::FindFirstFile(search_path, &fd);   
-    if(hFind != INVALID_HANDLE_VALUE)   
-    {   
-      do   
-      {   
-        if(! (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) )  
-        {  
-          allFiles.push_back(fd.cFileName);  
-        }  
-      } while(::FindNextFile(hFind, &fd));   
-      ::FindClose(hFind);   
-    }   
-    return allFiles;  
+bool readSubjectList(const std::string &fileName, std::vector< std::string > &subjectIDs)
+{
+  std::ifstream infile(fileName.c_str());
+  subjectIDs.clear();
+  for (std::string line; std::getline(infile, line, '\n');)
+  {
+    line.erase(std::remove(line.begin(), line.end(), '"'), line.end());
+    line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
+    if (subjectIDs.empty() && (line.compare(0, 3, "id,") == 0))
+    {
+      return false;
+    }
+    if (!line.empty())
+    {
+      subjectIDs.push_back(line);
+    }
+  }
+  return !subjectIDs.empty();
+}
 
-  }  
-  #else  
-  {  
-    DIR *dp;  
-    struct dirent *dirp;  
-    if((dp  = opendir(dirName.c_str())) == NULL)   
-    {  
-      std::cerr << "Error(" << errno << ") occurred while opening directory '" <<   
-        dirName << "'\n";  
-    }  
-      
-    while ((dirp = readdir(dp)) != NULL)   
-    {  
-      allFiles.push_back(std::string(dirp->d_name));  
-    }  
-    closedir(dp);  
-    return allFiles;  
-  }  
-  #endif  
-}  
+typedef float PixelType; // pre-define expected pixel type
+typedef itk::Image< PixelType, 3 > FloatImageType;
+typedef itk::Image< unsigned char, 3 > MaskImageType; // foreground masks are binary
 
-// main entry of program
-int main(int argc, char *argv[])
+/**
+\brief Options which control how the training set is built
+*/
+struct TrainingSetOptions
 {
-  try // to catch exceptions
+  TrainingSetOptions() :
+    numberOfWorkers(1), maxSubjectsInFlight(2), samplesPerClass(50000), keepAllRows(false), balanceClasses(true), seed(0)
   {
-    std::string dirName = argv[1], subIDFile;
-    dirName = replaceString(dirName, "\\", "/") + "/";
-    std::vector< std::string > allFileNames = filesInDirectory(dirName), subjectIDs;    
+  }
+
+  unsigned int numberOfWorkers; //! subjects extracted concurrently
+  unsigned int maxSubjectsInFlight; //! subjects which are being read or wait to be merged
+  size_t samplesPerClass; //! uniform random sample of at most this many voxels per label; 0 keeps all voxels
+  bool keepAllRows; //! with samplesPerClass > 0, still extract every voxel with its key and sample when merging, e.g., to test on whole subjects
+  bool balanceClasses; //! reduce every class to the size of the smallest one (see data/README.txt)
+  unsigned int seed; //! seed of the sampling; the same seed gives the same training set
+  NeighborhoodFeatureSettings neighborhood; //! local statistics added to the intensities of every modality
+  std::vector< IntensityLandmarks > referenceLandmarks; //! T1, T2, PD and FL of the reference; empty keeps the intensities as read
+
+  //! Intensities of T1, T2, PD and FL followed by their neighborhood features
+  int GetNumberOfFeatures() const
+  {
+    return static_cast< int >(4 * (1 + neighborhood.GetNumberOfFeaturesPerImage()));
+  }
+};
+
+/**
+\brief Landmarks of the foreground histograms of T1, T2, PD and FL of the subject all others are matched to
+
+\param subject The reference subject
+\param landmarks Overwritten with the landmarks of T1, T2, PD and FL
+*/
+void computeReferenceLandmarks(const SubjectFiles &subject, std::vector< IntensityLandmarks > &landmarks)
+{
+  const SubjectFiles::FileType modalities[] = { SubjectFiles::T1, SubjectFiles::T2, SubjectFiles::PD, SubjectFiles::FL };
+  MaskImageType::Pointer maskImage = MaskImageType::New();
+  SafeReadImage<MaskImageType>(maskImage, subject.files[SubjectFiles::Foreground]);
+  ForegroundIndex foreground;
+  foreground.Load(maskImage.GetPointer(), subject.files[SubjectFiles::Foreground]);
+  landmarks.clear();
+  for (unsigned int m = 0; m < 4; m++)
+  {
+    FloatImageType::Pointer image = FloatImageType::New();
+    SafeReadImage<FloatImageType>(image, subject.files[modalities[m]]);
+    landmarks.push_back(HistogramLandmarkNormalizer< FloatImageType, MaskImageType >::ComputeLandmarks(image, maskImage, &foreground));
+    if (!landmarks.back().IsValid())
+    {
+      itkGenericExceptionMacro(<< "The foreground of '" << subject.files[modalities[m]] << "' has no intensity range to normalize to");
+    }
+  }
+}
+
+/**
+\brief Read the images of a subject and extract the intensities of its foreground voxels
+
+With options.samplesPerClass > 0, only the mask and the labels are streamed first: every foreground voxel gets
+a random key and only the voxels with the samplesPerClass smallest keys of each label are kept, so the rows of
+the other voxels are never materialized. The keys are returned so that the subjects can be merged into one
+uniform sample (see ClassBalancedReservoirSampler). With options.keepAllRows every voxel is extracted and gets
+the key it would have been drawn with, so merging the full blocks gives the same sample.
+
+\param subject The subject
+\param subjectIndex Position of the subject; seeds the keys together with options.seed
+\param options Sampling options
+\param samples Overwritten with an [n x options.GetNumberOfFeatures()] matrix: T1, T2, PD and FL intensities,
+then the neighborhood features of T1, T2, PD and FL; all computed after matching the intensities to
+options.referenceLandmarks, if set
+\param labels Overwritten with the [n x 1] lesion labels
+\param keys Overwritten with the random key of every row; empty if all voxels are kept
+
+The images are read with pixel type TImageType and the mask as MaskImageType, so no conversion pass is made
+when TImageType is the storage type of the files; values are only widened to float in the sample rows.
+*/
+template < typename TImageType >
+void extractSubjectFeaturesAs(const SubjectFiles &subject, size_t subjectIndex, const TrainingSetOptions &options,
+  cv::Mat &samples, cv::Mat &labels, std::vector< double > &keys)
+{
+  typename TImageType::Pointer
+    t1image = TImageType::New(), t2image = TImageType::New(), FLimage = TImageType::New(),
+    PDimage = TImageType::New(), lesionImage = TImageType::New();
+  MaskImageType::Pointer maskImage = MaskImageType::New();
+
+  SafeReadImage<TImageType>(t1image, subject.files[SubjectFiles::T1]);
+  SafeReadImage<TImageType>(t2image, subject.files[SubjectFiles::T2]);
+  SafeReadImage<TImageType>(FLimage, subject.files[SubjectFiles::FL]);
+  SafeReadImage<TImageType>(PDimage, subject.files[SubjectFiles::PD]);
+  SafeReadImage<MaskImageType>(maskImage, subject.files[SubjectFiles::Foreground]);
+  SafeReadImage<TImageType>(lesionImage, subject.files[SubjectFiles::Lesion]);
+
+  // the runs of the mask are built once (or read from next to it) and used by every stage below, so none of them
+  // sweeps the background
+  ForegroundIndex foreground;
+  foreground.Load(maskImage.GetPointer(), subject.files[SubjectFiles::Foreground]);
+
+  // histogram matching in place, so every feature below sees the normalized intensities
+  if (!options.referenceLandmarks.empty())
+  {
+    TImageType *modalities[] = { t1image, t2image, PDimage, FLimage };
+    for (unsigned int m = 0; m < 4; m++)
+    {
+      HistogramLandmarkNormalizer< TImageType, MaskImageType > normalizer;
+      normalizer.SetReference(options.referenceLandmarks[m]);
+      normalizer.Normalize(modalities[m], maskImage, &foreground);
+    }
+  }
 
-    std::vector< std::tuple< std::string, std::string, std::string, std::string, std::string, std::string > > sortedFileNames;
-    sortedFileNames.clear();
+  // walk all images in lockstep and write the foreground voxels straight into the first 4 columns
+  MaskedFeatureExtractor< TImageType, MaskImageType > extractor;
+  extractor.AddImage(t1image);
+  extractor.AddImage(t2image);
+  extractor.AddImage(PDimage);
+  extractor.AddImage(FLimage);
+  extractor.SetMask(maskImage);
+  extractor.SetForegroundIndex(&foreground);
+  extractor.SetLabelImage(lesionImage); // keeping lesions at the end because they denote labels
 
-    bool multipleSubjects = false;
+  // the neighborhood features fill the remaining columns of the same rows
+  NeighborhoodFeatureGenerator< TImageType, MaskImageType > neighborhood;
+  neighborhood.SetSettings(options.neighborhood);
+  neighborhood.AddImage(t1image);
+  neighborhood.AddImage(t2image);
+  neighborhood.AddImage(PDimage);
+  neighborhood.AddImage(FLimage);
+  neighborhood.SetMask(maskImage);
+  neighborhood.SetForegroundIndex(&foreground);
+  const int numberOfFeatures = options.GetNumberOfFeatures();
 
-    // file name parsing
-    for (size_t i = 0; i < allFileNames.size(); i++)
+  keys.clear();
+  if ((options.samplesPerClass == 0) || options.keepAllRows)
+  {
+    const int count = static_cast< int >(extractor.CountSamples());
+    samples.create(count, numberOfFeatures, CV_32FC1);
+    labels.create(count, 1, CV_32FC1);
+    if (count > 0)
+    {
+      extractor.Extract(samples.ptr< float >(0), samples.step1(), labels.ptr< float >(0));
+      neighborhood.Extract(samples.ptr< float >(0) + extractor.GetNumberOfFeatures(), samples.step1());
+    }
+    if (options.samplesPerClass > 0)
+    {
+      // the keys are drawn in the visiting order of the reservoirs below, which is also the row order
+      SubjectKeyGenerator randomKey(options.seed, subjectIndex);
+      keys.resize(count);
+      size_t row = 0;
+      auto draw = [&](size_t, float) { keys[row++] = randomKey(); };
+      extractor.VisitForeground(draw);
+    }
+  }
+  else
+  {
+    // per-label reservoirs of voxel offsets; the merged sample only needs samplesPerClass of them per label
+    std::map< float, BottomKReservoir< size_t > > reservoirs;
+    SubjectKeyGenerator randomKey(options.seed, subjectIndex);
+    auto offer = [&](size_t offset, float label)
     {
-      std::string temp_1, temp_2, ext;
-      splitFileName(dirName+allFileNames[i], temp_1, temp_2, ext);
-      if (ext == ".csv") // if a csv file is detected, obtain all subject IDs from it
+      std::map< float, BottomKReservoir< size_t > >::iterator it = reservoirs.find(label);
+      if (it == reservoirs.end())
       {
-        subjectIDs.clear();
-        multipleSubjects = true;
-        temp_1 = dirName + "/" + allFileNames[i];
-        std::ifstream infile(temp_1);
-        for (std::string line; std::getline(infile, line, '\n');)
-        {
-          line.erase(std::remove(line.begin(), line.end(), '"'), line.end());
-          subjectIDs.push_back(std::move(line)); // subject IDs are pushed onto this
-        }
-        goto continuation;
-      }      
+        it = reservoirs.insert(std::make_pair(label, BottomKReservoir< size_t >(options.samplesPerClass))).first;
+      }
+      it->second.Offer(randomKey(), offset);
+    };
+    extractor.VisitForeground(offer);
+
+    // gather the kept voxels in buffer order
+    std::vector< BottomKReservoir< size_t >::ItemType > kept;
+    for (std::map< float, BottomKReservoir< size_t > >::const_iterator it = reservoirs.begin(); it != reservoirs.end(); ++it)
+    {
+      kept.insert(kept.end(), it->second.GetItems().begin(), it->second.GetItems().end());
     }
+    std::sort(kept.begin(), kept.end(),
+      [](const BottomKReservoir< size_t >::ItemType &a, const BottomKReservoir< size_t >::ItemType &b) { return a.second < b.second; });
+    std::vector< size_t > offsets(kept.size());
+    keys.resize(kept.size());
+    for (size_t i = 0; i < kept.size(); i++)
+    {
+      keys[i] = kept[i].first;
+      offsets[i] = kept[i].second;
+    }
+    samples.create(static_cast< int >(offsets.size()), numberOfFeatures, CV_32FC1);
+    labels.create(static_cast< int >(offsets.size()), 1, CV_32FC1);
+    if (!offsets.empty())
+    {
+      extractor.ExtractAt(offsets, samples.ptr< float >(0), samples.step1(), labels.ptr< float >(0));
+      neighborhood.ExtractAt(offsets, samples.ptr< float >(0) + extractor.GetNumberOfFeatures(), samples.step1());
+    }
+  }
+  if (samples.rows == 0)
+  {
+    std::cerr << "Subject '" << subject.id << "' has an empty foreground mask.\n";
+    samples = cv::Mat(0, numberOfFeatures, CV_32FC1);
+    labels = cv::Mat(0, 1, CV_32FC1);
+  }
+}
+
+/**
+\brief Read the images of a subject with their storage type and extract its samples, see extractSubjectFeaturesAs()
 
-    continuation:
-    if (multipleSubjects)
+Byte and 16 bit modalities are kept as they are stored, which divides the memory and bandwidth of every read
+by 2 to 4 compared to float. Normalized intensities are new real values and are always held as float, as are
+subjects whose modalities differ in type or have another type.
+*/
+void extractSubjectFeatures(const SubjectFiles &subject, size_t subjectIndex, const TrainingSetOptions &options,
+  cv::Mat &samples, cv::Mat &labels, std::vector< double > &keys)
+{
+  std::vector< std::string > modalities;
+  modalities.push_back(subject.files[SubjectFiles::T1]);
+  modalities.push_back(subject.files[SubjectFiles::T2]);
+  modalities.push_back(subject.files[SubjectFiles::PD]);
+  modalities.push_back(subject.files[SubjectFiles::FL]);
+  switch (options.referenceLandmarks.empty() ? commonComponentType(modalities) : itk::ImageIOBase::FLOAT)
+  {
+  case itk::ImageIOBase::UCHAR:
+    extractSubjectFeaturesAs< itk::Image< unsigned char, 3 > >(subject, subjectIndex, options, samples, labels, keys);
+    break;
+  case itk::ImageIOBase::USHORT:
+    extractSubjectFeaturesAs< itk::Image< unsigned short, 3 > >(subject, subjectIndex, options, samples, labels, keys);
+    break;
+  case itk::ImageIOBase::SHORT:
+    extractSubjectFeaturesAs< itk::Image< short, 3 > >(subject, subjectIndex, options, samples, labels, keys);
+    break;
+  default:
+    extractSubjectFeaturesAs< FloatImageType >(subject, subjectIndex, options, samples, labels, keys);
+    break;
+  }
+}
+
+/**
+\brief Number of foreground voxels of a subject, i.e., the rows extractSubjectFeatures() gives without sampling
+
+The runs written next to the mask are read if they are current, so the mask itself is usually not read; if it
+is, its runs are written for the extraction which follows.
+*/
+size_t countSubjectSamples(const SubjectFiles &subject)
+{
+  const std::string &maskFileName = subject.files[SubjectFiles::Foreground];
+  ForegroundIndex foreground;
+  if (!foreground.Read(ForegroundIndex::FileNameOf(maskFileName), maskFileName))
+  {
+    MaskImageType::Pointer maskImage = MaskImageType::New();
+    SafeReadImage<MaskImageType>(maskImage, maskFileName);
+    foreground.Load(maskImage.GetPointer(), maskFileName);
+  }
+  return foreground.GetNumberOfVoxels();
+}
+
+/**
+\brief Extract the training data of all subjects with a pool of workers
+
+Every worker extracts whole subjects into a local block (see extractSubjectFeatures()). The calling thread
+merges the blocks strictly in subject order, so the result does not depend on the number of workers or on
+timing. A worker only starts subject i once subject i - maxSubjectsInFlight has been merged, which bounds the
+number of subjects held in memory.
+
+With options.samplesPerClass > 0 the blocks are merged into per-label reservoirs and the result is a uniform
+random sample of at most samplesPerClass voxels per label, in random order. Otherwise, or if all rows are kept
+in the blocks (options.keepAllRows), the rows of every subject are counted from its foreground first (see
+countSubjectSamples()), the result is allocated once and every worker extracts its subject straight into its
+row range; the blocks are headers on these rows.
+
+\param subjects The subjects
+\param options Workers and sampling
+\param samples Overwritten with the samples
+\param labels Overwritten with the labels of the samples
+\param cacheWriter If not NULL, every subject block is added to this cache when it is merged
+\param subjectBlocks If not NULL, every subject block is also kept here, e.g., for cross-validation
+
+\return Number of subjects which could not be extracted; they contribute no samples
+*/
+size_t extractTrainingData(const std::vector< SubjectFiles > &subjects, const TrainingSetOptions &options,
+  cv::Mat &samples, cv::Mat &labels, FeatureCacheWriter *cacheWriter = NULL, std::vector< SubjectSamples > *subjectBlocks = NULL)
+{
+  struct SubjectBlock
+  {
+    SubjectBlock() :
+      done(false), failed(false)
+    {
+    }
+
+    cv::Mat samples, labels;
+    std::vector< double > keys;
+    bool done, failed;
+  };
+
+  std::vector< SubjectBlock > blocks(subjects.size());
+  std::atomic< size_t > nextSubject(0);
+  size_t merged = 0; // guarded by 'mutex'
+  std::mutex mutex;
+  std::condition_variable blockDone, blockMerged;
+  const unsigned int maxSubjectsInFlight = std::max(1u, options.maxSubjectsInFlight);
+  const unsigned int numberOfWorkers = std::max(1u, options.numberOfWorkers);
+  ClassBalancedReservoirSampler sampler(options.samplesPerClass, options.GetNumberOfFeatures());
+
+  // when all rows are extracted the size of the result is known from the foregrounds, so it is allocated once
+  const bool preallocated = (options.samplesPerClass == 0) || options.keepAllRows;
+  std::vector< size_t > firstRows(subjects.size() + 1, 0);
+  std::vector< char > countFailed(subjects.size(), 0); // written by the counters, so not a vector< bool >
+  samples.release();
+  labels.release();
+  if (preallocated)
+  {
+    std::vector< size_t > rows(subjects.size(), 0);
+    std::atomic< size_t > nextCount(0);
+    std::mutex outputMutex;
+    auto counter = [&]()
     {
-      for (size_t i = 0; i < subjectIDs.size(); i++)
+      for (size_t i = nextCount++; i < subjects.size(); i = nextCount++)
       {
-        std::string t1 = "", t2 = "", fl = "", pd = "", le = "", fg = "";
-        for (size_t j = 0; j < allFileNames.size(); j++)
+        try
         {
-          while ((allFileNames[j].find(subjectIDs[i]) != std::string::npos) && ((t1 == "") || (t2 == "") || (fl == "") || (pd == "") || (le == "") || (fg == "")))
-          {
-            if (allFileNames[j].find(subjectIDs[i]+".T1") != std::string::npos)
-            {
-              t1 = dirName + allFileNames[j];
-            }
-            else if (allFileNames[j].find(subjectIDs[i]+".T2") != std::string::npos)
-            {
-              t2 = dirName + allFileNames[j];
-            }
-            else if (allFileNames[j].find(subjectIDs[i]+".PD") != std::string::npos)
-            {
-              pd = dirName + allFileNames[j];
-            }
-            else if (allFileNames[j].find(subjectIDs[i]+".FL") != std::string::npos)
-            {
-              fl = dirName + allFileNames[j];
-            }
-            else if (allFileNames[j].find(subjectIDs[i]+".manual") != std::string::npos)
-            {
-              le = dirName + allFileNames[j];
-            }
-            else if (allFileNames[j].find(subjectIDs[i]+".foreground") != std::string::npos)
-            {
-              fg = dirName + allFileNames[j];
-            }
-            else
-            {
-              std::cerr << "Unsupported file name type(s).\n";
-              exit(EXIT_FAILURE);
-            }
-            j++;
-          }
-
-          if (!((t1 == "") || (t2 == "") || (fl == "") || (pd == "") || (le == "") || (fg == "")))
-          {
-            sortedFileNames.push_back(std::make_tuple(t1, t2, fl, pd, fg, le)); // keeping lesions at the end because they denote labels
-          }
-          t1 = "", t2 = "", fl = "", pd = "", le = "", fg = "";
+          rows[i] = countSubjectSamples(subjects[i]);
+        }
+        catch (std::exception &e) // itk::ExceptionObject, std::bad_alloc, ...; the subject fails, not the run
+        {
+          countFailed[i] = 1;
+          std::lock_guard< std::mutex > lock(outputMutex);
+          std::cerr << "Subject '" << subjects[i].id << "' failed: " << e.what() << "\n";
         }
       }
+    };
+    std::vector< std::thread > counters;
+    for (unsigned int w = 0; w < numberOfWorkers; w++)
+    {
+      counters.push_back(std::thread(counter));
+    }
+    for (size_t w = 0; w < counters.size(); w++)
+    {
+      counters[w].join();
+    }
+    for (size_t i = 0; i < subjects.size(); i++)
+    {
+      firstRows[i + 1] = firstRows[i] + rows[i];
     }
-    else // give use case where only a single subject ID is presented
+    if (firstRows.back() > static_cast< size_t >(INT_MAX))
+    {
+      itkGenericExceptionMacro(<< "The " << firstRows.back() << " foreground voxels of all subjects exceed the rows of a cv::Mat; " <<
+        "use sampling");
+    }
+    samples.create(static_cast< int >(firstRows.back()), options.GetNumberOfFeatures(), CV_32FC1);
+    labels.create(static_cast< int >(firstRows.back()), 1, CV_32FC1);
+  }
+
+  auto worker = [&]()
+  {
+    for (size_t i = nextSubject++; i < subjects.size(); i = nextSubject++)
     {
-      std::string t1 = "", t2 = "", fl = "", pd = "", le = "", fg = "";
-      for (size_t j = 0; j < allFileNames.size(); j++)
       {
-        while ((t1 == "") || (t2 == "") || (fl == "") || (pd == "") || (le == "") || (fg == ""))
+        std::unique_lock< std::mutex > lock(mutex);
+        blockMerged.wait(lock, [&]() { return i < merged + maxSubjectsInFlight; });
+      }
+
+      // cv::Mat::create() keeps a header of the right size, so a preallocated subject is extracted in place
+      cv::Mat subjectSamples, subjectLabels;
+      const int firstRow = static_cast< int >(firstRows[i]), endRow = static_cast< int >(firstRows[i + 1]);
+      if (preallocated)
+      {
+        subjectSamples = samples.rowRange(firstRow, endRow);
+        subjectLabels = labels.rowRange(firstRow, endRow);
+      }
+      std::vector< double > subjectKeys;
+      bool failed = (countFailed[i] != 0); // already reported
+      try
+      {
+        if (!failed)
         {
-          if (allFileNames[j].find("T1") != std::string::npos)
-          {
-            t1 = dirName + allFileNames[j];
-          }
-          else if (allFileNames[j].find("T2") != std::string::npos)
-          {
-            t2 = dirName + allFileNames[j];
-          }
-          else if (allFileNames[j].find("PD") != std::string::npos)
-          {
-            pd = dirName + allFileNames[j];
-          }
-          else if (allFileNames[j].find("FL") != std::string::npos)
-          {
-            fl = dirName + allFileNames[j];
-          }
-          else if (allFileNames[j].find("manual") != std::string::npos)
-          {
-            le = dirName + allFileNames[j];
-          }
-          else if (allFileNames[j].find("foreground") != std::string::npos)
+          extractSubjectFeatures(subjects[i], i, options, subjectSamples, subjectLabels, subjectKeys);
+          if (preallocated && (subjectSamples.rows != endRow - firstRow))
           {
-            fg = dirName + allFileNames[j];
+            itkGenericExceptionMacro(<< "The foreground changed after its voxels were counted");
           }
-          else
-          {
-            std::cerr << "Unsupported file name type(s).\n";
-          }
-          j++;
-        }
-
-        if (!((t1 == "") || (t2 == "") || (fl == "") || (pd == "") || (le == "") || (fg == "")))
-        {
-          sortedFileNames.push_back(std::make_tuple(t1, t2, fl, pd, fg, le)); // keeping lesions at the end because they denote labels
         }
-        t1 = "", t2 = "", fl = "", pd = "", le = "", fg = "";
       }
+      catch (itk::ExceptionObject &e)
+      {
+        failed = true;
+        std::cerr << "Subject '" << subjects[i].id << "' failed: " << e.what() << "\n";
+      }
+      catch (std::exception &e) // e.g., std::bad_alloc or a cv::Exception; an exception escaping a worker would terminate the run
+      {
+        failed = true;
+        std::cerr << "Subject '" << subjects[i].id << "' failed: " << e.what() << "\n";
+      }
+
+      std::lock_guard< std::mutex > lock(mutex);
+      blocks[i].samples = subjectSamples;
+      blocks[i].labels = subjectLabels;
+      blocks[i].keys.swap(subjectKeys);
+      blocks[i].failed = failed;
+      blocks[i].done = true;
+      blockDone.notify_all();
     }
+  };
 
-    typedef float PixelType; // pre-define expected pixel type
-    typedef itk::Image< PixelType, 3 > FloatImageType;
+  std::vector< std::thread > workers;
+  for (unsigned int w = 0; w < numberOfWorkers; w++)
+  {
+    workers.push_back(std::thread(worker));
+  }
 
-    std::vector< PixelType > t1Vector, t2Vector, pdVector, flVector, labelsVector;
+  // ordered merge; a block is released as soon as it is merged
+  size_t failures = 0;
+  std::vector< bool > failed(subjects.size(), false);
+  for (size_t i = 0; i < subjects.size(); i++)
+  {
+    SubjectBlock block;
+    {
+      std::unique_lock< std::mutex > lock(mutex);
+      blockDone.wait(lock, [&]() { return blocks[i].done; });
+      std::swap(block, blocks[i]);
+    }
 
-    for (size_t i = 0; i < sortedFileNames.size(); i++)
+    if (!block.failed && cacheWriter && !cacheWriter->AddSubject(subjects[i].id, block.samples, block.labels, block.keys))
     {
-      FloatImageType::Pointer
-        t1image = FloatImageType::New(), t2image = FloatImageType::New(), FLimage = FloatImageType::New(),
-        PDimage = FloatImageType::New(), maskImage = FloatImageType::New(), lesionImage = FloatImageType::New();
+      std::cerr << "Could not write subject '" << subjects[i].id << "' to the feature cache.\n";
+    }
+    if (!block.failed && subjectBlocks)
+    {
+      SubjectSamples subject;
+      subject.id = subjects[i].id;
+      subject.samples = block.samples;
+      subject.labels = block.labels;
+      subject.keys = block.keys;
+      subjectBlocks->push_back(subject);
+    }
+    if (block.failed)
+    {
+      failures++;
+      failed[i] = true;
+    }
+    else if (options.samplesPerClass > 0)
+    {
+      sampler.Offer(block.samples, block.labels, block.keys);
+    }
+    std::cout << "Merged subject '" << subjects[i].id << "' (" << block.samples.rows << " samples).\n";
 
-      t1image     = SafeReadImage<FloatImageType>(std::get<0>(sortedFileNames[i]));
-      t2image     = SafeReadImage<FloatImageType>(std::get<1>(sortedFileNames[i]));
-      FLimage     = SafeReadImage<FloatImageType>(std::get<2>(sortedFileNames[i]));
-      PDimage     = SafeReadImage<FloatImageType>(std::get<3>(sortedFileNames[i]));
-      maskImage   = SafeReadImage<FloatImageType>(std::get<4>(sortedFileNames[i]));
-      lesionImage = SafeReadImage<FloatImageType>(std::get<5>(sortedFileNames[i]));
+    std::lock_guard< std::mutex > lock(mutex);
+    merged = i + 1;
+    blockMerged.notify_all();
+  }
 
-      // initialize iterators with image and region to iterator through (in this case, it is the largest possible region)
-      itk::ImageRegionIterator<FloatImageType>
-        itMask(maskImage, maskImage->GetLargestPossibleRegion()),
-        itT1(t1image, t1image->GetLargestPossibleRegion()),
-        itT2(t2image, t2image->GetLargestPossibleRegion()),
-        itFL(FLimage, FLimage->GetLargestPossibleRegion()),
-        itPD(PDimage, PDimage->GetLargestPossibleRegion()),
-        itLE(lesionImage, lesionImage->GetLargestPossibleRegion());
+  for (size_t w = 0; w < workers.size(); w++)
+  {
+    workers[w].join();
+  }
+
+  if (options.samplesPerClass > 0)
+  {
+    sampler.GetSamples(samples, labels, options.balanceClasses);
+  }
+  else if (failures > 0)
+  {
+    // the rows of failed subjects were never written; copy the others together once
+    size_t keptRows = 0;
+    for (size_t i = 0; i < subjects.size(); i++)
+    {
+      keptRows += failed[i] ? 0 : firstRows[i + 1] - firstRows[i];
+    }
+    cv::Mat keptSamples(static_cast< int >(keptRows), samples.cols, CV_32FC1), keptLabels(keptSamples.rows, 1, CV_32FC1);
+    int kept = 0;
+    for (size_t i = 0; i < subjects.size(); i++)
+    {
+      const int firstRow = static_cast< int >(firstRows[i]), endRow = static_cast< int >(firstRows[i + 1]);
+      if (!failed[i] && (endRow > firstRow))
+      {
+        samples.rowRange(firstRow, endRow).copyTo(keptSamples.rowRange(kept, kept + endRow - firstRow));
+        labels.rowRange(firstRow, endRow).copyTo(keptLabels.rowRange(kept, kept + endRow - firstRow));
+        kept += endRow - firstRow;
+      }
+    }
+    samples = keptSamples;
+    labels = keptLabels;
+  }
+  return failures;
+}
+
+/**
+\brief Key of a feature cache: the extraction settings and the name, size and time of every input file
+
+Settings which are applied after the subject blocks are merged (classes balanced or not) and the training
+parameters are not part of the key, so changing them reuses the cache.
+*/
+unsigned long long featureCacheKey(const std::vector< SubjectFiles > &subjects, const TrainingSetOptions &options)
+{
+  const unsigned long long settings[] = { FeatureCache::Version, static_cast< unsigned long long >(options.GetNumberOfFeatures()),
+    options.samplesPerClass, options.seed, (options.keepAllRows && (options.samplesPerClass > 0)) ? 1ULL : 0ULL };
+  unsigned long long key = fnv1aHash(settings, sizeof(settings));
+  key = fnv1aHash(options.neighborhood.ToString(), key);
+  for (size_t m = 0; m < options.referenceLandmarks.size(); m++)
+  {
+    const std::vector< double > &values = options.referenceLandmarks[m].values;
+    key = fnv1aHash(values.empty() ? NULL : &values[0], values.size() * sizeof(double), key);
+  }
+  for (size_t i = 0; i < subjects.size(); i++)
+  {
+    key = fnv1aHash(subjects[i].id, key);
+    for (int type = 0; type < SubjectFiles::NumberOfFileTypes; type++)
+    {
+      key = fileSignature(subjects[i].files[type], key);
+    }
+  }
+  return key;
+}
+
+/**
+\brief Build the training set from the subject blocks of a feature cache
+
+Without sampling the training set is the mapped cache itself; otherwise the stored keys are merged exactly as
+extractTrainingData() does, which gives the same sample.
+*/
+void trainingDataFromCache(const FeatureCache &cache, const TrainingSetOptions &options, cv::Mat &samples, cv::Mat &labels)
+{
+  const cv::Mat cachedSamples = cache.GetSamples(), cachedLabels = cache.GetLabels();
+  if ((options.samplesPerClass == 0) || (cache.GetKeys() == NULL))
+  {
+    samples = cachedSamples;
+    labels = cachedLabels;
+    return;
+  }
+  ClassBalancedReservoirSampler sampler(options.samplesPerClass, cachedSamples.cols);
+  const double *keys = cache.GetKeys();
+  for (int row = 0; row < cachedSamples.rows; row++)
+  {
+    sampler.Offer(cachedLabels.at< float >(row), keys[row], cachedSamples.ptr< float >(row));
+  }
+  sampler.GetSamples(samples, labels, options.balanceClasses);
+}
+
+/**
+\brief The subject blocks of a feature cache, as views on the mapping (only the keys are copied)
+*/
+void subjectBlocksFromCache(const FeatureCache &cache, std::vector< SubjectSamples > &subjectBlocks)
+{
+  const cv::Mat cachedSamples = cache.GetSamples(), cachedLabels = cache.GetLabels();
+  const double *keys = cache.GetKeys();
+  subjectBlocks.resize(cache.GetNumberOfSubjects());
+  for (size_t i = 0; i < subjectBlocks.size(); i++)
+  {
+    const cv::Range rows = cache.GetSubjectRows(i);
+    subjectBlocks[i].id = cache.GetSubjectID(i);
+    subjectBlocks[i].samples = cachedSamples.rowRange(rows);
+    subjectBlocks[i].labels = cachedLabels.rowRange(rows);
+    subjectBlocks[i].keys.assign(keys ? keys + rows.start : NULL, keys ? keys + rows.end : NULL);
+  }
+}
+
+// main entry of program
+int main(int argc, char *argv[])
+{
+  try // to catch exceptions
+  {
+    if (argc < 2)
+    {
+      std::cerr << "Usage: " << argv[0] << " <dataDirectory> [manifestFile] [options]\n" <<
+        "  manifestFile is written after scanning dataDirectory and read instead of scanning it on reruns\n" <<
+        "Options:\n" <<
+        "  -workers <n>    Subjects extracted concurrently (default: number of cores)\n" <<
+        "  -inFlight <n>   Subjects read but not yet merged, bounds the memory (default: 2 x workers)\n" <<
+        "  -samplesPerClass <n>  Random voxels kept per label; 0 keeps all foreground voxels (default: 50000)\n" <<
+        "  -unbalanced     Do not reduce the classes to the size of the smallest one\n" <<
+        "  -seed <n>       Seed of the voxel sampling (default: 0)\n" <<
+        "  -boxRadii <r,..>        Add mean and variance of (2r+1)^3 neighborhoods of every modality (e.g., 1,2)\n" <<
+        "  -gradientSigmas <s,..>  Add Gaussian gradient magnitudes of every modality at these scales in mm (e.g., 1,2)\n" <<
+        "  -normalize      Match the intensity histograms of every subject to those of the first one\n" <<
+        "  -reference <id> Match the intensity histograms to those of this subject instead (implies -normalize)\n" <<
+        "  -cache <file>   Feature cache; written after extraction and mapped instead of reading the images on reruns\n" <<
+        "  -C <c>          Penalty of margin violations (default: 1)\n" <<
+        "  -weightClasses  Weight the penalty inversely to the class sizes, e.g., together with -unbalanced\n" <<
+        "  -epochs <n>     Maximum passes of the linear trainer over the samples (default: 1000)\n" <<
+        "  -tolerance <t>  Stop the linear trainer once the optimality violation is below t (default: 0.1)\n" <<
+        "  -folds <k>      Report a subject-level k-fold cross-validation before training on all subjects;\n" <<
+        "                  held-out subjects are tested on their whole foreground\n" <<
+        "  -rff <D>        Approximate an RBF kernel SVM by a linear SVM on D random Fourier features (e.g., 500)\n" <<
+        "  -gamma <g>      Width of that kernel, exp(-g |x - y|^2) on standardized features (default: 1 / features)\n" <<
+        "  -opencvSVM      Train with cv::SVM instead of the linear trainer; slow for many voxels\n" <<
+        "  -model <file>   Where the trained model is written (default: lesionModel.yml)\n";
+      return EXIT_FAILURE;
+    }
+    std::string dirName = argv[1], manifestFile = "", cacheFile = "", modelFile = "lesionModel.yml", referenceID = "";
+    TrainingSetOptions trainingSetOptions;
+    trainingSetOptions.numberOfWorkers = std::max(1u, std::thread::hardware_concurrency());
+    trainingSetOptions.maxSubjectsInFlight = 0;
+    LinearSVMTrainerParameters trainerParameters;
+    bool weightClasses = false, useOpenCVSVM = false, normalize = false;
+    unsigned int numberOfFolds = 0;
+    int numberOfRandomFeatures = 0;
+    double gamma = 0;
+    for (int i = 2; i < argc; i++)
+    {
+      std::string option = argv[i];
+      if ((option == "-workers") && (i + 1 < argc))
+      {
+        trainingSetOptions.numberOfWorkers = std::max(1, std::atoi(argv[++i]));
+      }
+      else if ((option == "-inFlight") && (i + 1 < argc))
+      {
+        trainingSetOptions.maxSubjectsInFlight = std::max(1, std::atoi(argv[++i]));
+      }
+      else if ((option == "-samplesPerClass") && (i + 1 < argc))
+      {
+        trainingSetOptions.samplesPerClass = static_cast< size_t >(std::max(0, std::atoi(argv[++i])));
+      }
+      else if (option == "-unbalanced")
+      {
+        trainingSetOptions.balanceClasses = false;
+      }
+      else if ((option == "-seed") && (i + 1 < argc))
+      {
+        trainingSetOptions.seed = static_cast< unsigned int >(std::strtoul(argv[++i], NULL, 10));
+      }
+      else if ((option == "-boxRadii") && (i + 1 < argc))
+      {
+        std::istringstream list(argv[++i]);
+        trainingSetOptions.neighborhood.boxRadii.clear();
+        for (std::string value; std::getline(list, value, ',');)
+        {
+          trainingSetOptions.neighborhood.boxRadii.push_back(static_cast< unsigned int >(std::max(1, std::atoi(value.c_str()))));
+        }
+      }
+      else if ((option == "-gradientSigmas") && (i + 1 < argc))
+      {
+        std::istringstream list(argv[++i]);
+        trainingSetOptions.neighborhood.gradientSigmas.clear();
+        for (std::string value; std::getline(list, value, ',');)
+        {
+          trainingSetOptions.neighborhood.gradientSigmas.push_back(std::atof(value.c_str()));
+        }
+      }
+      else if (option == "-normalize")
+      {
+        normalize = true;
+      }
+      else if ((option == "-reference") && (i + 1 < argc))
+      {
+        normalize = true;
+        referenceID = argv[++i];
+      }
+      else if ((option == "-cache") && (i + 1 < argc))
+      {
+        cacheFile = argv[++i];
+      }
+      else if ((option == "-model") && (i + 1 < argc))
+      {
+        modelFile = argv[++i];
+      }
+      else if ((option == "-C") && (i + 1 < argc))
+      {
+        trainerParameters.C = std::atof(argv[++i]);
+      }
+      else if (option == "-weightClasses")
+      {
+        weightClasses = true;
+      }
+      else if ((option == "-epochs") && (i + 1 < argc))
+      {
+        trainerParameters.maxEpochs = static_cast< unsigned int >(std::max(1, std::atoi(argv[++i])));
+      }
+      else if ((option == "-tolerance") && (i + 1 < argc))
+      {
+        trainerParameters.tolerance = std::atof(argv[++i]);
+      }
+      else if ((option == "-folds") && (i + 1 < argc))
+      {
+        numberOfFolds = static_cast< unsigned int >(std::max(2, std::atoi(argv[++i])));
+      }
+      else if ((option == "-rff") && (i + 1 < argc))
+      {
+        numberOfRandomFeatures = std::max(0, std::atoi(argv[++i]));
+      }
+      else if ((option == "-gamma") && (i + 1 < argc))
+      {
+        gamma = std::atof(argv[++i]);
+      }
+      else if (option == "-opencvSVM")
+      {
+        useOpenCVSVM = true;
+      }
+      else if ((i == 2) && (option[0] != '-'))
+      {
+        manifestFile = option;
+      }
+      else
+      {
+        std::cerr << "Unknown option '" << option << "'\n";
+        return EXIT_FAILURE;
+      }
+    }
+    if (trainingSetOptions.maxSubjectsInFlight == 0)
+    {
+      trainingSetOptions.maxSubjectsInFlight = 2 * trainingSetOptions.numberOfWorkers;
+    }
+    dirName = replaceString(dirName, "\\", "/") + "/";
 
-      itMask.GoToBegin(); // start mask iterator since all other computations are based on this
+    SubjectManifest manifest;
+    if (!manifestFile.empty() && manifest.Load(manifestFile))
+    {
+      std::cout << "Read " << manifest.GetSubjects().size() << " subjects from manifest '" << manifestFile << "'.\n";
+    }
+    else
+    {
+      // the only scan of the directory
+      const std::vector< std::string > allFileNames = SubjectManifest::ListDirectory(dirName);
+      if (allFileNames.empty())
+      {
+        std::cerr << "Could not read data directory '" << dirName << "', or it is empty.\n";
+        return EXIT_FAILURE;
+      }
+      manifest.Build(dirName, allFileNames);
 
-      std::cout << "Started reading mask '" << i << "'.\n";
-      while (!itMask.IsAtEnd())
+      // if a csv file with subject IDs is present, only those subjects are used, in the order of the file
+      for (size_t i = 0; i < allFileNames.size(); i++)
       {
-        //std::cout << " " << count;
-        if (itMask.Get() == static_cast<PixelType>(1))
+        std::vector< std::string > subjectIDs;
+        const std::string &name = allFileNames[i];
+        if ((name.length() > 4) && (name.compare(name.length() - 4, 4, ".csv") == 0) &&
+          readSubjectList(dirName + name, subjectIDs))
         {
-          //indexVector.push_back(itMask.GetIndex()); // obtain location of voxel in Mask
+          std::vector< std::string > missing = manifest.Select(subjectIDs);
+          for (size_t m = 0; m < missing.size(); m++)
+          {
+            std::cerr << "Subject '" << missing[m] << "' from '" << name << "' has no images.\n";
+          }
+          break;
+        }
+      }
 
-          // Set the location (i.e., Index) for other iterators
-          itT1.SetIndex(itMask.GetIndex());
-          itT2.SetIndex(itMask.GetIndex());
-          itFL.SetIndex(itMask.GetIndex());
-          itPD.SetIndex(itMask.GetIndex());
-          itLE.SetIndex(itMask.GetIndex());
+      if (!manifestFile.empty() && !manifest.Save(manifestFile))
+      {
+        std::cerr << "Could not write manifest '" << manifestFile << "'.\n";
+      }
+    }
+    manifest.RemoveIncomplete();
+    const std::vector< SubjectFiles > &subjects = manifest.GetSubjects();
 
-          // make vector of test data
-          t1Vector.push_back(itT1.Get());
-          t2Vector.push_back(itT1.Get());
-          pdVector.push_back(itT1.Get());
-          flVector.push_back(itT1.Get());
-          labelsVector.push_back(itLE.Get());
+    // the intensities of all subjects are matched to a reference subject, whose landmarks go into the model
+    if (normalize && !subjects.empty())
+    {
+      size_t reference = 0;
+      while ((reference < subjects.size()) && !referenceID.empty() && (subjects[reference].id != referenceID))
+      {
+        reference++;
+      }
+      if (reference == subjects.size())
+      {
+        std::cerr << "Reference subject '" << referenceID << "' is not part of the training set.\n";
+        return EXIT_FAILURE;
+      }
+      computeReferenceLandmarks(subjects[reference], trainingSetOptions.referenceLandmarks);
+      std::cout << "Normalizing intensities to subject '" << subjects[reference].id << "'.\n";
+    }
+
+    // subjects are extracted concurrently and merged in subject order, unless a cache of them is valid
+    FeatureCache cache; // training_data may be mapped from the cache file, so the cache has to outlive it
+    cv::Mat training_data, labels; // training_data holds T1, T2, PD and FL intensities and their neighborhood features
+    std::vector< SubjectSamples > subjectBlocks; // only kept for cross-validation
+    trainingSetOptions.keepAllRows = (numberOfFolds > 0); // held-out subjects are tested on all their voxels
+    const unsigned long long cacheKey = featureCacheKey(subjects, trainingSetOptions);
+    if (!cacheFile.empty() && cache.Open(cacheFile, cacheKey))
+    {
+      trainingDataFromCache(cache, trainingSetOptions, training_data, labels);
+      if (numberOfFolds > 0)
+      {
+        subjectBlocksFromCache(cache, subjectBlocks);
+      }
+      std::cout << "Read " << cache.GetNumberOfSubjects() << " subjects from feature cache '" << cacheFile << "'.\n";
+    }
+    else
+    {
+      FeatureCacheWriter cacheWriter;
+      if (!cacheFile.empty() && !cacheWriter.Open(cacheFile, cacheKey, trainingSetOptions.GetNumberOfFeatures(),
+        trainingSetOptions.samplesPerClass > 0))
+      {
+        std::cerr << "Could not create feature cache '" << cacheFile << "'.\n";
+      }
+      size_t failures = extractTrainingData(subjects, trainingSetOptions, training_data, labels,
+        cacheWriter.IsOpen() ? &cacheWriter : NULL, (numberOfFolds > 0) ? &subjectBlocks : NULL);
+      if (failures > 0)
+      {
+        std::cerr << failures << " of " << subjects.size() << " subjects could not be read.\n";
+        cacheWriter.Abort(); // incomplete; the next run extracts again
+      }
+      else if (cacheWriter.IsOpen() && !cacheWriter.Commit())
+      {
+        std::cerr << "Could not write feature cache '" << cacheFile << "'.\n";
+      }
+    }
+    std::cout << "Training on " << training_data.rows << " voxels.\n";
 
-          //it.Set(10);
+    // cross-validation on the blocks extracted above, before any map is fitted on all subjects; the folds share
+    // the worker budget
+    if (numberOfFolds > 0)
+    {
+      SubjectCrossValidation crossValidation;
+      crossValidation.SetSubjects(&subjectBlocks);
+      crossValidation.SetNumberOfFolds(numberOfFolds);
+      crossValidation.SetNumberOfThreads(trainingSetOptions.numberOfWorkers);
+      crossValidation.SetSeed(trainingSetOptions.seed);
+      crossValidation.SetSampling(trainingSetOptions.samplesPerClass, trainingSetOptions.balanceClasses);
+      crossValidation.SetTrainerParameters(trainerParameters, weightClasses);
+      crossValidation.SetRandomFeatures(numberOfRandomFeatures, gamma, trainingSetOptions.seed);
+      const std::vector< CrossValidationFold > folds = crossValidation.Run();
 
+      double diceSum = 0, diceSquaredSum = 0, accuracySum = 0;
+      size_t valid = 0;
+      for (size_t f = 0; f < folds.size(); f++)
+      {
+        std::cout << "Fold " << folds[f].fold + 1 << "/" << folds.size() << ": " << folds[f].testSubjects.size() << " test subjects, " <<
+          folds[f].trainingRows << " training rows, " << folds[f].testRows << " test rows, ";
+        if (!folds[f].error.empty())
+        {
+          std::cout << "failed: " << folds[f].error << "\n";
+          continue;
         }
-        itMask++; // only iterator through foreground mask since this all computations are based on it
+        std::cout << "accuracy " << folds[f].accuracy << ", Dice " << folds[f].dice << ", " << folds[f].epochs << " epochs" <<
+          (folds[f].converged ? "" : " (not converged)") << ", " << folds[f].seconds << " s\n";
+        diceSum += folds[f].dice;
+        diceSquaredSum += folds[f].dice * folds[f].dice;
+        accuracySum += folds[f].accuracy;
+        valid++;
+      }
+      if (valid > 0)
+      {
+        const double meanDice = diceSum / valid;
+        std::cout << "Cross-validation: accuracy " << accuracySum / valid << ", Dice " << meanDice << " +/- " <<
+          std::sqrt(std::max(diceSquaredSum / valid - meanDice * meanDice, 0.0)) << " over " << valid << " folds.\n";
       }
     }
-    
-    // initialize the OpenCV data structures
-    cv::Mat training_data, labels(labelsVector);
 
-    cv::hconcat(
-      std::vector<cv::Mat>{cv::Mat(t1Vector), cv::Mat(t2Vector), cv::Mat(pdVector), cv::Mat(flVector)}, // make a vector of all modality intensities
-      training_data); // training_data now is an [n x 4] matrix
+    // approximate RBF kernel: from here on the rows of training_data are their random Fourier features, and
+    // the map goes into the model so that inference maps its rows the same way
+    RandomFourierFeatureMap featureMap;
+    if (numberOfRandomFeatures > 0)
+    {
+      featureMap.Fit(training_data, numberOfRandomFeatures, gamma, trainingSetOptions.seed);
+      featureMap.Transform(training_data, training_data);
+      std::cout << "Mapped " << featureMap.GetNumberOfInputs() << " features to " << featureMap.GetNumberOfOutputs() <<
+        " random Fourier features.\n";
+    }
     
     ////// start teaching the machine
 
-    // Set up SVM's parameters. There are different parameters for different classifiers. Please see documentation for details
-    cv::SVMParams params;
-    params.svm_type = cv::SVM::C_SVC; // C-Support Vector Classification
-    params.kernel_type = cv::SVM::LINEAR;
-    params.term_crit = cvTermCriteria(CV_TERMCRIT_ITER, 100, 1e-6); // when to stop
+    LinearModel model;
+    if (useOpenCVSVM)
+    {
+      // Set up SVM's parameters. There are different parameters for different classifiers. Please see documentation for details
+      cv::SVMParams params;
+      params.svm_type = cv::SVM::C_SVC; // C-Support Vector Classification
+      params.kernel_type = cv::SVM::LINEAR;
+      params.C = trainerParameters.C;
+      params.term_crit = cvTermCriteria(CV_TERMCRIT_ITER, 100, 1e-6); // when to stop
 
-    cv::SVM svm;
-    svm.train(training_data, labels, cv::Mat(), cv::Mat(), params);
+      cv::SVM svm;
+      svm.train(training_data, labels, cv::Mat(), cv::Mat(), params);
+      if (!extractLinearModel(svm, model)) // e.g., a training set with a single class has no support vectors
+      {
+        std::cerr << "The OpenCV SVM is not a two-class linear classifier; no model can be written.\n";
+        return EXIT_FAILURE;
+      }
+    }
+    else
+    {
+      // dual coordinate descent reads training_data in place and scales linearly with the number of voxels
+      LinearSVMTrainer trainer;
+      trainer.SetParameters(trainerParameters);
+      if (weightClasses)
+      {
+        trainer.BalanceClassWeights(labels);
+      }
+      LinearSVMTrainer::Result result = trainer.Train(training_data, labels, model);
+      std::cout << "Linear SVM trained in " << result.epochs << " epochs" <<
+        (result.converged ? "" : " (not converged, increase -epochs)") << ".\n";
+    }
+
+    cv::Mat predicted;
+    linearModelPredict(model, training_data, predicted);
+    std::cout << "Training accuracy: " << cv::countNonZero(predicted == labels) / std::max(1.0, static_cast< double >(labels.rows)) << "\n";
+
+    // the model is applied to new subjects by ITK_Tutorial_ML-2_Inference, which needs the same features
+    if (!saveLinearModel(model, modelFile))
+    {
+      std::cerr << "Could not write model '" << modelFile << "'.\n";
+      return EXIT_FAILURE;
+    }
+    cv::FileStorage modelStorage(modelFile, cv::FileStorage::APPEND);
+    trainingSetOptions.neighborhood.Write(modelStorage);
+    featureMap.Write(modelStorage);
+    if (!trainingSetOptions.referenceLandmarks.empty())
+    {
+      IntensityLandmarks::WriteSequence(modelStorage, "intensityLandmarks", trainingSetOptions.referenceLandmarks);
+    }
+    std::cout << "Wrote model '" << modelFile << "'.\n";
 
   }
   catch (itk::ExceptionObject &error)
@@ -408,6 +1089,11 @@ int main(int argc, char *argv[])
     std::cerr << "Exception caught: " << error << "\n";
     return EXIT_FAILURE;
   }
+  catch (cv::Exception &error) // e.g., from linearModelPredict() on a model of the wrong size
+  {
+    std::cerr << "Exception caught: " << error.what() << "\n";
+    return EXIT_FAILURE;
+  }
   
   return EXIT_SUCCESS;
 }
\ No newline at end of file
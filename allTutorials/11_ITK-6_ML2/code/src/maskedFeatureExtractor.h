@@ -0,0 +1,241 @@
+#pragma once
+
+#include "itkImage.h"
+#include "itkMacro.h"
+
+#include "opencv2/core/core.hpp"
+
+#include "foregroundIndex.h"
+
+#include <vector>
+
+/**
+\brief Extract the voxels inside a mask from a set of co-registered images into a row-major sample matrix
+
+All images share the grid of the mask, so voxel 'o' of every image is element 'o' of its buffer. The
+extractor walks all buffers in lockstep by this linear offset, without computing an index per voxel. The
+foreground voxels are counted first, so the sample matrix is allocated once and every voxel is written
+straight into its row: feature f of a sample is the value of the f-th image added with AddImage().
+
+With a ForegroundIndex of the mask, the foreground is walked run by run: the count is known without a pass
+and the background is never touched.
+*/
+template < typename TImageType, typename TMaskImageType = TImageType >
+class MaskedFeatureExtractor
+{
+public:
+  MaskedFeatureExtractor() :
+    m_Mask(NULL), m_LabelImage(NULL), m_Foreground(NULL)
+  {
+  }
+
+  //! Add the image of the next feature
+  void AddImage(const TImageType *image)
+  {
+    m_Images.push_back(image);
+  }
+
+  //! Voxels where the mask is not zero are extracted
+  void SetMask(const TMaskImageType *mask)
+  {
+    m_Mask = mask;
+  }
+
+  //! Optional runs of the non-zero voxels of the mask; not copied, so they have to outlive the extraction
+  void SetForegroundIndex(const ForegroundIndex *foreground)
+  {
+    m_Foreground = foreground;
+  }
+
+  //! Optional image whose values are extracted as labels
+  void SetLabelImage(const TImageType *labelImage)
+  {
+    m_LabelImage = labelImage;
+  }
+
+  size_t GetNumberOfFeatures() const
+  {
+    return m_Images.size();
+  }
+
+  //! Throws if the mask is missing or an image does not share the buffered region of the mask
+  void Validate() const
+  {
+    if (m_Mask == NULL)
+    {
+      itkGenericExceptionMacro(<< "No mask set");
+    }
+    const typename TMaskImageType::RegionType &region = m_Mask->GetBufferedRegion();
+    for (size_t f = 0; f < m_Images.size(); f++)
+    {
+      if (m_Images[f]->GetBufferedRegion() != region)
+      {
+        itkGenericExceptionMacro(<< "Image " << f << " does not share the grid of the mask");
+      }
+    }
+    if (m_LabelImage && (m_LabelImage->GetBufferedRegion() != region))
+    {
+      itkGenericExceptionMacro(<< "The label image does not share the grid of the mask");
+    }
+    if (m_Foreground && !m_Foreground->SharesGrid(m_Mask))
+    {
+      itkGenericExceptionMacro(<< "The foreground index does not share the grid of the mask");
+    }
+  }
+
+  //! Number of samples, i.e., of voxels inside the mask
+  size_t CountSamples() const
+  {
+    this->Validate();
+    if (m_Foreground)
+    {
+      return m_Foreground->GetNumberOfVoxels();
+    }
+    const typename TMaskImageType::PixelType *mask = m_Mask->GetBufferPointer();
+    const size_t numberOfVoxels = m_Mask->GetBufferedRegion().GetNumberOfPixels();
+    size_t count = 0;
+    for (size_t o = 0; o < numberOfVoxels; o++)
+    {
+      count += (mask[o] != 0) ? 1 : 0;
+    }
+    return count;
+  }
+
+  /**
+  \brief Write the samples into a caller provided buffer
+
+  \param samples Row-major buffer with room for CountSamples() rows of 'rowStride' floats
+  \param rowStride Distance between two rows in floats; at least GetNumberOfFeatures()
+  \param labels Buffer with room for CountSamples() labels; may be NULL
+
+  \return Number of rows written
+  */
+  size_t Extract(float *samples, size_t rowStride, float *labels) const
+  {
+    this->Validate();
+    const size_t numberOfFeatures = m_Images.size();
+    std::vector< const typename TImageType::PixelType * > buffers(numberOfFeatures);
+    for (size_t f = 0; f < numberOfFeatures; f++)
+    {
+      buffers[f] = m_Images[f]->GetBufferPointer();
+    }
+    const typename TImageType::PixelType *labelBuffer = m_LabelImage ? m_LabelImage->GetBufferPointer() : NULL;
+
+    size_t row = 0;
+    auto extract = [&](size_t o)
+    {
+      float *sample = samples + row * rowStride;
+      for (size_t f = 0; f < numberOfFeatures; f++)
+      {
+        sample[f] = static_cast< float >(buffers[f][o]);
+      }
+      if (labels && labelBuffer)
+      {
+        labels[row] = static_cast< float >(labelBuffer[o]);
+      }
+      row++;
+    };
+    this->ForEachForegroundVoxel(extract);
+    return row;
+  }
+
+  /**
+  \brief Call visitor(offset, label) for every voxel inside the mask, in buffer order
+
+  The label is 0 if no label image is set. Only the mask and the label image are read.
+  */
+  template < typename TVisitor >
+  void VisitForeground(TVisitor &visitor) const
+  {
+    this->Validate();
+    const typename TImageType::PixelType *labelBuffer = m_LabelImage ? m_LabelImage->GetBufferPointer() : NULL;
+    auto visit = [&](size_t o)
+    {
+      visitor(o, labelBuffer ? static_cast< float >(labelBuffer[o]) : 0.0f);
+    };
+    this->ForEachForegroundVoxel(visit);
+  }
+
+  /**
+  \brief Write the samples of the given voxels only
+
+  \param offsets Linear offsets of the voxels, e.g., collected with VisitForeground()
+  \param samples Row-major buffer with room for offsets.size() rows of 'rowStride' floats
+  \param rowStride Distance between two rows in floats; at least GetNumberOfFeatures()
+  \param labels Buffer with room for offsets.size() labels; may be NULL
+  */
+  void ExtractAt(const std::vector< size_t > &offsets, float *samples, size_t rowStride, float *labels) const
+  {
+    this->Validate();
+    const size_t numberOfFeatures = m_Images.size();
+    for (size_t row = 0; row < offsets.size(); row++)
+    {
+      float *sample = samples + row * rowStride;
+      for (size_t f = 0; f < numberOfFeatures; f++)
+      {
+        sample[f] = static_cast< float >(m_Images[f]->GetBufferPointer()[offsets[row]]);
+      }
+      if (labels && m_LabelImage)
+      {
+        labels[row] = static_cast< float >(m_LabelImage->GetBufferPointer()[offsets[row]]);
+      }
+    }
+  }
+
+  /**
+  \brief Extract into newly allocated matrices
+
+  \param samples Overwritten with a [CountSamples() x GetNumberOfFeatures()] CV_32F matrix
+  \param labels Overwritten with a [CountSamples() x 1] CV_32F matrix; empty if no label image is set
+  */
+  void Extract(cv::Mat &samples, cv::Mat &labels) const
+  {
+    const int count = static_cast< int >(this->CountSamples());
+    samples.create(count, static_cast< int >(m_Images.size()), CV_32FC1);
+    if (m_LabelImage)
+    {
+      labels.create(count, 1, CV_32FC1);
+    }
+    else
+    {
+      labels.release();
+    }
+    if (count > 0)
+    {
+      this->Extract(samples.ptr< float >(0), samples.step1(), m_LabelImage ? labels.ptr< float >(0) : NULL);
+    }
+  }
+
+private:
+  //! Call function(offset) for every voxel inside the mask, in buffer order: along the runs if there is an index
+  template < typename TFunction >
+  void ForEachForegroundVoxel(TFunction &function) const
+  {
+    if (m_Foreground)
+    {
+      for (size_t r = 0; r < m_Foreground->GetNumberOfRuns(); r++)
+      {
+        const ForegroundIndex::Run &run = m_Foreground->GetRun(r);
+        for (size_t o = static_cast< size_t >(run.begin); o < run.end; o++)
+        {
+          function(o);
+        }
+      }
+      return;
+    }
+    const size_t numberOfVoxels = m_Mask->GetBufferedRegion().GetNumberOfPixels();
+    const typename TMaskImageType::PixelType *mask = m_Mask->GetBufferPointer();
+    for (size_t o = 0; o < numberOfVoxels; o++)
+    {
+      if (mask[o] != 0)
+      {
+        function(o);
+      }
+    }
+  }
+
+  std::vector< const TImageType * > m_Images;
+  const TMaskImageType *m_Mask;
+  const TImageType *m_LabelImage;
+  const ForegroundIndex *m_Foreground;
+};
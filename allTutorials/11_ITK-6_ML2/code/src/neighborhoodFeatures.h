@@ -0,0 +1,312 @@
+#pragma once
+
+#include "itkImage.h"
+#include "itkGradientMagnitudeRecursiveGaussianImageFilter.h"
+
+#include "opencv2/core/core.hpp"
+
+#include "foregroundIndex.h"
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+
+/**
+\brief Which neighborhood features are computed for every modality
+*/
+struct NeighborhoodFeatureSettings
+{
+  std::vector< unsigned int > boxRadii; //! local mean and variance in a (2r+1)^3 box, per radius r in voxels
+  std::vector< double > gradientSigmas; //! Gaussian gradient magnitude, per scale sigma in physical units
+
+  size_t GetNumberOfFeaturesPerImage() const
+  {
+    return 2 * boxRadii.size() + gradientSigmas.size();
+  }
+
+  //! Text form, e.g., "box:1,2;gradient:1,2"; part of the feature cache key
+  std::string ToString() const
+  {
+    std::ostringstream stream;
+    stream << "box:";
+    for (size_t i = 0; i < boxRadii.size(); i++)
+    {
+      stream << (i ? "," : "") << boxRadii[i];
+    }
+    stream << ";gradient:";
+    for (size_t i = 0; i < gradientSigmas.size(); i++)
+    {
+      stream << (i ? "," : "") << gradientSigmas[i];
+    }
+    return stream.str();
+  }
+
+  void Write(cv::FileStorage &storage) const
+  {
+    std::vector< int > radii(boxRadii.begin(), boxRadii.end());
+    storage << "boxRadii" << radii;
+    storage << "gradientSigmas" << gradientSigmas;
+  }
+
+  //! Read what Write() wrote; missing entries mean no features of that kind
+  void Read(const cv::FileStorage &storage)
+  {
+    std::vector< int > radii;
+    if (!storage["boxRadii"].empty())
+    {
+      storage["boxRadii"] >> radii;
+    }
+    boxRadii.assign(radii.begin(), radii.end());
+    gradientSigmas.clear();
+    if (!storage["gradientSigmas"].empty())
+    {
+      storage["gradientSigmas"] >> gradientSigmas;
+    }
+  }
+};
+
+/**
+\brief Box sums of a volume along one axis, in place; every range is a block of lines along that axis
+
+Each line is turned into prefix sums once, after which every window sum is the difference of two of them, so
+the cost per voxel does not depend on the radius. Windows are clipped at the border of the volume.
+*/
+class BoxSumAlongAxisBody : public cv::ParallelLoopBody
+{
+public:
+  BoxSumAlongAxisBody(double *volume, const size_t size[3], unsigned int axis, unsigned int radius) :
+    m_Volume(volume), m_Radius(radius)
+  {
+    const size_t strides[3] = { 1, size[0], size[0] * size[1] };
+    m_Length = size[axis];
+    m_Stride = strides[axis];
+    // a line is identified by its position along the two other axes
+    m_InnerAxis = (axis == 0) ? 1 : 0;
+    m_OuterAxis = (axis == 2) ? 1 : 2;
+    m_InnerSize = size[m_InnerAxis];
+    m_InnerStride = strides[m_InnerAxis];
+    m_OuterStride = strides[m_OuterAxis];
+  }
+
+  int GetNumberOfLines(const size_t size[3]) const
+  {
+    return static_cast< int >(size[m_InnerAxis] * size[m_OuterAxis]);
+  }
+
+  void operator()(const cv::Range &lines) const
+  {
+    std::vector< double > prefix(m_Length + 1);
+    const long long radius = m_Radius, last = static_cast< long long >(m_Length) - 1;
+    for (int line = lines.start; line < lines.end; line++)
+    {
+      const size_t inner = static_cast< size_t >(line) % m_InnerSize, outer = static_cast< size_t >(line) / m_InnerSize;
+      double *values = m_Volume + inner * m_InnerStride + outer * m_OuterStride;
+      prefix[0] = 0;
+      for (size_t i = 0; i < m_Length; i++)
+      {
+        prefix[i + 1] = prefix[i] + values[i * m_Stride];
+      }
+      for (long long i = 0; i <= last; i++)
+      {
+        const long long begin = std::max(i - radius, 0LL), end = std::min(i + radius, last) + 1;
+        values[i * m_Stride] = prefix[end] - prefix[begin];
+      }
+    }
+  }
+
+private:
+  BoxSumAlongAxisBody &operator=(const BoxSumAlongAxisBody &); // purposely not implemented
+
+  double *m_Volume;
+  unsigned int m_Radius;
+  size_t m_Length, m_Stride;
+  unsigned int m_InnerAxis, m_OuterAxis;
+  size_t m_InnerSize, m_InnerStride, m_OuterStride;
+};
+
+/**
+\brief Multi-scale neighborhood features of co-registered images, written straight into a sample matrix
+
+For every image added with AddImage() and in this order:
+- for every box radius r: mean and variance of the (2r+1)^3 neighborhood. Sums of the values and of their
+  squares are computed with separable prefix-sum box filters, O(1) per voxel whatever the radius; at the
+  border the box is clipped and the statistics are taken over the voxels inside the image
+- for every sigma: gradient magnitude of the image smoothed with a Gaussian of that sigma, computed with
+  itk::GradientMagnitudeRecursiveGaussianImageFilter, also O(1) per voxel
+
+The box passes run on all cores with cv::parallel_for_, the recursive filters with the ITK threads. Whole
+volumes are filtered (neighborhoods cross the mask border), but features are only written for the voxels
+inside the mask, in the same row order as MaskedFeatureExtractor, and two double volumes of working memory
+are reused for every image and radius. With a ForegroundIndex of the mask, the voxels are taken from its runs
+instead of a pass over the mask.
+*/
+template < typename TImageType, typename TMaskImageType = TImageType >
+class NeighborhoodFeatureGenerator
+{
+public:
+  typedef itk::Image< float, TImageType::ImageDimension > FloatImageType;
+
+  NeighborhoodFeatureGenerator() :
+    m_Mask(NULL), m_Foreground(NULL)
+  {
+  }
+
+  void SetSettings(const NeighborhoodFeatureSettings &settings)
+  {
+    m_Settings = settings;
+  }
+
+  void AddImage(const TImageType *image)
+  {
+    m_Images.push_back(image);
+  }
+
+  void SetMask(const TMaskImageType *mask)
+  {
+    m_Mask = mask;
+  }
+
+  //! Optional runs of the non-zero voxels of the mask, see MaskedFeatureExtractor::SetForegroundIndex()
+  void SetForegroundIndex(const ForegroundIndex *foreground)
+  {
+    m_Foreground = foreground;
+  }
+
+  size_t GetNumberOfFeatures() const
+  {
+    return m_Images.size() * m_Settings.GetNumberOfFeaturesPerImage();
+  }
+
+  /**
+  \brief Write the features of all voxels inside the mask
+
+  \param samples Row-major buffer; row i gets the features of the i-th mask voxel in buffer order, starting at
+  samples + i * rowStride, e.g., the columns after the intensities of MaskedFeatureExtractor::Extract()
+  \param rowStride Distance between two rows in floats
+  */
+  void Extract(float *samples, size_t rowStride)
+  {
+    if (m_Mask == NULL)
+    {
+      itkGenericExceptionMacro(<< "No mask set");
+    }
+    std::vector< size_t > offsets;
+    if (m_Foreground)
+    {
+      if (!m_Foreground->SharesGrid(m_Mask))
+      {
+        itkGenericExceptionMacro(<< "The foreground index does not share the grid of the mask");
+      }
+      m_Foreground->GetOffsets(offsets);
+    }
+    else
+    {
+      const size_t numberOfVoxels = m_Mask->GetBufferedRegion().GetNumberOfPixels();
+      const typename TMaskImageType::PixelType *mask = m_Mask->GetBufferPointer();
+      for (size_t o = 0; o < numberOfVoxels; o++)
+      {
+        if (mask[o] != 0)
+        {
+          offsets.push_back(o);
+        }
+      }
+    }
+    this->ExtractAt(offsets, samples, rowStride);
+  }
+
+  //! Write the features of the given voxels only, see MaskedFeatureExtractor::ExtractAt()
+  void ExtractAt(const std::vector< size_t > &offsets, float *samples, size_t rowStride)
+  {
+    itkStaticAssert(TImageType::ImageDimension == 3, "Box features are implemented for volumes");
+    if (m_Mask == NULL)
+    {
+      itkGenericExceptionMacro(<< "No mask set");
+    }
+    if (offsets.empty() || (this->GetNumberOfFeatures() == 0))
+    {
+      return;
+    }
+
+    size_t column = 0;
+    for (size_t image = 0; image < m_Images.size(); image++)
+    {
+      const TImageType *input = m_Images[image];
+      if (input->GetBufferedRegion() != m_Mask->GetBufferedRegion())
+      {
+        itkGenericExceptionMacro(<< "Image " << image << " does not share the grid of the mask");
+      }
+      for (size_t r = 0; r < m_Settings.boxRadii.size(); r++)
+      {
+        this->WriteBoxStatistics(input, m_Settings.boxRadii[r], offsets, samples + column, rowStride);
+        column += 2;
+      }
+      for (size_t s = 0; s < m_Settings.gradientSigmas.size(); s++)
+      {
+        this->WriteGradientMagnitude(input, m_Settings.gradientSigmas[s], offsets, samples + column, rowStride);
+        column++;
+      }
+    }
+  }
+
+private:
+  //! Mean into column 0 and variance into column 1 of every row
+  void WriteBoxStatistics(const TImageType *image, unsigned int radius, const std::vector< size_t > &offsets,
+    float *samples, size_t rowStride)
+  {
+    const typename TImageType::SizeType &imageSize = image->GetBufferedRegion().GetSize();
+    const size_t size[3] = { imageSize[0], imageSize[1], imageSize[2] };
+    const size_t numberOfVoxels = size[0] * size[1] * size[2];
+    const typename TImageType::PixelType *values = image->GetBufferPointer();
+    m_Sums.resize(numberOfVoxels);
+    m_SquaredSums.resize(numberOfVoxels);
+    for (size_t o = 0; o < numberOfVoxels; o++)
+    {
+      m_Sums[o] = static_cast< double >(values[o]);
+      m_SquaredSums[o] = m_Sums[o] * m_Sums[o];
+    }
+    for (unsigned int axis = 0; axis < 3; axis++)
+    {
+      BoxSumAlongAxisBody sums(&m_Sums[0], size, axis, radius), squaredSums(&m_SquaredSums[0], size, axis, radius);
+      cv::parallel_for_(cv::Range(0, sums.GetNumberOfLines(size)), sums);
+      cv::parallel_for_(cv::Range(0, squaredSums.GetNumberOfLines(size)), squaredSums);
+    }
+
+    for (size_t row = 0; row < offsets.size(); row++)
+    {
+      const size_t o = offsets[row];
+      const size_t index[3] = { o % size[0], (o / size[0]) % size[1], o / (size[0] * size[1]) };
+      double count = 1;
+      for (unsigned int d = 0; d < 3; d++)
+      {
+        const size_t begin = (index[d] > radius) ? index[d] - radius : 0, end = std::min(index[d] + radius, size[d] - 1);
+        count *= static_cast< double >(end - begin + 1);
+      }
+      const double mean = m_Sums[o] / count;
+      float *sample = samples + row * rowStride;
+      sample[0] = static_cast< float >(mean);
+      sample[1] = static_cast< float >(std::max(m_SquaredSums[o] / count - mean * mean, 0.0));
+    }
+  }
+
+  void WriteGradientMagnitude(const TImageType *image, double sigma, const std::vector< size_t > &offsets,
+    float *samples, size_t rowStride)
+  {
+    typedef itk::GradientMagnitudeRecursiveGaussianImageFilter< TImageType, FloatImageType > GradientFilterType;
+    typename GradientFilterType::Pointer gradient = GradientFilterType::New();
+    gradient->SetInput(image);
+    gradient->SetSigma(sigma);
+    gradient->Update();
+    const float *magnitudes = gradient->GetOutput()->GetBufferPointer();
+    for (size_t row = 0; row < offsets.size(); row++)
+    {
+      samples[row * rowStride] = magnitudes[offsets[row]];
+    }
+  }
+
+  NeighborhoodFeatureSettings m_Settings;
+  std::vector< const TImageType * > m_Images;
+  const TMaskImageType *m_Mask;
+  const ForegroundIndex *m_Foreground;
+  std::vector< double > m_Sums, m_SquaredSums; //! working volumes of WriteBoxStatistics()
+};
@@ -0,0 +1,215 @@
+#pragma once
+
+#include "opencv2/core/core.hpp"
+
+#include <vector>
+#include <cmath>
+#include <random>
+#include <algorithm>
+
+/**
+\brief Parallel body of RandomFourierFeatureMap::Transform(); every range is a block of sample rows
+
+One matrix product per block projects all its rows at once, then the cosine is taken in place.
+*/
+class RandomFourierFeatureBody : public cv::ParallelLoopBody
+{
+public:
+  RandomFourierFeatureBody(const cv::Mat &samples, const cv::Mat &projection, const std::vector< float > &offsets, float scale,
+    int blockSize, cv::Mat &features) :
+    m_Samples(samples), m_Projection(projection), m_Offsets(offsets), m_Scale(scale), m_BlockSize(blockSize), m_Features(features)
+  {
+  }
+
+  void operator()(const cv::Range &blocks) const
+  {
+    const int numberOfOutputs = m_Projection.rows;
+    for (int block = blocks.start; block < blocks.end; block++)
+    {
+      const int first = block * m_BlockSize, last = std::min(first + m_BlockSize, m_Samples.rows);
+      cv::Mat projected = m_Features.rowRange(first, last);
+      cv::gemm(m_Samples.rowRange(first, last), m_Projection, 1.0, cv::Mat(), 0.0, projected, cv::GEMM_2_T);
+      for (int row = 0; row < projected.rows; row++)
+      {
+        float *z = projected.ptr< float >(row);
+        for (int j = 0; j < numberOfOutputs; j++)
+        {
+          z[j] = m_Scale * std::cos(z[j] + m_Offsets[j]);
+        }
+      }
+    }
+  }
+
+private:
+  RandomFourierFeatureBody &operator=(const RandomFourierFeatureBody &); // purposely not implemented
+
+  const cv::Mat &m_Samples, &m_Projection;
+  const std::vector< float > &m_Offsets;
+  float m_Scale;
+  int m_BlockSize;
+  cv::Mat &m_Features;
+};
+
+/**
+\brief Random Fourier features of Rahimi and Recht, which turn an RBF kernel SVM into a linear one
+
+z(x) = sqrt(2 / D) cos(W x + b), with the D rows of W drawn from N(0, 2 gamma I) and b uniform in [0, 2 pi),
+satisfies E[z(x).z(y)] = exp(-gamma |x - y|^2), the RBF kernel. A linear SVM trained on z(x) therefore
+approximates the RBF SVM, with the training and prediction cost of a linear model of D features instead of
+a kernel expansion over the support vectors.
+
+The kernel is taken on standardized features (zero mean, unit variance, from Fit()), so one gamma suits
+intensities and neighborhood statistics alike. The standardization is folded into W and b, and the map
+written to the model is applied to the raw feature rows as they are extracted.
+*/
+class RandomFourierFeatureMap
+{
+public:
+  enum
+  {
+    BlockSize = 1024 //! sample rows per matrix product
+  };
+
+  RandomFourierFeatureMap()
+  {
+  }
+
+  //! False until Fit() or Read() created a map; then Transform() is the identity
+  bool IsEnabled() const
+  {
+    return !m_Projection.empty();
+  }
+
+  int GetNumberOfInputs() const
+  {
+    return m_Projection.cols;
+  }
+
+  int GetNumberOfOutputs() const
+  {
+    return m_Projection.rows;
+  }
+
+  /**
+  \brief Draw a map for the features of 'samples'
+
+  \param samples [n x d] CV_32F training rows; only their mean and variance per column are used
+  \param numberOfOutputs D, the number of random features; more approximate the kernel better
+  \param gamma Width of the kernel exp(-gamma |x - y|^2) on standardized features; <= 0 uses 1 / d
+  \param seed Seed of W and b
+  */
+  void Fit(const cv::Mat &samples, int numberOfOutputs, double gamma, unsigned int seed)
+  {
+    CV_Assert((samples.type() == CV_32FC1) && (numberOfOutputs > 0));
+    const int numberOfInputs = samples.cols;
+    if (gamma <= 0)
+    {
+      gamma = 1.0 / std::max(1, numberOfInputs);
+    }
+
+    std::vector< double > mean(numberOfInputs, 0.0), scale(numberOfInputs, 1.0);
+    std::vector< double > squaredSum(numberOfInputs, 0.0);
+    for (int row = 0; row < samples.rows; row++)
+    {
+      const float *sample = samples.ptr< float >(row);
+      for (int f = 0; f < numberOfInputs; f++)
+      {
+        mean[f] += sample[f];
+        squaredSum[f] += static_cast< double >(sample[f]) * sample[f];
+      }
+    }
+    for (int f = 0; f < numberOfInputs; f++)
+    {
+      mean[f] /= std::max(1, samples.rows);
+      const double variance = squaredSum[f] / std::max(1, samples.rows) - mean[f] * mean[f];
+      scale[f] = (variance > 1e-12) ? 1.0 / std::sqrt(variance) : 1.0; // constant features stay unscaled
+    }
+
+    // w ~ N(0, 2 gamma) per standardized input, folded: w.((x - mean) * scale) + b = (w * scale).x + b - (w * scale).mean
+    std::mt19937 generator(seed);
+    std::normal_distribution< double > normal(0.0, std::sqrt(2.0 * gamma));
+    std::uniform_real_distribution< double > uniform(0.0, 2.0 * CV_PI);
+    m_Projection.create(numberOfOutputs, numberOfInputs, CV_32FC1);
+    m_Offsets.resize(numberOfOutputs);
+    for (int j = 0; j < numberOfOutputs; j++)
+    {
+      float *w = m_Projection.ptr< float >(j);
+      double offset = uniform(generator);
+      for (int f = 0; f < numberOfInputs; f++)
+      {
+        const double weight = normal(generator) * scale[f];
+        w[f] = static_cast< float >(weight);
+        offset -= weight * mean[f];
+      }
+      m_Offsets[j] = static_cast< float >(offset);
+    }
+  }
+
+  /**
+  \brief Map every row of 'samples' to its random features, in parallel blocks of rows
+
+  \param samples [n x GetNumberOfInputs()] CV_32F
+  \param features Overwritten with the [n x GetNumberOfOutputs()] CV_32F features; 'samples' itself if disabled. A
+  buffer of that size is reused unless it is the one of 'samples', so blocks of rows can be mapped into one buffer
+  \param parallel False maps the blocks on the calling thread, e.g., from a worker which already has its share of the threads
+  */
+  void Transform(const cv::Mat &samples, cv::Mat &features, bool parallel = true) const
+  {
+    if (!this->IsEnabled())
+    {
+      features = samples;
+      return;
+    }
+    if (samples.rows == 0)
+    {
+      features = cv::Mat(0, m_Projection.rows, CV_32FC1);
+      return;
+    }
+    CV_Assert((samples.type() == CV_32FC1) && (samples.cols == m_Projection.cols));
+    cv::Mat result = (features.datastart == samples.datastart) ? cv::Mat() : features;
+    result.create(samples.rows, m_Projection.rows, CV_32FC1);
+    const int numberOfBlocks = (samples.rows + BlockSize - 1) / BlockSize;
+    const float scale = static_cast< float >(std::sqrt(2.0 / m_Projection.rows));
+    const RandomFourierFeatureBody body(samples, m_Projection, m_Offsets, scale, BlockSize, result);
+    if (parallel)
+    {
+      cv::parallel_for_(cv::Range(0, numberOfBlocks), body);
+    }
+    else
+    {
+      body(cv::Range(0, numberOfBlocks));
+    }
+    features = result;
+  }
+
+  //! Write the map next to the model; nothing is written if it is disabled
+  void Write(cv::FileStorage &storage) const
+  {
+    if (this->IsEnabled())
+    {
+      storage << "randomFourierProjection" << m_Projection;
+      storage << "randomFourierOffsets" << m_Offsets;
+    }
+  }
+
+  //! Read what Write() wrote; the map is disabled if the model has none
+  void Read(const cv::FileStorage &storage)
+  {
+    m_Projection.release();
+    m_Offsets.clear();
+    if (!storage["randomFourierProjection"].empty())
+    {
+      storage["randomFourierProjection"] >> m_Projection;
+      storage["randomFourierOffsets"] >> m_Offsets;
+      if (m_Offsets.size() != static_cast< size_t >(m_Projection.rows))
+      {
+        m_Projection.release();
+        m_Offsets.clear();
+      }
+    }
+  }
+
+private:
+  cv::Mat m_Projection; //! [D x d] CV_32F, W with the standardization folded in
+  std::vector< float > m_Offsets; //! b with the standardization folded in
+};
@@ -0,0 +1,425 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+
+/**
+\brief The images of one subject
+*/
+struct SubjectFiles
+{
+  //! Images of a subject; Lesion is last because it holds the labels
+  enum FileType
+  {
+    T1,
+    T2,
+    FL,
+    PD,
+    Foreground,
+    Lesion,
+    NumberOfFileTypes
+  };
+
+  std::string id; //! subject ID, e.g., '301D00252-20040121'
+  std::string files[NumberOfFileTypes]; //! full file names, indexed by FileType; empty if missing
+
+  bool IsComplete() const
+  {
+    for (int i = 0; i < NumberOfFileTypes; i++)
+    {
+      if (files[i].empty())
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+/**
+\brief Index of the subjects and their images in a data directory
+
+The directory listing is parsed once: every image name is split into the subject ID and the file type
+('<id>.T1.*', '<id>.T2.*', '<id>.FL.*', '<id>.PD.*', '<id>.manual.*' and '<id>_foreground.*' or
+'<id>.foreground.*') and stored in a hash index by subject ID, so building the manifest is linear in the
+number of files. The manifest can be saved and loaded again, which skips the directory scan on reruns.
+*/
+class SubjectManifest
+{
+public:
+  /**
+  \brief Build the manifest from a directory listing
+
+  \param dirName Directory which contains the files; ends with '/'
+  \param fileNames Names of the files in the directory (without the path)
+
+  \return Number of files which could not be assigned to a subject
+  */
+  size_t Build(const std::string &dirName, const std::vector< std::string > &fileNames)
+  {
+    m_Subjects.clear();
+    m_Index.clear();
+    size_t unassigned = 0;
+    for (size_t i = 0; i < fileNames.size(); i++)
+    {
+      const std::string &name = fileNames[i];
+      if (!IsImageFile(name))
+      {
+        continue; // e.g., '.', '..', the subject list or a saved manifest
+      }
+      std::string id;
+      SubjectFiles::FileType type;
+      if (!ParseFileName(name, id, type))
+      {
+        std::cerr << "Skipping file with unsupported name '" << name << "'.\n";
+        unassigned++;
+        continue;
+      }
+      SubjectFiles &subject = this->GetOrAddSubject(id);
+      if (!subject.files[type].empty())
+      {
+        std::cerr << "Subject '" << id << "' has more than one " << TypeName(type) << " image; ignoring '" << name << "'.\n";
+        unassigned++;
+        continue;
+      }
+      subject.files[type] = dirName + name;
+    }
+
+    // directory listings come in no particular order; sort so that reruns see the subjects in the same order
+    std::sort(m_Subjects.begin(), m_Subjects.end(), [](const SubjectFiles &a, const SubjectFiles &b) { return a.id < b.id; });
+    this->RebuildIndex();
+    return unassigned;
+  }
+
+  /**
+  \brief Keep only the listed subjects, in the order of the list
+
+  \return IDs from the list which have no files at all
+  */
+  std::vector< std::string > Select(const std::vector< std::string > &ids)
+  {
+    std::vector< SubjectFiles > selected;
+    std::vector< std::string > missing;
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+      std::unordered_map< std::string, size_t >::const_iterator found = m_Index.find(ids[i]);
+      if (found == m_Index.end())
+      {
+        missing.push_back(ids[i]);
+      }
+      else
+      {
+        selected.push_back(m_Subjects[found->second]);
+      }
+    }
+    m_Subjects.swap(selected);
+    this->RebuildIndex();
+    return missing;
+  }
+
+  /**
+  \brief Remove subjects which miss at least one image and report what is missing
+
+  \return Number of removed subjects
+  */
+  size_t RemoveIncomplete()
+  {
+    std::vector< SubjectFiles > complete;
+    for (size_t i = 0; i < m_Subjects.size(); i++)
+    {
+      if (m_Subjects[i].IsComplete())
+      {
+        complete.push_back(m_Subjects[i]);
+        continue;
+      }
+      std::cerr << "Subject '" << m_Subjects[i].id << "' is incomplete, missing:";
+      for (int type = 0; type < SubjectFiles::NumberOfFileTypes; type++)
+      {
+        if (m_Subjects[i].files[type].empty())
+        {
+          std::cerr << " " << TypeName(static_cast< SubjectFiles::FileType >(type));
+        }
+      }
+      std::cerr << "\n";
+    }
+    const size_t removed = m_Subjects.size() - complete.size();
+    m_Subjects.swap(complete);
+    this->RebuildIndex();
+    return removed;
+  }
+
+  /**
+  \brief Write the manifest as CSV: a header and one 'id,T1,T2,FL,PD,foreground,manual' line per subject
+
+  Fields with commas, quotes or line breaks are quoted, see QuoteField().
+  */
+  bool Save(const std::string &fileName) const
+  {
+    std::ofstream outfile(fileName.c_str());
+    if (!outfile.is_open())
+    {
+      return false;
+    }
+    outfile << "id";
+    for (int type = 0; type < SubjectFiles::NumberOfFileTypes; type++)
+    {
+      outfile << "," << TypeName(static_cast< SubjectFiles::FileType >(type));
+    }
+    outfile << "\n";
+    for (size_t i = 0; i < m_Subjects.size(); i++)
+    {
+      outfile << QuoteField(m_Subjects[i].id);
+      for (int type = 0; type < SubjectFiles::NumberOfFileTypes; type++)
+      {
+        outfile << "," << QuoteField(m_Subjects[i].files[type]);
+      }
+      outfile << "\n";
+    }
+    return static_cast< bool >(outfile);
+  }
+
+  /**
+  \brief Read a manifest written by Save()
+
+  \return False if the file is no manifest, or if a file it lists no longer exists; the data directory then
+  has to be scanned again
+  */
+  bool Load(const std::string &fileName)
+  {
+    std::ifstream infile(fileName.c_str());
+    std::string line;
+    if (!std::getline(infile, line) || (line.compare(0, 3, "id,") != 0))
+    {
+      return false;
+    }
+    m_Subjects.clear();
+    while (std::getline(infile, line))
+    {
+      if (!line.empty() && (line[line.length() - 1] == '\r'))
+      {
+        line.erase(line.length() - 1);
+      }
+      if (line.empty())
+      {
+        continue;
+      }
+      std::vector< std::string > fields;
+      if (!SplitFields(line, fields) || (fields.size() != SubjectFiles::NumberOfFileTypes + 1))
+      {
+        std::cerr << "Manifest '" << fileName << "' has a malformed line: " << line << "\n";
+        m_Subjects.clear();
+        return false;
+      }
+      SubjectFiles subject;
+      subject.id = fields[0];
+      for (int type = 0; type < SubjectFiles::NumberOfFileTypes; type++)
+      {
+        subject.files[type] = fields[type + 1];
+        struct stat status;
+        if (!subject.files[type].empty() && (stat(subject.files[type].c_str(), &status) != 0))
+        {
+          std::cerr << "Manifest '" << fileName << "' lists '" << subject.files[type] << "', which does not exist.\n";
+          m_Subjects.clear();
+          return false;
+        }
+      }
+      m_Subjects.push_back(subject);
+    }
+    this->RebuildIndex();
+    return true;
+  }
+
+  const std::vector< SubjectFiles > &GetSubjects() const
+  {
+    return m_Subjects;
+  }
+
+  //! Subject with the given ID, or NULL
+  const SubjectFiles *FindSubject(const std::string &id) const
+  {
+    std::unordered_map< std::string, size_t >::const_iterator found = m_Index.find(id);
+    return (found == m_Index.end()) ? NULL : &m_Subjects[found->second];
+  }
+
+  static const char *TypeName(SubjectFiles::FileType type)
+  {
+    static const char *names[SubjectFiles::NumberOfFileTypes] = { "T1", "T2", "FL", "PD", "foreground", "manual" };
+    return names[type];
+  }
+
+  //! Names of the files in a directory (without the path); empty if it cannot be read
+  static std::vector< std::string > ListDirectory(const std::string &dirName)
+  {
+    std::vector< std::string > names;
+#if defined(_WIN32)
+    WIN32_FIND_DATAA found;
+    HANDLE search = FindFirstFileA((dirName + "/*").c_str(), &found);
+    if (search != INVALID_HANDLE_VALUE)
+    {
+      do
+      {
+        if (!(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+        {
+          names.push_back(found.cFileName);
+        }
+      } while (FindNextFileA(search, &found));
+      FindClose(search);
+    }
+#else
+    DIR *directory = opendir(dirName.c_str());
+    if (directory)
+    {
+      for (struct dirent *entry = readdir(directory); entry != NULL; entry = readdir(directory))
+      {
+        names.push_back(entry->d_name); // '.' and '..' are skipped by Build() as they are no images
+      }
+      closedir(directory);
+    }
+#endif
+    return names;
+  }
+
+  //! A CSV field; quoted, with quotes doubled, if it contains a comma, a quote or a line break
+  static std::string QuoteField(const std::string &field)
+  {
+    if (field.find_first_of(",\"\r\n") == std::string::npos)
+    {
+      return field;
+    }
+    std::string quoted = "\"";
+    for (size_t i = 0; i < field.length(); i++)
+    {
+      quoted += field[i];
+      if (field[i] == '"')
+      {
+        quoted += '"';
+      }
+    }
+    return quoted + "\"";
+  }
+
+  /**
+  \brief Split a CSV line written with QuoteField() into its fields
+
+  \return False if a quoted field is not closed, e.g., because it spans lines
+  */
+  static bool SplitFields(const std::string &line, std::vector< std::string > &fields)
+  {
+    fields.assign(1, std::string());
+    bool quoted = false;
+    for (size_t i = 0; i < line.length(); i++)
+    {
+      const char c = line[i];
+      if (quoted)
+      {
+        if ((c == '"') && (i + 1 < line.length()) && (line[i + 1] == '"'))
+        {
+          fields.back() += '"';
+          i++;
+        }
+        else if (c == '"')
+        {
+          quoted = false;
+        }
+        else
+        {
+          fields.back() += c;
+        }
+      }
+      else if ((c == '"') && fields.back().empty())
+      {
+        quoted = true;
+      }
+      else if (c == ',')
+      {
+        fields.push_back(std::string());
+      }
+      else
+      {
+        fields.back() += c;
+      }
+    }
+    return !quoted;
+  }
+
+  //! True for the image extensions ITK can read in this tutorial
+  static bool IsImageFile(const std::string &name)
+  {
+    const std::string extensions[] = { ".nii.gz", ".nii", ".nrrd", ".mha", ".mhd" };
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++)
+    {
+      const std::string &ext = extensions[i];
+      if ((name.length() > ext.length()) && (name.compare(name.length() - ext.length(), ext.length(), ext) == 0))
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+  \brief Split an image name into subject ID and file type
+
+  The type is the first '.' or '_' separated token after the ID which is a known type name; the ID is
+  everything before it.
+
+  \return False if the name contains no known type
+  */
+  static bool ParseFileName(const std::string &name, std::string &id, SubjectFiles::FileType &type)
+  {
+    for (size_t begin = name.find_first_of("._"); begin != std::string::npos; begin = name.find_first_of("._", begin + 1))
+    {
+      const size_t end = std::min(name.find_first_of("._", begin + 1), name.length());
+      const std::string token = name.substr(begin + 1, end - begin - 1);
+      for (int t = 0; t < SubjectFiles::NumberOfFileTypes; t++)
+      {
+        if ((begin > 0) && (token == TypeName(static_cast< SubjectFiles::FileType >(t))))
+        {
+          id = name.substr(0, begin);
+          type = static_cast< SubjectFiles::FileType >(t);
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+private:
+  SubjectFiles &GetOrAddSubject(const std::string &id)
+  {
+    std::unordered_map< std::string, size_t >::const_iterator found = m_Index.find(id);
+    if (found != m_Index.end())
+    {
+      return m_Subjects[found->second];
+    }
+    m_Index[id] = m_Subjects.size();
+    m_Subjects.push_back(SubjectFiles());
+    m_Subjects.back().id = id;
+    return m_Subjects.back();
+  }
+
+  void RebuildIndex()
+  {
+    m_Index.clear();
+    for (size_t i = 0; i < m_Subjects.size(); i++)
+    {
+      m_Index[m_Subjects[i].id] = i;
+    }
+  }
+
+  std::vector< SubjectFiles > m_Subjects; //! sorted by ID, or in the order of the subject list after Select()
+  std::unordered_map< std::string, size_t > m_Index; //! subject ID -> position in m_Subjects
+};
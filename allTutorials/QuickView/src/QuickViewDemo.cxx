@@ -1,13 +1,243 @@
 #include "itkImage.h"
 #include "itkImageFileReader.h"
 #include "itkRescaleIntensityImageFilter.h"
- 
+#include "itkShrinkImageFilter.h"
+#include "itkStreamingImageFilter.h"
+#include "itkMinimumMaximumImageCalculator.h"
+#include "itkIntensityWindowingImageFilter.h"
+#include "itkImageToVTKImageFilter.h"
+#include "itkNumericTraits.h"
+
 #include "QuickView.h"
  
+#include "vtkVersion.h"
+#include "vtkSmartPointer.h"
+#include "vtkCommand.h"
+#include "vtkCamera.h"
+#include "vtkImageActor.h"
+#include "vtkRenderer.h"
+#include "vtkRenderWindow.h"
+#include "vtkRenderWindowInteractor.h"
+#include "vtkInteractorStyleImage.h"
+
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
 typedef itk::Image<unsigned char, 2>  ImageType;
+typedef itk::ImageToVTKImageFilter<ImageType> ConnectorType;
  
 static void CreateImage(ImageType* const image);
- 
+
+typedef itk::ImageFileReader<ImageType> ReaderType;
+
+static const unsigned int PreviewSize = 512; // longest side of the coarse level, in pixels
+static const unsigned int StreamDivisions = 16; // slabs the file is read in for the coarse level
+
+/**
+\brief Coarse level of the pyramid: every n-th pixel along every axis, with n chosen so the longest side is at most maxSize
+
+The file is streamed through the shrink filter in StreamDivisions slabs, so only one slab of it is held at a time
+if its ImageIO can stream (e.g., MetaImage or NRRD); other formats are read whole for this pass. The shrunk image
+keeps the physical extent of the input (its spacing grows by n), so it is displayed in place of it.
+*/
+static ImageType::Pointer CoarseLevel(const std::string &fileName, unsigned int maxSize)
+{
+  ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName(fileName);
+  reader->UpdateOutputInformation();
+  const ImageType::SizeType size = reader->GetOutput()->GetLargestPossibleRegion().GetSize();
+
+  typedef itk::ShrinkImageFilter<ImageType, ImageType> ShrinkFilterType;
+  ShrinkFilterType::Pointer shrinkFilter = ShrinkFilterType::New();
+  shrinkFilter->SetInput(reader->GetOutput());
+  for (unsigned int d = 0; d < ImageType::ImageDimension; d++)
+  {
+    shrinkFilter->SetShrinkFactor(d, static_cast<unsigned int>(std::max<itk::SizeValueType>(1, (size[d] + maxSize - 1) / maxSize)));
+  }
+  typedef itk::StreamingImageFilter<ImageType, ImageType> StreamingFilterType;
+  StreamingFilterType::Pointer streamingFilter = StreamingFilterType::New();
+  streamingFilter->SetInput(shrinkFilter->GetOutput());
+  streamingFilter->SetNumberOfStreamDivisions(StreamDivisions);
+  streamingFilter->Update();
+  return streamingFilter->GetOutput();
+}
+
+/**
+\brief Stretch [minimum, maximum] of image to [0, 255]; what RescaleIntensityImageFilter does, without its statistics pass
+*/
+static ImageType::Pointer WindowIntensities(ImageType* const image, ImageType::PixelType minimum, ImageType::PixelType maximum)
+{
+  if (!(maximum > minimum)) // a constant image has no range to stretch; widen it by one step
+  {
+    if (maximum < itk::NumericTraits<ImageType::PixelType>::max())
+    {
+      maximum = maximum + 1;
+    }
+    else
+    {
+      minimum = minimum - 1;
+    }
+  }
+  typedef itk::IntensityWindowingImageFilter<ImageType, ImageType> WindowFilterType;
+  WindowFilterType::Pointer windowFilter = WindowFilterType::New();
+  windowFilter->SetInput(image);
+  windowFilter->SetWindowMinimum(minimum);
+  windowFilter->SetWindowMaximum(maximum);
+  windowFilter->SetOutputMinimum(0);
+  windowFilter->SetOutputMaximum(255);
+  windowFilter->Update();
+  return windowFilter->GetOutput();
+}
+
+/**
+\brief Timer callback of ProgressiveView(): swaps the coarse level for the full resolution level once it is ready
+
+If the refinement failed, the timer is destroyed and the coarse level stays on screen.
+*/
+class RefinementCallback : public vtkCommand
+{
+public:
+  static RefinementCallback *New()
+  {
+    return new RefinementCallback;
+  }
+
+  void Set(const std::atomic<bool> *ready, const std::atomic<bool> *failed, const ImageType::Pointer *fullLevel,
+    vtkImageActor *actor, int timerId)
+  {
+    m_Ready = ready;
+    m_Failed = failed;
+    m_FullLevel = fullLevel;
+    m_Actor = actor;
+    m_TimerId = timerId;
+  }
+
+  virtual void Execute(vtkObject *caller, unsigned long eventId, void *)
+  {
+    if ((eventId != vtkCommand::TimerEvent) || m_Stopped)
+    {
+      return;
+    }
+    vtkRenderWindowInteractor *interactor = static_cast<vtkRenderWindowInteractor *>(caller);
+    if (m_Failed->load())
+    {
+      interactor->DestroyTimer(m_TimerId);
+      m_Stopped = true;
+      return;
+    }
+    if (!m_Ready->load())
+    {
+      return;
+    }
+    m_Connector = ConnectorType::New(); // kept alive as long as the actor shows its output
+    m_Connector->SetInput(*m_FullLevel);
+    m_Connector->Update();
+#if VTK_MAJOR_VERSION <= 5
+    m_Actor->SetInput(m_Connector->GetOutput());
+#else
+    m_Actor->SetInputData(m_Connector->GetOutput());
+#endif
+    interactor->DestroyTimer(m_TimerId);
+    m_Stopped = true;
+    interactor->Render();
+  }
+
+private:
+  RefinementCallback() :
+    m_Ready(NULL), m_Failed(NULL), m_FullLevel(NULL), m_Actor(NULL), m_TimerId(0), m_Stopped(false)
+  {
+  }
+
+  const std::atomic<bool> *m_Ready;
+  const std::atomic<bool> *m_Failed;
+  const ImageType::Pointer *m_FullLevel;
+  vtkImageActor *m_Actor;
+  int m_TimerId;
+  bool m_Stopped; //! the timer is destroyed
+  ConnectorType::Pointer m_Connector;
+};
+
+/**
+\brief Show a 2-D unsigned char image file coarse level first and refine it to full resolution in the background
+
+The coarse level is streamed from the file with CoarseLevel() and the intensity range is computed on it only, so
+the first image appears after one pass over the file without holding all of it. The full resolution level is
+read and windowed with the same range on a worker thread; a repeating VTK timer polls it and swaps it in, while
+the window stays interactive.
+*/
+static void ProgressiveView(const std::string &fileName)
+{
+  ImageType::Pointer coarse = CoarseLevel(fileName, PreviewSize);
+
+  typedef itk::MinimumMaximumImageCalculator<ImageType> CalculatorType;
+  CalculatorType::Pointer calculator = CalculatorType::New();
+  calculator->SetImage(coarse);
+  calculator->Compute();
+  const ImageType::PixelType minimum = calculator->GetMinimum(), maximum = calculator->GetMaximum();
+  ImageType::Pointer coarseLevel = WindowIntensities(coarse, minimum, maximum);
+
+  // refine while the coarse level is on screen
+  ImageType::Pointer fullLevel;
+  std::atomic<bool> ready(false), failed(false);
+  std::thread refinement([&]()
+  {
+    try
+    {
+      ReaderType::Pointer reader = ReaderType::New();
+      reader->SetFileName(fileName);
+      reader->Update();
+      fullLevel = WindowIntensities(reader->GetOutput(), minimum, maximum);
+      ready.store(true);
+    }
+    catch (itk::ExceptionObject &e) // the coarse level stays on screen
+    {
+      std::cerr << "Full resolution failed: " << e << "\n";
+      failed.store(true);
+    }
+    catch (std::exception &e) // e.g., std::bad_alloc: the very files shown progressively may not fit in memory
+    {
+      std::cerr << "Full resolution failed: " << e.what() << "\n";
+      failed.store(true);
+    }
+  });
+
+  ConnectorType::Pointer connector = ConnectorType::New();
+  connector->SetInput(coarseLevel);
+  connector->Update();
+  vtkSmartPointer<vtkImageActor> actor = vtkSmartPointer<vtkImageActor>::New();
+#if VTK_MAJOR_VERSION <= 5
+  actor->SetInput(connector->GetOutput());
+#else
+  actor->SetInputData(connector->GetOutput());
+#endif
+
+  vtkSmartPointer<vtkRenderer> renderer = vtkSmartPointer<vtkRenderer>::New();
+  renderer->AddActor(actor);
+  vtkCamera *camera = renderer->GetActiveCamera();
+  camera->ParallelProjectionOn();
+  camera->SetPosition(0, 0, -1); // first row at the top, like QuickView
+  camera->SetFocalPoint(0, 0, 0);
+  camera->SetViewUp(0, -1, 0);
+  renderer->ResetCamera();
+
+  vtkSmartPointer<vtkRenderWindow> renderWindow = vtkSmartPointer<vtkRenderWindow>::New();
+  renderWindow->AddRenderer(renderer);
+  renderWindow->SetSize(600, 600);
+  vtkSmartPointer<vtkRenderWindowInteractor> interactor = vtkSmartPointer<vtkRenderWindowInteractor>::New();
+  interactor->SetRenderWindow(renderWindow);
+  interactor->SetInteractorStyle(vtkSmartPointer<vtkInteractorStyleImage>::New());
+  interactor->Initialize();
+  renderWindow->Render();
+
+  vtkSmartPointer<RefinementCallback> callback = vtkSmartPointer<RefinementCallback>::New();
+  callback->Set(&ready, &failed, &fullLevel, actor, interactor->CreateRepeatingTimer(100));
+  interactor->AddObserver(vtkCommand::TimerEvent, callback);
+  interactor->Start();
+
+  refinement.join();
+}
+
 int main(int argc, char *argv[])
 {
   ImageType::Pointer image;
@@ -21,11 +251,11 @@ int main(int argc, char *argv[])
     }
   else
   {
-    typedef itk::ImageFileReader<ImageType> ReaderType;
-    ReaderType::Pointer reader = ReaderType::New();
-    reader->SetFileName(argv[1]);
     std::cout << argv[1] << std::endl;
-    image = reader->GetOutput();
+ 
+    // files may be large: they are streamed to a coarse level first and refined in the background, see ProgressiveView()
+    ProgressiveView(argv[1]);
+    return EXIT_SUCCESS;
   }
  
   typedef itk::RescaleIntensityImageFilter< ImageType, ImageType > RescaleFilterType;